@@ -94,7 +94,8 @@ isr_handler(registers_t *regs)
 			uint64_t fault_addr;
 			__asm__ volatile("mov %%cr2, %0" : "=r"(fault_addr));
 
-			mmu_handle_page_fault(fault_addr, regs->err_code);
+			if (mmu_handle_page_fault(fault_addr, regs->err_code))
+				return;
 
 			char pf_msg[256];
 			char *p = pf_msg;
@@ -3,6 +3,7 @@
 #include <pit.h>
 #include <isr.h>
 #include <pmm.h>
+#include <mempool.h>
 #include <paging.h>
 #include <kmalloc.h>
 #include <string.h>
@@ -34,9 +35,10 @@ typedef struct {
 
 static scheduler_data_t scheduler;
 
+#define IDLE_ZERO_BATCH 8 /* Pages zeroed per idle loop iteration */
+
 static void scheduler_switch_to_next(void);
 static struct proc *scheduler_pick_next_task(void);
-static void idle_task_entry(void);
 static void scheduler_timer_handler(registers_t *regs);
 
 static inline task_priority_t
@@ -93,7 +95,9 @@ scheduler_init(uint32_t timer_frequency)
 	if (scheduler.idle_process) {
 		scheduler.idle_task =
 		    proc_alloc(scheduler.idle_process, "idle");
+		scheduler.idle_process->ps_flags |= PS_SYSTEM;
 		if (scheduler.idle_task) {
+			scheduler.idle_task->p_flag |= P_SYSTEM;
 			proc_set_priority(scheduler.idle_task,
 			                  TASK_PRIORITY_IDLE);
 		}
@@ -127,6 +131,11 @@ scheduler_create_task(const char *name,
 
 	proc_set_priority(p, priority);
 
+	if (is_kernel) {
+		ps->ps_flags |= PS_SYSTEM;
+		p->p_flag |= P_SYSTEM;
+	}
+
 	/* Store entry point in machine-dependent structure */
 	/* This would need to be stored in trapframe or similar */
 	/* For now, we'll assume the entry point gets set elsewhere */
@@ -300,10 +309,9 @@ scheduler_start(void)
 		first_task->p_stat = SONPROC;
 		scheduler.stats.running_tasks = 1;
 
-		if (first_task->p_vmspace) {
-			/* Load CR3 with physical address */
-			uint64_t cr3 = first_task->p_vmspace->phys_addr;
-			__asm__ volatile("movq %0, %%cr3" : : "r"(cr3));
+		if (first_task->p_vmspace &&
+		    !(first_task->p_flag & P_SYSTEM)) {
+			mmu_switch_address_space(first_task->p_vmspace);
 		}
 
 		/* Context switch would happen here */
@@ -525,9 +533,25 @@ scheduler_switch_to_next(void)
 	proc_set_current(new_task);
 	scheduler.stats.context_switches++;
 
-	if (new_task->p_vmspace) {
-		uint64_t cr3 = new_task->p_vmspace->phys_addr;
-		__asm__ volatile("movq %0, %%cr3" : : "r"(cr3));
+	/*
+	 * scheduler_switch_context() loads CR3 from the saved state, so
+	 * store the ASID-tagged value there rather than the raw CR3 it saved.
+	 * Kernel threads never touch the user half: they borrow whatever is
+	 * loaded, and the switch skips the CR3 write when it is unchanged.
+	 */
+	page_directory_t *new_pd = new_task->p_vmspace;
+	if (new_pd == NULL || (new_task->p_flag & P_SYSTEM)) {
+		new_pd = mmu_get_current_address_space();
+	}
+	if (new_pd == NULL) {
+		new_pd = mmu_get_kernel_address_space();
+	}
+	uint64_t new_cr3 = mmu_activate(new_pd);
+
+	if (new_task->p_md.md_cpu_state) {
+		((cpu_state_t *)new_task->p_md.md_cpu_state)->cr3 = new_cr3;
+	} else {
+		__asm__ volatile("movq %0, %%cr3" : : "r"(new_cr3) : "memory");
 	}
 
 	if (old_task && old_task->p_md.md_cpu_state &&
@@ -574,11 +598,22 @@ scheduler_pick_next_task(void)
 	return NULL;
 }
 
-static void
-idle_task_entry(void)
+/*
+ * Body of the idle task.  The idle proc has no context of its own, so
+ * kmain() ends here and the boot thread runs the loop for it.
+ */
+void
+scheduler_idle(void)
 {
 	while (1) {
-		__asm__ volatile("hlt");
+		if (mempool_refill_pending) {
+			mempool_refill();
+		}
+
+		/* Zero frames for pmm_alloc_zeroed() while there is time */
+		if (pmm_refill_zero_pool(IDLE_ZERO_BATCH) == 0) {
+			__asm__ volatile("hlt");
+		}
 	}
 }
 
@@ -65,8 +65,6 @@ sys_exit(int status)
 	}
 
 	struct process *ps = p->p_p;
-	struct limine_hhdm_response *hhdm = boot_get_hhdm();
-	uint64_t hhdm_offset = hhdm ? hhdm->offset : 0;
 
 	/* Free user space memory */
 	if (ps->ps_vmspace) {
@@ -74,16 +72,10 @@ sys_exit(int status)
 		uint64_t end = ps->ps_brk;
 
 		if (end > start) {
-			uint64_t current_page = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-			while (current_page < end) {
-				uint64_t phys_addr = mmu_get_physical_address(ps->ps_vmspace, current_page);
-				if (phys_addr != 0) {
-					paging_unmap_range(ps->ps_vmspace, current_page, 1);
-					void *page_virt = (void *)(phys_addr + hhdm_offset);
-					pmm_free(page_virt);
-				}
-				current_page += PAGE_SIZE;
-			}
+			uint64_t start_page = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+			size_t num_pages = (end - start_page + PAGE_SIZE - 1) / PAGE_SIZE;
+
+			paging_unmap_free_range(ps->ps_vmspace, start_page, num_pages);
 		}
 	}
 
@@ -147,67 +139,12 @@ sys_fork(syscall_registers_t *regs)
 	LIST_INSERT_HEAD(&parent_ps->ps_children, child_ps, ps_sibling);
 	spinlock_release_irqrestore(&parent_ps->ps_lock, lock_flags);
 
-	/* Copy address space */
-	struct limine_hhdm_response *hhdm = boot_get_hhdm();
-	uint64_t hhdm_offset = hhdm ? hhdm->offset : 0;
-	pml4e_t *parent_pml4 = parent_ps->ps_vmspace->pml4;
-	uint64_t pages_copied = 0;
-
-	for (int pml4_idx = 0; pml4_idx < 256; pml4_idx++) {
-		if (!(parent_pml4[pml4_idx] & PAGE_PRESENT))
-			continue;
-
-		uint64_t pdpt_phys = parent_pml4[pml4_idx] & PAGE_ADDR_MASK;
-		pdpte_t *pdpt = (pdpte_t *)mmu_phys_to_virt(pdpt_phys);
-
-		for (int pdpt_idx = 0; pdpt_idx < 512; pdpt_idx++) {
-			if (!(pdpt[pdpt_idx] & PAGE_PRESENT) || (pdpt[pdpt_idx] & PAGE_HUGE))
-				continue;
-
-			uint64_t pd_phys = pdpt[pdpt_idx] & PAGE_ADDR_MASK;
-			pde_t *pd_table = (pde_t *)mmu_phys_to_virt(pd_phys);
-
-			for (int pd_idx = 0; pd_idx < 512; pd_idx++) {
-				if (!(pd_table[pd_idx] & PAGE_PRESENT) || (pd_table[pd_idx] & PAGE_HUGE))
-					continue;
-
-				uint64_t pt_phys = pd_table[pd_idx] & PAGE_ADDR_MASK;
-				pte_t *pt = (pte_t *)mmu_phys_to_virt(pt_phys);
-
-				for (int pt_idx = 0; pt_idx < 512; pt_idx++) {
-					if (!(pt[pt_idx] & PAGE_PRESENT))
-						continue;
-
-					uint64_t src_phys = pt[pt_idx] & PAGE_ADDR_MASK;
-					uint64_t flags = pt[pt_idx] & ~PAGE_ADDR_MASK;
-
-					void *new_page = pmm_alloc();
-					if (!new_page) {
-						proc_free(child_proc);
-						process_free(child_ps);
-						return -ENOMEM;
-					}
-
-					void *src_page = (void *)(src_phys + hhdm_offset);
-					memcpy(new_page, src_page, PAGE_SIZE);
-
-					uint64_t new_phys = (uint64_t)new_page - hhdm_offset;
-					uint64_t virt = ((uint64_t)pml4_idx << PML4_SHIFT) |
-					                ((uint64_t)pdpt_idx << PDPT_SHIFT) |
-					                ((uint64_t)pd_idx << PD_SHIFT) |
-					                ((uint64_t)pt_idx << PT_SHIFT);
-
-					if (!mmu_map_page(child_ps->ps_vmspace, virt, new_phys, flags)) {
-						pmm_free(new_page);
-						proc_free(child_proc);
-						process_free(child_ps);
-						return -ENOMEM;
-					}
-
-					pages_copied++;
-				}
-			}
-		}
+	/* Share the address space copy-on-write; only page tables are copied */
+	if (!paging_copy_user_pages(child_ps->ps_vmspace, parent_ps->ps_vmspace) ||
+	    !vmm_copy_regions(child_ps->ps_vm, parent_ps->ps_vm)) {
+		proc_free(child_proc);
+		process_free(child_ps);
+		return -ENOMEM;
 	}
 
 	/* Copy brk and flags */
@@ -1375,24 +1312,30 @@ sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 		return (void *)(intptr_t)-EINVAL;
 
 	size_t aligned_length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-	size_t num_pages = aligned_length / PAGE_SIZE;
 	uint64_t virt_addr;
 
 	if (flags & MAP_FIXED) {
 		if (!is_user_address(addr))
 			return (void *)(intptr_t)-EINVAL;
 		virt_addr = (uint64_t)addr & ~(PAGE_SIZE - 1);
+
+		/* A fixed mapping replaces whatever was there */
+		vmm_release_range(ps->ps_vm, virt_addr, aligned_length);
 	} else {
-		uint64_t lock_flags;
-		spinlock_acquire_irqsave(&ps->ps_lock, &lock_flags);
-		virt_addr = (ps->ps_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-		spinlock_release_irqrestore(&ps->ps_lock, lock_flags);
+		uint64_t hint = (uint64_t)addr & ~(PAGE_SIZE - 1);
+		uint64_t limit = USER_STACK_TOP - PROCESS_USER_STACK_SIZE;
+
+		/* Take the hint if it is free, otherwise the first hole that fits */
+		if (addr != NULL && is_user_address(addr) &&
+		    hint + aligned_length <= limit &&
+		    vmm_range_is_free(ps->ps_vm, hint, aligned_length))
+			virt_addr = hint;
+		else
+			virt_addr = vmm_find_gap(ps->ps_vm, aligned_length,
+			                         VMM_USER_MMAP_BASE, limit);
 
-		if (addr != NULL && is_user_address(addr)) {
-			uint64_t hint = (uint64_t)addr & ~(PAGE_SIZE - 1);
-			if (hint >= virt_addr)
-				virt_addr = hint;
-		}
+		if (virt_addr == 0)
+			return (void *)(intptr_t)-ENOMEM;
 	}
 
 	uint64_t page_flags = PAGE_PRESENT | PAGE_USER;
@@ -1401,49 +1344,10 @@ sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 	if (!(prot & PROT_EXEC))
 		page_flags |= PAGE_NX;
 
-	struct limine_hhdm_response *hhdm = boot_get_hhdm();
-	uint64_t hhdm_offset = hhdm ? hhdm->offset : 0;
-
-	for (size_t i = 0; i < num_pages; i++) {
-		uint64_t virt_page = virt_addr + (i * PAGE_SIZE);
-
-		void *page_virt = pmm_alloc();
-		if (!page_virt) {
-			/* Cleanup */
-			for (size_t j = 0; j < i; j++) {
-				uint64_t cleanup_virt = virt_addr + (j * PAGE_SIZE);
-				uint64_t phys = mmu_get_physical_address(ps->ps_vmspace, cleanup_virt);
-				if (phys != 0) {
-					paging_unmap_range(ps->ps_vmspace, cleanup_virt, 1);
-					pmm_free((void *)(phys + hhdm_offset));
-				}
-			}
-			return (void *)(intptr_t)-ENOMEM;
-		}
-
-		memset(page_virt, 0, PAGE_SIZE);
-		uint64_t phys_page = (uint64_t)page_virt - hhdm_offset;
-
-		if (!paging_map_range(ps->ps_vmspace, virt_page, phys_page, 1, page_flags)) {
-			pmm_free(page_virt);
-			/* Cleanup */
-			for (size_t j = 0; j < i; j++) {
-				uint64_t cleanup_virt = virt_addr + (j * PAGE_SIZE);
-				uint64_t phys = mmu_get_physical_address(ps->ps_vmspace, cleanup_virt);
-				if (phys != 0) {
-					paging_unmap_range(ps->ps_vmspace, cleanup_virt, 1);
-					pmm_free((void *)(phys + hhdm_offset));
-				}
-			}
-			return (void *)(intptr_t)-ENOMEM;
-		}
-	}
-
-	uint64_t lock_flags;
-	spinlock_acquire_irqsave(&ps->ps_lock, &lock_flags);
-	if (virt_addr + aligned_length > ps->ps_brk)
-		ps->ps_brk = virt_addr + aligned_length;
-	spinlock_release_irqrestore(&ps->ps_lock, lock_flags);
+	/* Only the range is reserved, pages are faulted in on first touch */
+	if (!vmm_reserve_region(ps->ps_vm, virt_addr, aligned_length,
+	                        VMM_REGION_USER_DATA, page_flags))
+		return (void *)(intptr_t)-ENOMEM;
 
 	return (void *)virt_addr;
 }
@@ -1461,22 +1365,9 @@ sys_munmap(void *addr, size_t length)
 	struct process *ps = p->p_p;
 	uint64_t virt_addr = (uint64_t)addr & ~(PAGE_SIZE - 1);
 	size_t aligned_length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-	size_t num_pages = aligned_length / PAGE_SIZE;
-
-	struct limine_hhdm_response *hhdm = boot_get_hhdm();
-	uint64_t hhdm_offset = hhdm ? hhdm->offset : 0;
 
-	for (size_t i = 0; i < num_pages; i++) {
-		uint64_t virt_page = virt_addr + (i * PAGE_SIZE);
-		uint64_t phys_addr = mmu_get_physical_address(ps->ps_vmspace, virt_page);
-
-		paging_unmap_range(ps->ps_vmspace, virt_page, 1);
-
-		if (phys_addr != 0) {
-			void *page_virt = (void *)(phys_addr + hhdm_offset);
-			pmm_free(page_virt);
-		}
-	}
+	if (!vmm_release_range(ps->ps_vm, virt_addr, aligned_length))
+		return -ENOMEM;
 
 	return 0;
 }
@@ -1493,7 +1384,6 @@ sys_mprotect(void *addr, size_t len, int prot)
 
 	uint64_t virt_addr = (uint64_t)addr & ~(PAGE_SIZE - 1);
 	size_t aligned_length = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-	size_t num_pages = aligned_length / PAGE_SIZE;
 
 	uint64_t page_flags = PAGE_PRESENT | PAGE_USER;
 	if (prot & PROT_WRITE)
@@ -1501,7 +1391,7 @@ sys_mprotect(void *addr, size_t len, int prot)
 	if (!(prot & PROT_EXEC))
 		page_flags |= PAGE_NX;
 
-	if (!paging_protect_range(p->p_p->ps_vmspace, virt_addr, num_pages, page_flags))
+	if (!vmm_protect_region(p->p_p->ps_vm, virt_addr, aligned_length, page_flags))
 		return -ENOMEM;
 
 	return 0;
@@ -1546,52 +1436,18 @@ sys_brk(void *addr)
 
 	spinlock_release_irqrestore(&ps->ps_lock, lock_flags);
 
-	struct limine_hhdm_response *hhdm = boot_get_hhdm();
-	uint64_t hhdm_offset = hhdm ? hhdm->offset : 0;
-
-	if (new_brk > old_brk) {
-		/* Expand */
-		uint64_t old_page = (old_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-		uint64_t new_page = (new_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-
-		uint64_t current_page = old_page;
-		while (current_page < new_page) {
-			uint64_t phys_addr = mmu_get_physical_address(ps->ps_vmspace, current_page);
-
-			if (phys_addr == 0) {
-				void *page_virt = pmm_alloc();
-				if (!page_virt)
-					return -ENOMEM;
-
-				memset(page_virt, 0, PAGE_SIZE);
-				uint64_t phys_page = (uint64_t)page_virt - hhdm_offset;
-
-				if (!paging_map_range(ps->ps_vmspace, current_page, phys_page, 1,
-				                      PAGE_PRESENT | PAGE_WRITE | PAGE_USER)) {
-					pmm_free(page_virt);
-					return -ENOMEM;
-				}
-			}
+	uint64_t old_page = (old_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	uint64_t new_page = (new_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
-			current_page += PAGE_SIZE;
-		}
-	} else {
+	if (new_page > old_page) {
+		/* Expand: reserve only, the heap is faulted in as it is used */
+		if (!vmm_reserve_region(ps->ps_vm, old_page, new_page - old_page,
+		                        VMM_REGION_USER_HEAP,
+		                        PAGE_PRESENT | PAGE_WRITE | PAGE_USER))
+			return -ENOMEM;
+	} else if (new_page < old_page) {
 		/* Shrink */
-		uint64_t new_page = (new_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-		uint64_t old_page = (old_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-
-		uint64_t current_page = new_page;
-		while (current_page < old_page) {
-			uint64_t phys_addr = mmu_get_physical_address(ps->ps_vmspace, current_page);
-
-			if (phys_addr != 0) {
-				paging_unmap_range(ps->ps_vmspace, current_page, 1);
-				void *page_virt = (void *)(phys_addr + hhdm_offset);
-				pmm_free(page_virt);
-			}
-
-			current_page += PAGE_SIZE;
-		}
+		vmm_release_range(ps->ps_vm, new_page, old_page - new_page);
 	}
 
 	spinlock_acquire_irqsave(&ps->ps_lock, &lock_flags);
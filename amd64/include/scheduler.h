@@ -67,6 +67,7 @@ void scheduler_yield(void);
 void scheduler_start(void);
 void scheduler_stop(void);
 void scheduler_tick(void);
+void scheduler_idle(void) __attribute__((noreturn));
 task_t *scheduler_get_current_task(void);
 task_t *scheduler_get_task_by_tid(uint32_t tid);
 
@@ -49,10 +49,11 @@ is_user_mapped(const void *addr)
 	if (!is_user_address(addr))
 		return false;
 
-	/* Check if page is actually mapped */
+	/* Check if page is actually mapped, or will be on first touch */
 	uint64_t phys =
 	    mmu_get_physical_address(p->p_p->ps_vmspace, (uint64_t)addr);
-	return (phys != 0);
+	return (phys != 0 ||
+	        vmm_find_region(p->p_p->ps_vm, (uint64_t)addr) != NULL);
 }
 
 static inline int
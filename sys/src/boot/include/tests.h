@@ -5,6 +5,8 @@
 #include <stdbool.h>
 
 void test_kmalloc(void);
+void test_slab_coloring(void);
+void test_zero_pool(void);
 void test_ahci(void);
 void test_rtc(void);
 bool userland_load_and_run(const void *elf_data,
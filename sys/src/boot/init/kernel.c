@@ -27,6 +27,7 @@
 #include <printf.h>
 #include <proc.h>
 #include <kmalloc.h>
+#include <mempool.h>
 #include <rtc.h>
 #include <boot.h>
 #include <tests.h>
@@ -65,6 +66,9 @@ initialize_memory(void)
 	kmalloc_init();
 	debug_success("kmalloc initialized");
 
+	mempool_init();
+	debug_success("mempool refill timer registered");
+
 	mmu_init(hhdm);
 	debug_success("MMU initialized");
 
@@ -160,6 +164,10 @@ initialize_cpu(cpu_info_t *cpu)
 		debug_error("FPU/FXSR not supported");
 	}
 
+	if (mmu_enable_pcid()) {
+		debug_success("PCID enabled");
+	}
+
 	debug_success("CPU detection complete");
 
 	if (debug_is_enabled()) {
@@ -223,6 +231,8 @@ static void
 run_tests(void)
 {
 	test_kmalloc();
+	test_slab_coloring();
+	test_zero_pool();
 	test_ahci();
 	test_rtc();
 
@@ -304,7 +314,5 @@ kmain(void)
 		serial_printf(DEBUG_PORT, "Awaiting input...\n");
 	}
 
-	for (;;) {
-		__asm__ volatile("hlt");
-	}
+	scheduler_idle();
 }
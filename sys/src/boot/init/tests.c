@@ -64,9 +64,156 @@ test_kmalloc(void)
 		kfree(zeroed);
 	}
 
+	void *aligned = kmalloc_flags(40, KMALLOC_CACHEALIGN);
+	if (aligned) {
+		if ((uintptr_t)aligned % KMEM_CACHE_LINE != 0) {
+			debug_error("KMALLOC_CACHEALIGN returned a misaligned "
+			            "object");
+		}
+		kfree(aligned);
+	}
+
 	debug_success("kmalloc tests passed");
 }
 
+#define COLOR_BENCH_SLABS 32
+#define COLOR_BENCH_PASSES 4096
+#define COLOR_BENCH_OBJSIZE 448
+
+static inline uint64_t
+rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* Cycles to read the first word of every object, many times over */
+static uint64_t
+color_bench_walk(void **objs, size_t count)
+{
+	volatile uint64_t sum = 0;
+	uint64_t start = rdtsc();
+
+	for (int pass = 0; pass < COLOR_BENCH_PASSES; pass++) {
+		for (size_t i = 0; i < count; i++) {
+			sum += *(volatile uint64_t *)objs[i];
+		}
+	}
+
+	return rdtsc() - start;
+}
+
+/*
+ * Walk the first object of each of COLOR_BENCH_SLABS slabs, as a lookup
+ * touching one hot field per vnode would.  Without coloring they all sit
+ * at the same page offset and fight over one set of each cache level; the
+ * baseline reproduces that layout with raw pages.
+ */
+void
+test_slab_coloring(void)
+{
+	kmem_cache_t *cache = kmem_cache_create(
+	    "bench-color", COLOR_BENCH_OBJSIZE, KMEM_CACHE_LINE, NULL, NULL);
+	if (cache == NULL) {
+		debug_error("Failed to create coloring benchmark cache");
+		return;
+	}
+
+	size_t per_slab = cache->objects_per_slab;
+	size_t total = COLOR_BENCH_SLABS * per_slab;
+	void **all = kmalloc(total * sizeof(void *));
+	void *colored[COLOR_BENCH_SLABS];
+	void *plain[COLOR_BENCH_SLABS];
+
+	if (all == NULL) {
+		kmem_cache_destroy(cache);
+		return;
+	}
+
+	/* Fresh slabs hand out objects lowest address first */
+	size_t allocated = 0;
+	for (; allocated < total; allocated++) {
+		all[allocated] = kmem_cache_alloc(cache, KMALLOC_ZERO);
+		if (all[allocated] == NULL) {
+			break;
+		}
+	}
+
+	size_t offset = (uintptr_t)all[0] & (PAGE_SIZE - 1);
+	size_t pages = 0;
+	for (; pages < COLOR_BENCH_SLABS && allocated == total; pages++) {
+		uint8_t *page = pmm_alloc_zeroed();
+		if (page == NULL) {
+			break;
+		}
+		colored[pages] = all[pages * per_slab];
+		plain[pages] = page + offset;
+	}
+
+	if (pages == COLOR_BENCH_SLABS) {
+		uint64_t plain_cycles = color_bench_walk(plain, pages);
+		uint64_t colored_cycles = color_bench_walk(colored, pages);
+
+		printf("Slab coloring: %u colors, %llu cycles uncolored, "
+		       "%llu cycles colored\n",
+		       cache->color_count,
+		       (unsigned long long)plain_cycles,
+		       (unsigned long long)colored_cycles);
+	} else {
+		debug_error("Out of memory in coloring benchmark");
+	}
+
+	for (size_t i = 0; i < pages; i++) {
+		pmm_free((uint8_t *)plain[i] - offset);
+	}
+	for (size_t i = 0; i < allocated; i++) {
+		kmem_cache_free(cache, all[i]);
+	}
+	kfree(all);
+	kmem_cache_destroy(cache);
+}
+
+/* Frames zeroed ahead of time by the idle loop serve pmm_alloc_zeroed() */
+void
+test_zero_pool(void)
+{
+	pmm_stats_t before, after;
+
+	pmm_refill_zero_pool(8);
+	pmm_get_stats(&before);
+	if (before.zeroed_pages == 0) {
+		printf("Zero pool empty, memory too low to fill it\n");
+		return;
+	}
+
+	uint8_t *page = pmm_alloc_zeroed();
+	pmm_get_stats(&after);
+	if (page == NULL) {
+		debug_error("pmm_alloc_zeroed failed");
+		return;
+	}
+
+	if (after.zero_pool_hits != before.zero_pool_hits + 1) {
+		debug_error("pmm_alloc_zeroed bypassed the zero pool");
+	}
+
+	for (size_t i = 0; i < PAGE_SIZE; i++) {
+		if (page[i] != 0) {
+			debug_error("Zero pool handed out a dirty frame");
+			break;
+		}
+	}
+	pmm_free(page);
+
+	printf("Zero pool: %llu hits, %llu misses, %llu frames ready\n",
+	       (unsigned long long)after.zero_pool_hits,
+	       (unsigned long long)after.zero_pool_misses,
+	       (unsigned long long)after.zeroed_pages);
+	debug_success("zero pool tests passed");
+}
+
 void
 test_ahci(void)
 {
@@ -5,6 +5,8 @@
 #include <sys/panic.h>
 #include <kmalloc.h>
 #include <kfree.h>
+#include <shrinker.h>
+#include <mempool.h>
 #include <string.h>
 
 static blk_device_t *blk_devices = NULL;
@@ -13,6 +15,17 @@ static spinlock_t blk_devices_lock = SPINLOCK_INITIALIZER("blk_devices");
 #define BLK_BUFFER_HASH_SIZE 256
 static blk_buffer_t *blk_buffer_hash[BLK_BUFFER_HASH_SIZE];
 static spinlock_t blk_buffer_lock = SPINLOCK_INITIALIZER("blk_buffer");
+static kmem_cache_t *blk_buffer_cache;
+static size_t blk_buffer_count = 0;    /* Buffers in the hash */
+static uint32_t blk_shrink_cursor = 0; /* Bucket the next scan starts at */
+
+/*
+ * Reserves so a buffer can always be read in, even with memory exhausted:
+ * writeback and page faults on file mappings depend on it.
+ */
+#define BLK_RESERVE_BUFFERS 8
+static mempool_t *blk_buffer_pool; /* Buffer headers */
+static mempool_t *blk_data_pool;   /* Block data, up to BLK_SIZE_8K */
 
 static inline uint32_t
 blk_buffer_hash_func(dev_t dev, uint64_t block)
@@ -463,10 +476,123 @@ blk_mark_range_used(blk_allocator_t *alloc, uint32_t start, uint32_t count)
 	return 0;
 }
 
+/* Cached buffers keep their lock initialised across reuse */
+static void
+blk_buffer_ctor(void *obj)
+{
+	blk_buffer_t *buffer = obj;
+	spinlock_init(&buffer->bb_lock, "blk_buffer");
+}
+
+/* Reserve data goes back to its pool; headers top up theirs first */
+static void
+blk_buffer_free(blk_buffer_t *buf)
+{
+	if (buf->bb_flags & BLK_BUF_RESERVE) {
+		mempool_free(buf->bb_data, blk_data_pool);
+	} else {
+		kfree(buf->bb_data);
+	}
+	mempool_free(buf, blk_buffer_pool);
+}
+
+/*
+ * Under memory pressure, drop clean buffers nobody holds.  Each scan
+ * starts at the bucket where the last one stopped, so eviction spreads
+ * over the whole hash instead of always emptying the first buckets.
+ */
+static size_t
+blk_buffer_shrink_count(struct shrinker *shrinker)
+{
+	(void)shrinker;
+	return blk_buffer_count;
+}
+
+static size_t
+blk_buffer_shrink_scan(struct shrinker *shrinker, size_t nr)
+{
+	blk_buffer_t *victims = NULL;
+	size_t freed = 0;
+
+	(void)shrinker;
+
+	/* Reclaim may run under blk_buffer_get(), never spin here */
+	if (!spinlock_try_acquire(&blk_buffer_lock)) {
+		return 0;
+	}
+
+	for (int n = 0; n < BLK_BUFFER_HASH_SIZE && freed < nr; n++) {
+		blk_buffer_t **link = &blk_buffer_hash[blk_shrink_cursor];
+		blk_shrink_cursor =
+		    (blk_shrink_cursor + 1) % BLK_BUFFER_HASH_SIZE;
+
+		while (*link != NULL && freed < nr) {
+			blk_buffer_t *buf = *link;
+
+			if (!spinlock_try_acquire(&buf->bb_lock)) {
+				link = &buf->bb_next;
+				continue;
+			}
+
+			if (buf->bb_refcount != 0 ||
+			    (buf->bb_flags & BLK_BUF_DIRTY)) {
+				spinlock_release(&buf->bb_lock);
+				link = &buf->bb_next;
+				continue;
+			}
+
+			/* Unhashed, so blk_buffer_get() can no longer find it */
+			*link = buf->bb_next;
+			spinlock_release(&buf->bb_lock);
+
+			buf->bb_next = victims;
+			victims = buf;
+			freed++;
+		}
+	}
+
+	blk_buffer_count -= freed;
+	spinlock_release(&blk_buffer_lock);
+
+	while (victims != NULL) {
+		blk_buffer_t *buf = victims;
+		victims = buf->bb_next;
+
+		blk_buffer_free(buf);
+	}
+
+	return freed;
+}
+
+static struct shrinker blk_buffer_shrinker = {
+	.name = "blk_buffer",
+	.count = blk_buffer_shrink_count,
+	.scan = blk_buffer_shrink_scan,
+};
+
 int
 blk_buffer_init(void)
 {
 	memset(blk_buffer_hash, 0, sizeof(blk_buffer_hash));
+
+	blk_buffer_cache = kmem_cache_create("blk_buffer",
+	                                     sizeof(blk_buffer_t),
+	                                     KMEM_CACHE_LINE,
+	                                     blk_buffer_ctor,
+	                                     NULL);
+	if (blk_buffer_cache == NULL) {
+		return -ENOMEM;
+	}
+
+	blk_buffer_pool = mempool_create_slab_pool(
+	    "blk_buffer", BLK_RESERVE_BUFFERS, blk_buffer_cache);
+	blk_data_pool = mempool_create_kmalloc_pool(
+	    "blk_data", BLK_RESERVE_BUFFERS, BLK_SIZE_8K);
+	if (blk_buffer_pool == NULL || blk_data_pool == NULL) {
+		return -ENOMEM;
+	}
+
+	shrinker_register(&blk_buffer_shrinker);
 	return 0;
 }
 
@@ -502,29 +628,32 @@ blk_buffer_get(blk_device_t *dev, uint64_t block, blk_buffer_t **buf)
 	spinlock_release_irqrestore(&blk_buffer_lock, flags);
 
 	/* Not in cache - allocate new buffer */
-	buffer = kmalloc(sizeof(blk_buffer_t));
+	buffer = mempool_alloc(blk_buffer_pool, 0);
 	if (buffer == NULL) {
 		return -ENOMEM;
 	}
 
+	buffer->bb_flags = 0;
 	buffer->bb_data = kmalloc(dev->bd_block_size);
+	if (buffer->bb_data == NULL && dev->bd_block_size <= BLK_SIZE_8K) {
+		/* Sized for the largest block, so only used when kmalloc fails */
+		buffer->bb_data = mempool_take(blk_data_pool);
+		buffer->bb_flags |= BLK_BUF_RESERVE;
+	}
 	if (buffer->bb_data == NULL) {
-		kfree(buffer);
+		mempool_free(buffer, blk_buffer_pool);
 		return -ENOMEM;
 	}
 
 	buffer->bb_block = block;
 	buffer->bb_dev = dev;
 	buffer->bb_size = dev->bd_block_size;
-	buffer->bb_flags = 0;
 	buffer->bb_refcount = 1;
-	spinlock_init(&buffer->bb_lock, "blk_buffer");
 
 	/* Read block from disk */
 	int ret = blk_read_block(dev, block, buffer->bb_data);
 	if (ret != 0) {
-		kfree(buffer->bb_data);
-		kfree(buffer);
+		blk_buffer_free(buffer);
 		return ret;
 	}
 
@@ -534,6 +663,7 @@ blk_buffer_get(blk_device_t *dev, uint64_t block, blk_buffer_t **buf)
 	spinlock_acquire_irqsave(&blk_buffer_lock, &flags);
 	buffer->bb_next = blk_buffer_hash[hash];
 	blk_buffer_hash[hash] = buffer;
+	blk_buffer_count++;
 	spinlock_release_irqrestore(&blk_buffer_lock, flags);
 
 	*buf = buffer;
@@ -68,6 +68,7 @@ typedef struct blk_buffer {
 #define BLK_BUF_DIRTY 0x0001
 #define BLK_BUF_VALID 0x0002
 #define BLK_BUF_LOCKED 0x0004
+#define BLK_BUF_RESERVE 0x0008 /* bb_data came from the I/O reserve */
 
 int blk_register_device(blk_device_t *dev);
 int blk_unregister_device(dev_t dev);
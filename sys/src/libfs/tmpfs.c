@@ -16,11 +16,24 @@ extern void serial_printf(uint16_t port, const char *fmt, ...);
 static vnode_ops_t tmpfs_vnode_ops;
 static vfs_ops_t tmpfs_vfs_ops;
 
+/* Exact-size caches for nodes and directory entries */
+static kmem_cache_t *tmpfs_node_cache;
+static kmem_cache_t *tmpfs_dirent_cache;
+
 int
 tmpfs_init(void)
 {
 	TMPFS_DEBUG("Initializing tmpfs\n");
 
+	tmpfs_node_cache = kmem_cache_create(
+	    "tmpfs_node", sizeof(tmpfs_node_t), KMEM_CACHE_LINE, NULL, NULL);
+	tmpfs_dirent_cache = kmem_cache_create(
+	    "tmpfs_dirent", sizeof(tmpfs_dirent_t), 0, NULL, NULL);
+	if (tmpfs_node_cache == NULL || tmpfs_dirent_cache == NULL) {
+		TMPFS_DEBUG("Failed to create object caches\n");
+		return -ENOMEM;
+	}
+
 	/* Set up VFS operations */
 	tmpfs_vfs_ops.fs_name = "tmpfs";
 	tmpfs_vfs_ops.mount = tmpfs_mount;
@@ -48,7 +61,7 @@ tmpfs_node_alloc(tmpfs_mount_t *tm, uint8_t type, mode_t mode)
 		return NULL;
 	}
 
-	tmpfs_node_t *node = kmalloc(sizeof(tmpfs_node_t));
+	tmpfs_node_t *node = kmem_cache_alloc(tmpfs_node_cache, 0);
 	if (node == NULL) {
 		return NULL;
 	}
@@ -115,7 +128,7 @@ tmpfs_node_free(tmpfs_node_t *node)
 			if (entry->td_name != NULL) {
 				kfree(entry->td_name);
 			}
-			kfree(entry);
+			kmem_cache_free(tmpfs_dirent_cache, entry);
 			entry = next;
 		}
 		break;
@@ -126,7 +139,7 @@ tmpfs_node_free(tmpfs_node_t *node)
 		break;
 	}
 
-	kfree(node);
+	kmem_cache_free(tmpfs_node_cache, node);
 }
 
 tmpfs_node_t *
@@ -491,14 +504,14 @@ tmpfs_dirent_add(tmpfs_node_t *dir, const char *name, tmpfs_node_t *node)
 	}
 
 	/* Allocate new entry */
-	tmpfs_dirent_t *entry = kmalloc(sizeof(tmpfs_dirent_t));
+	tmpfs_dirent_t *entry = kmem_cache_alloc(tmpfs_dirent_cache, 0);
 	if (entry == NULL) {
 		return -ENOMEM;
 	}
 
 	entry->td_name = kmalloc(strlen(name) + 1);
 	if (entry->td_name == NULL) {
-		kfree(entry);
+		kmem_cache_free(tmpfs_dirent_cache, entry);
 		return -ENOMEM;
 	}
 	strcpy(entry->td_name, name);
@@ -538,7 +551,7 @@ tmpfs_dirent_remove(tmpfs_node_t *dir, const char *name)
 			}
 
 			kfree(entry->td_name);
-			kfree(entry);
+			kmem_cache_free(tmpfs_dirent_cache, entry);
 
 			return 0;
 		}
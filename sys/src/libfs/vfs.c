@@ -6,6 +6,7 @@
 #include <sys/panic.h>
 #include <kmalloc.h>
 #include <kfree.h>
+#include <shrinker.h>
 #include <string.h>
 
 extern uint64_t tsc_get_time_ns(void);
@@ -31,12 +32,140 @@ static spinlock_t vnode_hash_locks[VNODE_HASH_SIZE];
 #define DENTRY_HASH_SIZE 512
 static vfs_dentry_t *dentry_hash[DENTRY_HASH_SIZE];
 static spinlock_t dentry_hash_lock = SPINLOCK_INITIALIZER("dentry_hash");
+static size_t dentry_count = 0;           /* Dentries in the hash */
+static uint32_t dentry_shrink_cursor = 0; /* Bucket the next scan starts at */
+
+/* Vnode references of shrunk dentries, dropped later outside reclaim */
+#define DENTRY_DEFERRED_MAX 64
+static vnode_t *dentry_deferred[DENTRY_DEFERRED_MAX];
+static size_t dentry_deferred_count = 0; /* Under dentry_hash_lock */
 
 static vfs_mount_t *root_mount = NULL;
 
 static vfs_stats_t vfs_stats = {0};
 static spinlock_t vfs_stats_lock = SPINLOCK_INITIALIZER("vfs_stats");
 
+static kmem_cache_t *vnode_cache;
+static kmem_cache_t *file_cache;
+static kmem_cache_t *dentry_cache;
+
+/* Files and dentries keep their lock initialised while cached */
+static void
+vfs_file_ctor(void *obj)
+{
+	vfs_file_t *f = obj;
+	spinlock_init(&f->f_lock, "file");
+}
+
+static void
+vfs_dentry_ctor(void *obj)
+{
+	vfs_dentry_t *dentry = obj;
+	spinlock_init(&dentry->d_lock, "dentry");
+}
+
+/*
+ * Under memory pressure, drop dentries whose vnode nothing else holds.
+ * Their vnode reference is parked in dentry_deferred: the final unref
+ * takes blocking locks and calls into the filesystem, so it happens on
+ * the next dentry add or remove instead.  Scans resume at the bucket
+ * where the last one stopped.
+ */
+static size_t
+vfs_dentry_shrink_count(struct shrinker *shrinker)
+{
+	(void)shrinker;
+	return dentry_count;
+}
+
+static size_t
+vfs_dentry_shrink_scan(struct shrinker *shrinker, size_t nr)
+{
+	vfs_dentry_t *victims = NULL;
+	size_t freed = 0;
+
+	(void)shrinker;
+
+	/* Reclaim may run under a lookup, never spin here */
+	if (!spinlock_try_acquire(&dentry_hash_lock))
+		return 0;
+
+	for (int n = 0; n < DENTRY_HASH_SIZE && freed < nr; n++) {
+		if (dentry_deferred_count == DENTRY_DEFERRED_MAX)
+			break;
+
+		vfs_dentry_t **link = &dentry_hash[dentry_shrink_cursor];
+		dentry_shrink_cursor =
+		    (dentry_shrink_cursor + 1) % DENTRY_HASH_SIZE;
+
+		while (*link != NULL && freed < nr &&
+		       dentry_deferred_count < DENTRY_DEFERRED_MAX) {
+			vfs_dentry_t *dentry = *link;
+			vnode_t *vnode = dentry->d_vnode;
+
+			if (vnode != NULL) {
+				if (!spinlock_try_acquire(&vnode->v_lock)) {
+					link = &dentry->d_next;
+					continue;
+				}
+				bool busy = vnode->v_refcount > 1;
+				spinlock_release(&vnode->v_lock);
+
+				if (busy) {
+					link = &dentry->d_next;
+					continue;
+				}
+				dentry_deferred[dentry_deferred_count++] = vnode;
+			}
+
+			*link = dentry->d_next;
+			dentry->d_next = victims;
+			victims = dentry;
+			freed++;
+		}
+	}
+
+	dentry_count -= freed;
+	spinlock_release(&dentry_hash_lock);
+
+	while (victims != NULL) {
+		vfs_dentry_t *dentry = victims;
+		victims = dentry->d_next;
+
+		kfree(dentry->d_name);
+		kmem_cache_free(dentry_cache, dentry);
+	}
+
+	return freed;
+}
+
+/* Drop the vnode references the shrinker left behind */
+static void
+vfs_dentry_release_deferred(void)
+{
+	vnode_t *batch[DENTRY_DEFERRED_MAX];
+	size_t count;
+	uint64_t flags;
+
+	if (dentry_deferred_count == 0)
+		return;
+
+	spinlock_acquire_irqsave(&dentry_hash_lock, &flags);
+	count = dentry_deferred_count;
+	memcpy(batch, dentry_deferred, count * sizeof(vnode_t *));
+	dentry_deferred_count = 0;
+	spinlock_release_irqrestore(&dentry_hash_lock, flags);
+
+	for (size_t i = 0; i < count; i++)
+		vfs_vnode_unref(batch[i]);
+}
+
+static struct shrinker vfs_dentry_shrinker = {
+	.name = "vfs_dentry",
+	.count = vfs_dentry_shrink_count,
+	.scan = vfs_dentry_shrink_scan,
+};
+
 static inline uint32_t
 vnode_hash_func(dev_t dev, ino_t ino)
 {
@@ -131,6 +260,19 @@ vfs_init(void)
 	fs_types = NULL;
 	root_mount = NULL;
 
+	vnode_cache = kmem_cache_create(
+	    "vnode", sizeof(vnode_t), KMEM_CACHE_LINE, NULL, NULL);
+	file_cache = kmem_cache_create(
+	    "vfs_file", sizeof(vfs_file_t), 0, vfs_file_ctor, NULL);
+	dentry_cache = kmem_cache_create(
+	    "vfs_dentry", sizeof(vfs_dentry_t), 0, vfs_dentry_ctor, NULL);
+	if (vnode_cache == NULL || file_cache == NULL || dentry_cache == NULL) {
+		VFS_DEBUG("Failed to create object caches\n");
+		return -ENOMEM;
+	}
+
+	shrinker_register(&vfs_dentry_shrinker);
+
 	VFS_DEBUG("VFS initialization complete\n");
 	return VFS_SUCCESS;
 }
@@ -367,7 +509,7 @@ vfs_find_mount(const char *path)
 vnode_t *
 vfs_vnode_alloc(vfs_mount_t *mnt, ino_t ino)
 {
-	vnode_t *vnode = kmalloc(sizeof(vnode_t));
+	vnode_t *vnode = kmem_cache_alloc(vnode_cache, 0);
 	if (vnode == NULL)
 		return NULL;
 
@@ -403,7 +545,7 @@ vfs_vnode_free(vnode_t *vnode)
 	if (vnode->v_ops && vnode->v_ops->release)
 		vnode->v_ops->release(vnode);
 
-	kfree(vnode);
+	kmem_cache_free(vnode_cache, vnode);
 }
 
 void
@@ -457,7 +599,7 @@ vfs_vnode_unref(vnode_t *vnode)
 
 		if (vnode->v_ops && vnode->v_ops->release)
 			vnode->v_ops->release(vnode);
-		kfree(vnode);
+		kmem_cache_free(vnode_cache, vnode);
 		return;
 	}
 
@@ -812,7 +954,7 @@ vfs_open(const char *path, uint32_t flags, mode_t mode, vfs_file_t **file)
 		return ret;
 	}
 
-	vfs_file_t *f = kmalloc(sizeof(vfs_file_t));
+	vfs_file_t *f = kmem_cache_alloc(file_cache, 0);
 	if (f == NULL) {
 		vfs_vnode_unref(vnode);
 		return -ENOMEM;
@@ -822,13 +964,12 @@ vfs_open(const char *path, uint32_t flags, mode_t mode, vfs_file_t **file)
 	f->f_offset = 0;
 	f->f_flags = flags;
 	f->f_refcount = 1;
-	spinlock_init(&f->f_lock, "file");
 
 	if (flags & VFS_O_TRUNC) {
 		if (vnode->v_ops && vnode->v_ops->truncate) {
 			ret = vnode->v_ops->truncate(vnode, 0);
 			if (ret != 0) {
-				kfree(f);
+				kmem_cache_free(file_cache, f);
 				vfs_vnode_unref(vnode);
 				return ret;
 			}
@@ -857,7 +998,7 @@ vfs_close(vfs_file_t *file)
 	spinlock_release_irqrestore(&file->f_lock, flags);
 
 	vfs_vnode_unref(file->f_vnode);
-	kfree(file);
+	kmem_cache_free(file_cache, file);
 
 	return VFS_SUCCESS;
 }
@@ -1657,13 +1798,15 @@ vfs_dentry_add(const char *path, vnode_t *vnode)
 	if (path == NULL || vnode == NULL)
 		return -EINVAL;
 
-	vfs_dentry_t *dentry = kmalloc(sizeof(vfs_dentry_t));
+	vfs_dentry_release_deferred();
+
+	vfs_dentry_t *dentry = kmem_cache_alloc(dentry_cache, 0);
 	if (dentry == NULL)
 		return -ENOMEM;
 
 	dentry->d_name = vfs_strdup(path);
 	if (dentry->d_name == NULL) {
-		kfree(dentry);
+		kmem_cache_free(dentry_cache, dentry);
 		return -ENOMEM;
 	}
 
@@ -1671,7 +1814,6 @@ vfs_dentry_add(const char *path, vnode_t *vnode)
 	vfs_vnode_ref(vnode);
 	dentry->d_parent = NULL;
 	dentry->d_hash = dentry_hash_func(path);
-	spinlock_init(&dentry->d_lock, "dentry");
 
 	uint64_t flags;
 	spinlock_acquire_irqsave(&dentry_hash_lock, &flags);
@@ -1679,6 +1821,7 @@ vfs_dentry_add(const char *path, vnode_t *vnode)
 	uint32_t hash = dentry->d_hash;
 	dentry->d_next = dentry_hash[hash];
 	dentry_hash[hash] = dentry;
+	dentry_count++;
 
 	spinlock_release_irqrestore(&dentry_hash_lock, flags);
 
@@ -1691,6 +1834,8 @@ vfs_dentry_remove(const char *path)
 	if (path == NULL)
 		return;
 
+	vfs_dentry_release_deferred();
+
 	uint32_t hash = dentry_hash_func(path);
 
 	uint64_t flags;
@@ -1701,12 +1846,13 @@ vfs_dentry_remove(const char *path)
 		if (strcmp((*current)->d_name, path) == 0) {
 			vfs_dentry_t *dentry = *current;
 			*current = dentry->d_next;
+			dentry_count--;
 
 			spinlock_release_irqrestore(&dentry_hash_lock, flags);
 
 			vfs_vnode_unref(dentry->d_vnode);
 			kfree(dentry->d_name);
-			kfree(dentry);
+			kmem_cache_free(dentry_cache, dentry);
 			return;
 		}
 		current = &(*current)->d_next;
@@ -1728,15 +1874,18 @@ vfs_dentry_purge(void)
 
 			vfs_vnode_unref(dentry->d_vnode);
 			kfree(dentry->d_name);
-			kfree(dentry);
+			kmem_cache_free(dentry_cache, dentry);
 
 			dentry = next;
 		}
 		dentry_hash[i] = NULL;
 	}
+	dentry_count = 0;
 
 	spinlock_release_irqrestore(&dentry_hash_lock, flags);
 
+	vfs_dentry_release_deferred();
+
 	VFS_DEBUG("Dentry cache purged\n");
 }
 
@@ -0,0 +1,274 @@
+#include <avl.h>
+
+static inline int
+avl_height(const struct avl_node *node)
+{
+	return node != NULL ? node->height : 0;
+}
+
+static inline void
+avl_update(const struct avl_tree *tree, struct avl_node *node)
+{
+	int lh = avl_height(node->left);
+	int rh = avl_height(node->right);
+
+	node->height = 1 + (lh > rh ? lh : rh);
+
+	if (tree->augment != NULL) {
+		tree->augment(node);
+	}
+}
+
+/* Point parent (or the root) at new where it pointed at old */
+static void
+avl_replace_child(struct avl_tree *tree,
+                  struct avl_node *parent,
+                  struct avl_node *old,
+                  struct avl_node *new)
+{
+	if (parent == NULL) {
+		tree->root = new;
+	} else if (parent->left == old) {
+		parent->left = new;
+	} else {
+		parent->right = new;
+	}
+
+	if (new != NULL) {
+		new->parent = parent;
+	}
+}
+
+static struct avl_node *
+avl_rotate_left(struct avl_tree *tree, struct avl_node *x)
+{
+	struct avl_node *y = x->right;
+
+	x->right = y->left;
+	if (y->left != NULL) {
+		y->left->parent = x;
+	}
+
+	avl_replace_child(tree, x->parent, x, y);
+	y->left = x;
+	x->parent = y;
+
+	avl_update(tree, x);
+	avl_update(tree, y);
+	return y;
+}
+
+static struct avl_node *
+avl_rotate_right(struct avl_tree *tree, struct avl_node *x)
+{
+	struct avl_node *y = x->left;
+
+	x->left = y->right;
+	if (y->right != NULL) {
+		y->right->parent = x;
+	}
+
+	avl_replace_child(tree, x->parent, x, y);
+	y->right = x;
+	x->parent = y;
+
+	avl_update(tree, x);
+	avl_update(tree, y);
+	return y;
+}
+
+/* Restore heights and balance from node up to the root */
+static void
+avl_rebalance(struct avl_tree *tree, struct avl_node *node)
+{
+	while (node != NULL) {
+		avl_update(tree, node);
+
+		int balance = avl_height(node->left) - avl_height(node->right);
+
+		if (balance > 1) {
+			if (avl_height(node->left->left) <
+			    avl_height(node->left->right)) {
+				avl_rotate_left(tree, node->left);
+			}
+			node = avl_rotate_right(tree, node);
+		} else if (balance < -1) {
+			if (avl_height(node->right->right) <
+			    avl_height(node->right->left)) {
+				avl_rotate_right(tree, node->right);
+			}
+			node = avl_rotate_left(tree, node);
+		}
+
+		node = node->parent;
+	}
+}
+
+void
+avl_init(struct avl_tree *tree, avl_cmp_t cmp)
+{
+	avl_init_augmented(tree, cmp, NULL);
+}
+
+void
+avl_init_augmented(struct avl_tree *tree, avl_cmp_t cmp, avl_augment_t augment)
+{
+	tree->root = NULL;
+	tree->cmp = cmp;
+	tree->augment = augment;
+	tree->count = 0;
+}
+
+/* Refresh the summaries from node up after its key changed in place */
+void
+avl_propagate(struct avl_tree *tree, struct avl_node *node)
+{
+	for (; node != NULL; node = node->parent) {
+		avl_update(tree, node);
+	}
+}
+
+/* Insert node; fails if an equal node is already present */
+bool
+avl_insert(struct avl_tree *tree, struct avl_node *node)
+{
+	struct avl_node *parent = NULL;
+	struct avl_node **link = &tree->root;
+
+	while (*link != NULL) {
+		int c = tree->cmp(node, *link);
+
+		if (c == 0) {
+			return false;
+		}
+
+		parent = *link;
+		link = c < 0 ? &parent->left : &parent->right;
+	}
+
+	node->left = NULL;
+	node->right = NULL;
+	node->parent = parent;
+	*link = node;
+	avl_update(tree, node);
+	tree->count++;
+
+	avl_rebalance(tree, parent);
+	return true;
+}
+
+void
+avl_remove(struct avl_tree *tree, struct avl_node *node)
+{
+	struct avl_node *start;
+
+	if (node->left != NULL && node->right != NULL) {
+		/* Put the in-order successor where node was */
+		struct avl_node *succ = node->right;
+		while (succ->left != NULL) {
+			succ = succ->left;
+		}
+
+		if (succ->parent == node) {
+			start = succ;
+		} else {
+			start = succ->parent;
+			avl_replace_child(tree, succ->parent, succ, succ->right);
+			succ->right = node->right;
+			node->right->parent = succ;
+		}
+
+		succ->left = node->left;
+		node->left->parent = succ;
+		avl_replace_child(tree, node->parent, node, succ);
+		succ->height = node->height;
+	} else {
+		struct avl_node *child =
+		    node->left != NULL ? node->left : node->right;
+
+		start = node->parent;
+		avl_replace_child(tree, node->parent, node, child);
+	}
+
+	node->left = node->right = node->parent = NULL;
+	tree->count--;
+
+	avl_rebalance(tree, start);
+}
+
+struct avl_node *
+avl_find(const struct avl_tree *tree, const struct avl_node *key)
+{
+	struct avl_node *node = tree->root;
+
+	while (node != NULL) {
+		int c = tree->cmp(key, node);
+
+		if (c == 0) {
+			return node;
+		}
+		node = c < 0 ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+struct avl_node *
+avl_first(const struct avl_tree *tree)
+{
+	struct avl_node *node = tree->root;
+
+	while (node != NULL && node->left != NULL) {
+		node = node->left;
+	}
+
+	return node;
+}
+
+struct avl_node *
+avl_last(const struct avl_tree *tree)
+{
+	struct avl_node *node = tree->root;
+
+	while (node != NULL && node->right != NULL) {
+		node = node->right;
+	}
+
+	return node;
+}
+
+struct avl_node *
+avl_next(const struct avl_node *node)
+{
+	if (node->right != NULL) {
+		node = node->right;
+		while (node->left != NULL) {
+			node = node->left;
+		}
+		return (struct avl_node *)node;
+	}
+
+	while (node->parent != NULL && node == node->parent->right) {
+		node = node->parent;
+	}
+
+	return node->parent;
+}
+
+struct avl_node *
+avl_prev(const struct avl_node *node)
+{
+	if (node->left != NULL) {
+		node = node->left;
+		while (node->right != NULL) {
+			node = node->right;
+		}
+		return (struct avl_node *)node;
+	}
+
+	while (node->parent != NULL && node == node->parent->left) {
+		node = node->parent;
+	}
+
+	return node->parent;
+}
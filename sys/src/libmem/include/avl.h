@@ -0,0 +1,56 @@
+#ifndef _AVL_H_
+#define _AVL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Intrusive AVL tree.  Embed a struct avl_node in the object and recover
+ * the object with avl_entry().  The comparison function orders two nodes;
+ * lookups pass a key node embedded in a stack object of the same type.
+ */
+struct avl_node {
+	struct avl_node *left;
+	struct avl_node *right;
+	struct avl_node *parent;
+	int height;
+};
+
+typedef int (*avl_cmp_t)(const struct avl_node *a, const struct avl_node *b);
+
+/*
+ * Optional per-node summary of a subtree, recomputed from the node and its
+ * children whenever the tree changes shape.  Callers that change a key in
+ * place without reordering the tree refresh it with avl_propagate().
+ */
+typedef void (*avl_augment_t)(struct avl_node *node);
+
+struct avl_tree {
+	struct avl_node *root;
+	avl_cmp_t cmp;
+	avl_augment_t augment;
+	size_t count;
+};
+
+#define AVL_TREE_INITIALIZER(cmpfn)                                            \
+	{ .root = NULL, .cmp = (cmpfn), .augment = NULL, .count = 0 }
+
+#define avl_entry(node, type, member)                                          \
+	((type *)((uint8_t *)(node) - offsetof(type, member)))
+
+void avl_init(struct avl_tree *tree, avl_cmp_t cmp);
+void avl_init_augmented(struct avl_tree *tree,
+                        avl_cmp_t cmp,
+                        avl_augment_t augment);
+void avl_propagate(struct avl_tree *tree, struct avl_node *node);
+bool avl_insert(struct avl_tree *tree, struct avl_node *node);
+void avl_remove(struct avl_tree *tree, struct avl_node *node);
+struct avl_node *avl_find(const struct avl_tree *tree,
+                          const struct avl_node *key);
+struct avl_node *avl_first(const struct avl_tree *tree);
+struct avl_node *avl_last(const struct avl_tree *tree);
+struct avl_node *avl_next(const struct avl_node *node);
+struct avl_node *avl_prev(const struct avl_node *node);
+
+#endif
@@ -4,13 +4,23 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/spinlock.h>
 
 #define KMALLOC_ZERO (1 << 0)   /* Zero the allocated memory */
 #define KMALLOC_ATOMIC (1 << 1) /* Cannot sleep/block */
+#define KMALLOC_CACHEALIGN (1 << 2) /* Start on a KMEM_CACHE_LINE boundary */
 
 #define KMALLOC_MIN_SIZE 16
 #define KMALLOC_MAX_SIZE 8192
 
+#define KMALLOC_MAXCPU 1
+#define KMALLOC_MAG_MAX 64  /* Upper bound on rounds per magazine */
+#define KMALLOC_DEPOT_MAX 8 /* Loaded magazines a depot may hold */
+
+#define KMALLOC_RESERVE_BYTES 8192 /* KMALLOC_ATOMIC reserve per size class */
+
+#define KMEM_CACHE_LINE 64 /* Alignment for hot, contended objects */
+
 enum {
 	CACHE_16 = 0,
 	CACHE_32,
@@ -25,26 +35,71 @@ enum {
 	CACHE_COUNT
 };
 
+struct cache;
+
 typedef struct slab {
 	struct slab *next;     /* Next slab in list */
+	struct slab *prev;     /* Previous slab in list */
+	struct cache *cache;   /* Cache this slab belongs to */
+	void *mem;             /* First page of the slab */
 	void *objects;         /* Pointer to first object */
+	void *freelist;        /* First free object, linked through objects */
 	uint32_t free_count;   /* Number of free objects */
 	uint32_t total_count;  /* Total objects in slab */
-	uint64_t *free_bitmap; /* Bitmap of free objects */
+	uint64_t *free_bitmap; /* Bitmap of free objects, for double frees */
 } slab_t;
 
+/*
+ * Magazines sit between the per-CPU caches and the depot.  A magazine is
+ * a stack of up to mag_size free objects.  They show as free in their
+ * slab's bitmap but still count as allocated in its free_count and stay
+ * off its freelist until the magazine is flushed.
+ */
+typedef struct magazine {
+	struct magazine *next;       /* Next magazine in the depot */
+	uint32_t rounds;             /* Objects currently held */
+	void *objs[KMALLOC_MAG_MAX]; /* The objects themselves */
+} magazine_t;
+
+typedef struct cpu_cache {
+	magazine_t *loaded;   /* Magazine objects come from and go to */
+	magazine_t *previous; /* Spare, swapped with loaded when useful */
+	uint64_t hits;        /* Served from a magazine */
+	uint64_t misses;      /* Fell through to the slab layer */
+} __aligned(64) cpu_cache_t;
+
 typedef struct cache {
 	const char *name;          /* Cache name for debugging */
 	size_t object_size;        /* Size of each object */
 	size_t align;              /* Alignment requirement */
+	size_t free_offset;        /* Where a free object keeps its link */
+	void (*ctor)(void *obj);   /* Run once when a slab is built */
+	void (*dtor)(void *obj);   /* Run once when a slab is released */
+	struct cache *next;        /* Next kmem_cache_create() cache */
+	uint32_t size_recip;       /* 2^32 / object_size, rounded up */
 	uint32_t objects_per_slab; /* Objects per slab */
+	uint32_t slab_order;       /* Slabs are 2^slab_order pages */
+	bool off_slab;             /* Slab header lives outside the slab */
+	uint32_t color_unit;       /* Step between slab colors, in bytes */
+	uint32_t color_count;      /* Distinct first-object offsets */
+	uint32_t color_next;       /* Color of the next slab built */
 	slab_t *partial;           /* Slabs with free objects */
 	slab_t *full;              /* Completely full slabs */
 	slab_t *empty;             /* Completely empty slabs */
+	uint32_t empty_count;      /* Slabs on the empty list */
 	uint64_t alloc_count;      /* Total allocations */
 	uint64_t free_count;       /* Total frees */
+	uint32_t mag_size;         /* Rounds per magazine, 0 disables */
+	magazine_t *depot_full;    /* Depot magazines holding objects */
+	magazine_t *depot_empty;   /* Depot magazines with no objects */
+	uint32_t depot_full_count;
+	uint32_t depot_empty_count;
+	spinlock_t lock;           /* Protects the depot and the slabs */
+	cpu_cache_t cpu[KMALLOC_MAXCPU];
 } cache_t;
 
+typedef cache_t kmem_cache_t;
+
 void kmalloc_init(void);
 
 void *kmalloc(size_t size);
@@ -56,6 +111,55 @@ size_t kmalloc_size(void *ptr);
 
 void kmalloc_stats(void);
 
+bool kmalloc_set_magazine_size(size_t size, uint32_t rounds);
+
+/*
+ * Typed object caches.  Objects are exactly size bytes rounded up to align
+ * (0 means pointer alignment).  With a constructor, objects come back from
+ * kmem_cache_alloc() in the state kmem_cache_free() found them, so only
+ * per-use fields need resetting; ctor and dtor run when slabs are built
+ * and torn down.
+ */
+kmem_cache_t *kmem_cache_create(const char *name,
+                                size_t size,
+                                size_t align,
+                                void (*ctor)(void *obj),
+                                void (*dtor)(void *obj));
+void kmem_cache_destroy(kmem_cache_t *cache);
+void *kmem_cache_alloc(kmem_cache_t *cache, uint32_t flags);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/* Return empty slabs and depot magazines to the PMM, used by reclaim */
+size_t kmem_cache_reap(void);
+
+/* Slab list and object index helpers shared by kmalloc.c and kfree.c */
+void slab_list_add(slab_t **list, slab_t *slab);
+void slab_list_del(slab_t **list, slab_t *slab);
+
+/* Slab layer, called with cache->lock held */
+void slab_free_object(cache_t *cache, slab_t *slab, void *obj, int obj_index);
+void slab_destroy(cache_t *cache, slab_t *slab);
+
+/* Magazine layer; false means the caller must go to the slab layer */
+bool magazine_free(cache_t *cache, void *obj);
+void cache_drain_magazines(cache_t *cache);
+
+static inline uint32_t
+slab_obj_index(cache_t *cache, slab_t *slab, void *obj)
+{
+	uint64_t offset = (uintptr_t)obj - (uintptr_t)slab->objects;
+
+	/* Exact for multiples of object_size without a divide */
+	return (uint32_t)((offset * cache->size_recip) >> 32);
+}
+
+/* Free-list link of a free object */
+static inline void **
+slab_obj_link(cache_t *cache, void *obj)
+{
+	return (void **)((uint8_t *)obj + cache->free_offset);
+}
+
 extern cache_t caches[CACHE_COUNT];
 
 #endif
\ No newline at end of file
@@ -0,0 +1,52 @@
+#ifndef _KMPROF_H_
+#define _KMPROF_H_
+
+#include <sys/cdefs.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Allocation profiler.  While enabled, every kmalloc, kmem_cache and PMM
+ * allocation is charged to the address its caller returns to, and live
+ * objects are remembered with their size and birth time so frees are
+ * credited back and old objects can be reported as possible leaks.
+ * Disabled, each hook costs one predicted-false branch.
+ */
+#define KMPROF_SITES 512    /* Call sites tracked, power of two */
+#define KMPROF_OBJECTS 8192 /* Live objects tracked, power of two */
+#define KMPROF_TOP_MAX 32   /* Most rows a report prints */
+
+enum kmprof_kind {
+	KMPROF_KMALLOC, /* kmalloc() and kmem_cache_alloc() objects */
+	KMPROF_PAGES,   /* Frames straight from the PMM */
+};
+
+extern volatile bool kmprof_enabled;
+
+void kmprof_enable(bool enable);
+void kmprof_record_alloc(enum kmprof_kind kind,
+                         void *caller,
+                         const void *ptr,
+                         size_t size);
+void kmprof_record_free(enum kmprof_kind kind, const void *ptr);
+void kmprof_dump(size_t top);
+size_t kmprof_leak_scan(uint64_t min_age);
+
+/* Hooks for the allocator entry points; the caller is their caller */
+#define KMPROF_ALLOC(kind, ptr, size)                                          \
+	do {                                                                   \
+		if (__predict_false(kmprof_enabled) && (ptr) != NULL)          \
+			kmprof_record_alloc((kind),                            \
+			                    __builtin_return_address(0),       \
+			                    (ptr),                             \
+			                    (size));                           \
+	} while (0)
+
+#define KMPROF_FREE(kind, ptr)                                                 \
+	do {                                                                   \
+		if (__predict_false(kmprof_enabled) && (ptr) != NULL)          \
+			kmprof_record_free((kind), (ptr));                     \
+	} while (0)
+
+#endif
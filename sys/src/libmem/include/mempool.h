@@ -0,0 +1,74 @@
+#ifndef _MEMPOOL_H_
+#define _MEMPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/cdefs.h>
+#include <sys/spinlock.h>
+#include <kmalloc.h>
+
+/*
+ * Memory pools keep a preallocated reserve of min_nr elements for paths
+ * that must make progress when the allocators are exhausted: block I/O,
+ * fault resolution and KMALLOC_ATOMIC callers.  mempool_alloc() tries the
+ * backing allocator first and only dips into the reserve when it fails.
+ * Elements handed back with mempool_free() top the reserve up first;
+ * elements freed behind the pool's back are replaced by mempool_refill(),
+ * which runs from the idle loop, nudged by a timer, and from the next
+ * allocation that may block.
+ */
+typedef void *(*mempool_alloc_t)(uint32_t flags, void *pool_data);
+typedef void (*mempool_free_t)(void *element, void *pool_data);
+
+typedef struct mempool {
+	const char *name;
+	spinlock_t lock;
+	uint32_t min_nr;         /* Reserve size to maintain */
+	uint32_t curr_nr;        /* Elements in the reserve now */
+	void **elements;         /* The reserve, a stack of min_nr slots */
+	size_t elem_size;        /* For KMALLOC_ZERO, 0 if unknown */
+	mempool_alloc_t alloc;   /* Backing allocator */
+	mempool_free_t free;     /* And its release function */
+	void *pool_data;         /* Passed to alloc and free */
+	bool refill;             /* Below min_nr, wants mempool_refill() */
+	uint64_t reserve_allocs; /* Allocations the reserve served */
+	uint64_t failures;       /* Allocations that found it empty */
+	struct mempool *next;
+} mempool_t;
+
+#define MEMPOOL_REFILL_MS 100 /* Period of the background refill */
+
+extern volatile bool mempool_refill_pending;
+
+mempool_t *mempool_create(const char *name,
+                          uint32_t min_nr,
+                          mempool_alloc_t alloc,
+                          mempool_free_t free,
+                          void *pool_data);
+mempool_t *mempool_create_kmalloc_pool(const char *name,
+                                       uint32_t min_nr,
+                                       size_t size);
+mempool_t *mempool_create_page_pool(const char *name, uint32_t min_nr);
+mempool_t *mempool_create_slab_pool(const char *name,
+                                    uint32_t min_nr,
+                                    kmem_cache_t *cache);
+void mempool_destroy(mempool_t *pool);
+
+void *mempool_alloc(mempool_t *pool, uint32_t flags);
+void *mempool_take(mempool_t *pool);
+void mempool_free(void *element, mempool_t *pool);
+
+void mempool_init(void);
+size_t mempool_refill(void);
+void mempool_stats(void);
+
+/* Lets allocation paths that may block top up pools drained earlier */
+#define MEMPOOL_REFILL_CHECK(flags)                                            \
+	do {                                                                   \
+		if (__predict_false(mempool_refill_pending) &&                 \
+		    !((flags) & KMALLOC_ATOMIC))                               \
+			mempool_refill();                                      \
+	} while (0)
+
+#endif
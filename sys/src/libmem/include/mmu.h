@@ -30,8 +30,17 @@
 #define PAGE_GLOBAL (1ULL << 8)
 #define PAGE_NX (1ULL << 63)
 
+#define PAGE_COW (1ULL << 9)       /* Software: write-protected, shared */
+#define PAGE_HUGE_PAT (1ULL << 12) /* PAT bit position in a 2 MiB entry */
+
 #define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
 
+#define HUGE_PAGE_SIZE (2ULL * 1024 * 1024)
+#define HUGE_PAGE_ORDER 9 /* 512 contiguous 4 KiB frames */
+#define HUGE_PAGE_PAGES (1ULL << HUGE_PAGE_ORDER)
+#define HUGE_PAGE_ADDR_MASK 0x000FFFFFFFE00000ULL
+#define GIANT_PAGE_ADDR_MASK 0x000FFFFFC0000000ULL
+
 typedef uint64_t pml4e_t;
 typedef uint64_t pdpte_t;
 typedef uint64_t pde_t;
@@ -40,26 +49,101 @@ typedef uint64_t pte_t;
 typedef struct {
 	pml4e_t *pml4;
 	uint64_t phys_addr;
+	uint16_t asid;     /* PCID tagging this space's TLB entries */
+	uint64_t asid_gen; /* Generation asid belongs to, 0 if none */
 } page_directory_t;
 
-typedef void (*page_fault_handler_t)(uint64_t fault_addr, uint64_t error_code);
+#define MMU_GATHER_FLUSH_MAX 32 /* More invlpgs than this cost a flush */
+#define MMU_GATHER_FRAMES 64
+
+/*
+ * Collects the TLB invalidations and frame frees of one range operation.
+ * Frames reach the PMM only after the flush, so a stale translation can
+ * never point at a frame that has been handed out again.
+ */
+typedef struct {
+	page_directory_t *pd;
+	uint64_t addrs[MMU_GATHER_FLUSH_MAX];
+	size_t nr_addrs;
+	bool flush_all; /* Too many addresses, flush the whole space */
+	bool kernel;    /* Some were global kernel-half entries */
+	void *frames[MMU_GATHER_FRAMES];
+	uint8_t orders[MMU_GATHER_FRAMES];
+	size_t nr_frames;
+} mmu_gather_t;
+
+/* Visits one present leaf entry spanning size bytes from virt */
+typedef bool (*mmu_walk_fn_t)(uint64_t virt,
+                              uint64_t *entry,
+                              uint64_t size,
+                              void *arg);
+
+/* Supplies the frame for page index of a batch, false when there is none */
+typedef bool (*mmu_frame_fn_t)(size_t index, uint64_t *phys, void *arg);
+
+/* Returns true once the fault is resolved and the access can be retried */
+typedef bool (*page_fault_handler_t)(uint64_t fault_addr, uint64_t error_code);
 
 void mmu_init(struct limine_hhdm_response *hhdm);
 page_directory_t *mmu_create_address_space(void);
 void mmu_destroy_address_space(page_directory_t *pd);
 void mmu_switch_address_space(page_directory_t *pd);
+uint64_t mmu_activate(page_directory_t *pd);
+bool mmu_enable_pcid(void);
+page_directory_t *mmu_get_kernel_address_space(void);
 page_directory_t *mmu_get_current_address_space(void);
+void mmu_get_active_directory(page_directory_t *pd);
 bool mmu_map_page(page_directory_t *pd,
                   uint64_t virt,
                   uint64_t phys,
                   uint64_t flags);
 bool mmu_unmap_page(page_directory_t *pd, uint64_t virt);
+bool mmu_map_huge_page(page_directory_t *pd,
+                       uint64_t virt,
+                       uint64_t phys,
+                       uint64_t flags);
+bool mmu_unmap_huge_page(page_directory_t *pd, uint64_t virt);
+bool mmu_split_huge_page(page_directory_t *pd, uint64_t virt);
+bool mmu_is_huge_mapped(page_directory_t *pd, uint64_t virt);
 uint64_t mmu_get_physical_address(page_directory_t *pd, uint64_t virt);
+pte_t *mmu_get_pte(page_directory_t *pd, uint64_t virt);
+bool mmu_walk_range(page_directory_t *pd,
+                    uint64_t start,
+                    uint64_t end,
+                    mmu_walk_fn_t fn,
+                    void *arg);
+size_t mmu_map_range_batch(page_directory_t *pd,
+                           uint64_t virt,
+                           size_t num_pages,
+                           uint64_t flags,
+                           mmu_frame_fn_t next_frame,
+                           void *arg);
+void mmu_set_entry(uint64_t *entry, uint64_t value);
+void mmu_set_leaf(uint64_t *entry, uint64_t value, uint64_t size);
+void mmu_reclaim_tables(page_directory_t *pd,
+                        mmu_gather_t *tlb,
+                        uint64_t start,
+                        uint64_t end);
 bool mmu_is_mapped(page_directory_t *pd, uint64_t virt);
 void mmu_set_page_fault_handler(page_fault_handler_t handler);
-void mmu_handle_page_fault(uint64_t fault_addr, uint64_t error_code);
+bool mmu_handle_page_fault(uint64_t fault_addr, uint64_t error_code);
+void mmu_gather_init(mmu_gather_t *tlb, page_directory_t *pd);
+bool mmu_gather_map_page(mmu_gather_t *tlb,
+                         uint64_t virt,
+                         uint64_t phys,
+                         uint64_t flags);
+bool mmu_gather_unmap_page(mmu_gather_t *tlb, uint64_t virt);
+bool mmu_gather_map_huge_page(mmu_gather_t *tlb,
+                              uint64_t virt,
+                              uint64_t phys,
+                              uint64_t flags);
+bool mmu_gather_unmap_huge_page(mmu_gather_t *tlb, uint64_t virt);
+void mmu_gather_page(mmu_gather_t *tlb, uint64_t virt);
+void mmu_gather_free(mmu_gather_t *tlb, void *frame, unsigned int order);
+void mmu_gather_flush(mmu_gather_t *tlb);
 void mmu_flush_tlb_single(uint64_t virt);
 void mmu_flush_tlb_all(void);
+void mmu_flush_address_space(page_directory_t *pd);
 void *mmu_phys_to_virt(uint64_t phys);
 uint64_t mmu_virt_to_phys(void *virt);
 
@@ -40,6 +40,21 @@ bool paging_map_range(page_directory_t *pd,
 bool paging_unmap_range(page_directory_t *pd,
                         uint64_t virt_base,
                         size_t num_pages);
+size_t paging_unmap_free_range(page_directory_t *pd,
+                               uint64_t virt_base,
+                               size_t num_pages);
+bool paging_alloc_range(page_directory_t *pd,
+                        uint64_t virt_base,
+                        size_t num_pages,
+                        uint64_t flags);
+bool paging_alloc_pages(page_directory_t *pd,
+                        uint64_t virt_base,
+                        size_t num_pages,
+                        uint64_t flags);
+bool paging_copy_huge_page(page_directory_t *dst,
+                           uint64_t virt,
+                           uint64_t src_phys,
+                           uint64_t flags);
 bool paging_map_region(page_directory_t *pd, memory_region_t *region);
 bool paging_identity_map(page_directory_t *pd,
                          uint64_t phys_base,
@@ -51,6 +66,11 @@ bool paging_is_range_mapped(page_directory_t *pd,
 page_directory_t *paging_create_kernel_address_space(void);
 page_directory_t *paging_create_user_address_space(void);
 page_directory_t *paging_clone_address_space(page_directory_t *src);
+bool paging_copy_user_pages(page_directory_t *dst, page_directory_t *src);
+bool paging_share_range(page_directory_t *dst,
+                        page_directory_t *src,
+                        uint64_t virt_base,
+                        size_t num_pages);
 void paging_switch_directory(page_directory_t *pd);
 page_directory_t *paging_get_kernel_directory(void);
 page_directory_t *paging_get_current_directory(void);
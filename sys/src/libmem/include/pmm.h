@@ -9,6 +9,32 @@
 #define PAGE_SIZE 4096
 #define PAGE_SHIFT 12
 
+#define PMM_MAX_ORDER 11 /* Buddy orders 0..10, largest block is 4 MiB */
+#define PMM_ZERO_POOL_MAX 256 /* Pre-zeroed frames kept by the idle task */
+
+/* struct page flags */
+#define PG_RESERVED 0x0001 /* Never handed out by the PMM */
+#define PG_ZEROED 0x0002   /* Sitting zero-filled in the pre-zeroed pool */
+#define PG_COW 0x0004      /* Shared copy-on-write between address spaces */
+#define PG_PINNED 0x0008   /* Pinned for DMA, must not move or be freed */
+#define PG_SLAB 0x0010     /* Owned by the slab allocator */
+#define PG_LARGE 0x0020    /* Head of a multi-page kmalloc, private = pages */
+#define PG_PGTABLE 0x0040  /* Page table, private = present entries */
+#define PG_CACHED 0x0080   /* Free, parked in a per-CPU page cache */
+
+/*
+ * Per-frame descriptor, one for every tracked page.  A frame handed out
+ * by the PMM starts with refcount 1; page_put() frees it when the last
+ * reference goes away, and pmm_free() on a shared frame only drops one.
+ */
+struct page {
+	volatile unsigned int refcount; /* References to the frame */
+	volatile unsigned int mapcount; /* Page table entries mapping it */
+	unsigned int flags;             /* PG_* flags */
+	unsigned int private;           /* Owner-specific data */
+	void *owner;                    /* Owning object, e.g. a slab */
+};
+
 typedef struct {
 	uint64_t total_physical;         /* Total physical memory in system */
 	uint64_t usable_memory;          /* Total usable RAM */
@@ -21,6 +47,21 @@ typedef struct {
 	uint64_t alloc_count;            /* Total allocations */
 	uint64_t free_count;             /* Total frees */
 	uint64_t bitmap_size;            /* Size of bitmap in bytes */
+	uint64_t free_blocks[PMM_MAX_ORDER]; /* Free buddy blocks per order */
+	uint64_t largest_free_order;     /* Highest order with a free block */
+	uint64_t split_count;            /* Buddy blocks split */
+	uint64_t merge_count;            /* Buddy blocks merged on free */
+	uint64_t cache_hits;             /* pmm_alloc served by CPU cache */
+	uint64_t cache_misses;           /* pmm_alloc that had to refill */
+	uint64_t cached_pages;           /* Free pages held in CPU caches */
+	uint64_t zero_pool_hits;         /* pmm_alloc_zeroed from the pool */
+	uint64_t zero_pool_misses;       /* pmm_alloc_zeroed that zeroed inline */
+	uint64_t zeroed_pages;           /* Frames in the pre-zeroed pool */
+	uint64_t wmark_min;              /* Reclaim on every allocation below */
+	uint64_t wmark_low;              /* Start reclaiming below */
+	uint64_t wmark_high;             /* Reclaim back up to */
+	uint64_t reclaim_runs;           /* Times the shrinkers were run */
+	uint64_t reclaimed_pages;        /* Pages they gave back */
 } pmm_stats_t;
 
 typedef struct {
@@ -35,9 +76,26 @@ void pmm_init(struct limine_memmap_response *memmap,
 
 void *pmm_alloc(void);
 void pmm_free(void *page);
+void *pmm_alloc_zeroed(void);
+size_t pmm_refill_zero_pool(size_t max_pages);
 
 void *pmm_alloc_contiguous(size_t num_pages);
+void *pmm_try_alloc_contiguous(size_t num_pages);
 void pmm_free_contiguous(void *base, size_t num_pages);
+void *pmm_alloc_order(unsigned int order);
+void pmm_free_order(void *base, unsigned int order);
+void pmm_drain_cpu_caches(void);
+
+struct page *pfn_to_page(uint64_t pfn);
+struct page *phys_to_page(uint64_t phys);
+struct page *virt_to_page(const void *virt);
+uint64_t page_to_pfn(const struct page *page);
+uint64_t page_to_phys(const struct page *page);
+void *page_to_virt(const struct page *page);
+void page_get(struct page *page);
+void page_put(struct page *page);
+unsigned int page_refcount(const struct page *page);
+
 void pmm_reclaim_bootloader_memory(void);
 bool pmm_is_page_allocated(void *page);
 uint64_t pmm_get_free_memory(void);
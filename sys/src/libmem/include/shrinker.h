@@ -0,0 +1,28 @@
+#ifndef _SHRINKER_H_
+#define _SHRINKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Subsystems holding memory they can rebuild (buffer and name caches)
+ * register a shrinker.  count() estimates how many objects could be
+ * dropped; scan() tries to drop up to nr of them and returns how many it
+ * did.  Both run from inside page allocations, so they must not sleep,
+ * must not allocate, and must only try-lock their own locks.
+ */
+struct shrinker {
+	const char *name;
+	size_t (*count)(struct shrinker *shrinker);
+	size_t (*scan)(struct shrinker *shrinker, size_t nr);
+	struct shrinker *next;
+};
+
+/* Each pass scans count >> priority objects, the last pass everything */
+#define SHRINK_PRIORITY_MAX 4
+
+void shrinker_register(struct shrinker *shrinker);
+void shrinker_unregister(struct shrinker *shrinker);
+size_t shrink_memory(size_t nr_pages);
+
+#endif
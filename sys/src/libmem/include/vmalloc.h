@@ -0,0 +1,20 @@
+#ifndef _VMALLOC_H_
+#define _VMALLOC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Virtually contiguous kernel allocations.  Pages are allocated one at a
+ * time and mapped into the vmalloc window, so large buffers do not need
+ * physically contiguous memory.  Each area is followed by an unmapped
+ * guard page.
+ */
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+size_t vmalloc_size(const void *ptr);
+bool is_vmalloc_addr(const void *ptr);
+void vmalloc_stats(void);
+
+#endif
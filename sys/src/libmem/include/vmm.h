@@ -5,12 +5,18 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <paging.h>
+#include <avl.h>
 
 #define VMM_KERNEL_HEAP_START 0xFFFFFFFF90000000ULL
 #define VMM_KERNEL_HEAP_SIZE (64 * 1024 * 1024)
+/* Upper half of the kernel heap window is handed out by vmalloc() */
+#define VMM_VMALLOC_START (VMM_KERNEL_HEAP_START + VMM_KERNEL_HEAP_SIZE / 2)
+#define VMM_VMALLOC_END (VMM_KERNEL_HEAP_START + VMM_KERNEL_HEAP_SIZE)
 #define VMM_USER_HEAP_START 0x0000000001000000ULL
 #define VMM_USER_STACK_TOP 0x00007FFFFFFFF000ULL
 #define VMM_USER_STACK_SIZE (8 * 1024 * 1024)
+/* mmap() without a usable hint searches upwards from here */
+#define VMM_USER_MMAP_BASE 0x0000200000000000ULL
 
 typedef enum {
 	VMM_REGION_KERNEL_CODE,
@@ -25,18 +31,28 @@ typedef enum {
 	VMM_REGION_MMIO
 } vmm_region_type_t;
 
+/*
+ * Regions live in an AVL tree keyed by virt_start.  Each node also
+ * summarises its subtree, so a hole of a given size is found without
+ * visiting every region.
+ */
 typedef struct vmm_region {
+	struct avl_node node;
 	uint64_t virt_start;
 	uint64_t virt_end;
 	uint64_t flags;
 	vmm_region_type_t type;
 	bool cow;
-	struct vmm_region *next;
+	bool anon;              /* Demand-zero, pages appear on first touch */
+	uint64_t subtree_start; /* Lowest virt_start in the subtree */
+	uint64_t subtree_end;   /* Highest virt_end in the subtree */
+	uint64_t subtree_gap;   /* Largest hole between regions in the subtree */
 } vmm_region_t;
 
 typedef struct {
 	page_directory_t *page_dir;
-	vmm_region_t *regions;
+	struct avl_tree regions;
+	vmm_region_t *last_hit; /* Region vmm_find_region() returned last */
 	uint64_t heap_start;
 	uint64_t heap_end;
 	uint64_t brk;
@@ -48,8 +64,17 @@ typedef struct {
 	uint64_t cached_pages;
 	uint64_t page_faults;
 	uint64_t tlb_flushes;
+	uint64_t cow_copies; /* Write faults that copied a shared frame */
+	uint64_t cow_reuses; /* Write faults on a frame with no other user */
+	uint64_t demand_faults;  /* Anonymous pages allocated on first write */
+	uint64_t zero_page_maps; /* Read faults served by the shared zero page */
 } vmm_stats_t;
 
+/* Page fault error code bits */
+#define VMM_PF_PRESENT (1 << 0) /* Protection violation, not a missing page */
+#define VMM_PF_WRITE (1 << 1)   /* Faulting access was a write */
+#define VMM_PF_USER (1 << 2)    /* Fault happened in user mode */
+
 void vmm_init(void);
 vmm_address_space_t *vmm_create_address_space(bool is_kernel);
 void vmm_destroy_address_space(vmm_address_space_t *space);
@@ -74,8 +99,25 @@ bool vmm_protect_region(vmm_address_space_t *space,
                         uint64_t virt_start,
                         size_t size,
                         uint64_t flags);
+bool vmm_reserve_region(vmm_address_space_t *space,
+                        uint64_t virt_start,
+                        size_t size,
+                        vmm_region_type_t type,
+                        uint64_t flags);
+bool vmm_release_range(vmm_address_space_t *space,
+                       uint64_t virt_start,
+                       size_t size);
+bool vmm_copy_regions(vmm_address_space_t *dst, vmm_address_space_t *src);
+uint64_t vmm_find_gap(vmm_address_space_t *space,
+                      size_t size,
+                      uint64_t low,
+                      uint64_t high);
+bool vmm_range_is_free(vmm_address_space_t *space,
+                       uint64_t virt_start,
+                       size_t size);
+vmm_region_t *vmm_find_region(vmm_address_space_t *space, uint64_t virt_addr);
 void *vmm_sbrk(vmm_address_space_t *space, intptr_t increment);
-void vmm_handle_page_fault(uint64_t fault_addr, uint64_t error_code);
+bool vmm_handle_page_fault(uint64_t fault_addr, uint64_t error_code);
 void vmm_flush_tlb(uint64_t virt_addr);
 void vmm_flush_tlb_all(void);
 vmm_stats_t vmm_get_stats(void);
@@ -1,6 +1,8 @@
 #include <kfree.h>
 #include <kmalloc.h>
 #include <pmm.h>
+#include <vmalloc.h>
+#include <kmprof.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -16,6 +18,7 @@ slab_mark_free(slab_t *slab, int index)
 	slab->free_count++;
 }
 
+/* Look up the owning slab through the page descriptor, O(1) */
 static bool
 find_allocation(void *ptr,
                 cache_t **out_cache,
@@ -26,103 +29,37 @@ find_allocation(void *ptr,
 		return false;
 	}
 
-	for (int i = 0; i < CACHE_COUNT; i++) {
-		cache_t *cache = &caches[i];
-
-		slab_t *slab = cache->partial;
-		while (slab != NULL) {
-			if ((uintptr_t)ptr >= (uintptr_t)slab &&
-			    (uintptr_t)ptr < (uintptr_t)slab + PAGE_SIZE) {
-				if ((uintptr_t)ptr < (uintptr_t)slab->objects) {
-					serial_printf(
-					    DEBUG_PORT,
-					    "[kfree] Invalid pointer in slab "
-					    "header region\n");
-					return false;
-				}
-
-				/* Calculate object index */
-				uintptr_t offset =
-				    (uintptr_t)ptr - (uintptr_t)slab->objects;
-
-				if (offset % cache->object_size != 0) {
-					serial_printf(
-					    DEBUG_PORT,
-					    "[kfree] Pointer not aligned to "
-					    "object boundary\n");
-					return false;
-				}
-
-				int index = offset / cache->object_size;
-
-				if (index >= 0 &&
-				    (uint32_t)index < cache->objects_per_slab) {
-					*out_cache = cache;
-					*out_slab = slab;
-					*out_index = index;
-					return true;
-				}
-			}
-			slab = slab->next;
-		}
-
-		/* Check full slabs */
-		slab = cache->full;
-		while (slab != NULL) {
-			if ((uintptr_t)ptr >= (uintptr_t)slab &&
-			    (uintptr_t)ptr < (uintptr_t)slab + PAGE_SIZE) {
-				if ((uintptr_t)ptr < (uintptr_t)slab->objects) {
-					serial_printf(
-					    DEBUG_PORT,
-					    "[kfree] Invalid pointer in slab "
-					    "header region\n");
-					return false;
-				}
-
-				uintptr_t offset =
-				    (uintptr_t)ptr - (uintptr_t)slab->objects;
-
-				if (offset % cache->object_size != 0) {
-					serial_printf(
-					    DEBUG_PORT,
-					    "[kfree] Pointer not aligned to "
-					    "object boundary\n");
-					return false;
-				}
-
-				int index = offset / cache->object_size;
-
-				if (index >= 0 &&
-				    (uint32_t)index < cache->objects_per_slab) {
-					*out_cache = cache;
-					*out_slab = slab;
-					*out_index = index;
-					return true;
-				}
-			}
-			slab = slab->next;
-		}
+	struct page *page = virt_to_page(ptr);
+	if (page == NULL || !(page->flags & PG_SLAB)) {
+		return false;
 	}
 
-	return false;
-}
+	slab_t *slab = (slab_t *)page->owner;
+	cache_t *cache = slab->cache;
 
-static void
-slab_remove_from_list(slab_t **list, slab_t *slab)
-{
-	if (*list == slab) {
-		*list = slab->next;
-		return;
+	if ((uintptr_t)ptr < (uintptr_t)slab->objects) {
+		serial_printf(DEBUG_PORT,
+		              "[kfree] Invalid pointer in slab header region\n");
+		return false;
 	}
 
-	slab_t *current = *list;
-	while (current != NULL && current->next != slab) {
-		current = current->next;
+	uint32_t index = slab_obj_index(cache, slab, ptr);
+
+	if ((uint8_t *)slab->objects + (size_t)index * cache->object_size !=
+	    (uint8_t *)ptr) {
+		serial_printf(DEBUG_PORT,
+		              "[kfree] Pointer not aligned to object boundary\n");
+		return false;
 	}
 
-	if (current != NULL) {
-		current->next = slab->next;
+	if (index >= cache->objects_per_slab) {
+		return false;
 	}
+
+	*out_cache = cache;
+	*out_slab = slab;
+	*out_index = index;
+	return true;
 }
 
 static bool
@@ -133,47 +70,53 @@ is_object_free(slab_t *slab, int index)
 	return (slab->free_bitmap[bitmap_index] & (1ULL << bit_index)) != 0;
 }
 
-static void
-cache_free(cache_t *cache, slab_t *slab, int obj_index)
+/* Slab layer free, called with cache->lock held */
+void
+slab_free_object(cache_t *cache, slab_t *slab, void *obj, int obj_index)
 {
-	if (is_object_free(slab, obj_index)) {
-		serial_printf(
-		    DEBUG_PORT,
-		    "[kfree] WARNING: Double-free detected in cache %s\n",
-		    cache->name);
-		return;
-	}
-
 	slab_mark_free(slab, obj_index);
+	*slab_obj_link(cache, obj) = slab->freelist;
+	slab->freelist = obj;
 	cache->free_count++;
 
-	bool was_full = (slab->free_count == 1); /* Was full before this free */
-	bool is_empty = (slab->free_count == slab->total_count);
-
-	if (was_full) {
-		slab_remove_from_list(&cache->full, slab);
-		slab->next = cache->partial;
-		cache->partial = slab;
-	} else if (is_empty) {
-		slab_remove_from_list(&cache->partial, slab);
-
-		int empty_count = 0;
-		slab_t *temp = cache->empty;
-		while (temp != NULL && empty_count < 2) {
-			empty_count++;
-			temp = temp->next;
-		}
+	if (slab->free_count == 1) {
+		/* Was full before this free */
+		slab_list_del(&cache->full, slab);
+		slab_list_add(&cache->partial, slab);
+	}
 
-		if (empty_count < 2) {
-			slab->next = cache->empty;
-			cache->empty = slab;
+	if (slab->free_count == slab->total_count) {
+		slab_list_del(&cache->partial, slab);
+
+		if (cache->empty_count < 2) {
+			slab_list_add(&cache->empty, slab);
+			cache->empty_count++;
 		} else {
-			pmm_free(slab);
+			slab_destroy(cache, slab);
 		}
 	}
 	/* If it was partial and is still partial, no list movement needed */
 }
 
+static void
+object_free(cache_t *cache, slab_t *slab, void *ptr, int obj_index)
+{
+	if (is_object_free(slab, obj_index)) {
+		serial_printf(DEBUG_PORT,
+		              "[kfree] WARNING: Double-free detected in cache %s\n",
+		              cache->name);
+		return;
+	}
+
+	if (magazine_free(cache, ptr)) {
+		return;
+	}
+
+	spinlock_acquire(&cache->lock);
+	slab_free_object(cache, slab, ptr, obj_index);
+	spinlock_release(&cache->lock);
+}
+
 bool
 kfree_validate(void *ptr)
 {
@@ -185,7 +128,16 @@ kfree_validate(void *ptr)
 	slab_t *slab;
 	int index;
 
-	return find_allocation(ptr, &cache, &slab, &index);
+	if (find_allocation(ptr, &cache, &slab, &index)) {
+		return true;
+	}
+
+	if (is_vmalloc_addr(ptr)) {
+		return vmalloc_size(ptr) != 0;
+	}
+
+	struct page *page = virt_to_page(ptr);
+	return page != NULL && (page->flags & PG_LARGE);
 }
 
 void
@@ -195,14 +147,55 @@ kfree(void *ptr)
 		return;
 	}
 
+	KMPROF_FREE(KMPROF_KMALLOC, ptr);
+
 	cache_t *cache;
 	slab_t *slab;
 	int obj_index;
 
 	if (find_allocation(ptr, &cache, &slab, &obj_index)) {
-		cache_free(cache, slab, obj_index);
+		object_free(cache, slab, ptr, obj_index);
+		return;
+	}
+
+	if (is_vmalloc_addr(ptr)) {
+		vfree(ptr);
+		return;
+	}
+
+	struct page *page = virt_to_page(ptr);
+	if (page != NULL && (page->flags & PG_LARGE)) {
+		size_t num_pages = page->private;
+
+		page->flags &= ~PG_LARGE;
+		pmm_free_contiguous(ptr, num_pages);
 		return;
 	}
 
 	pmm_free(ptr);
-}
\ No newline at end of file
+}
+
+void
+kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+	if (obj == NULL) {
+		return;
+	}
+
+	KMPROF_FREE(KMPROF_KMALLOC, obj);
+
+	cache_t *owner;
+	slab_t *slab;
+	int obj_index;
+
+	if (!find_allocation(obj, &owner, &slab, &obj_index) ||
+	    owner != cache) {
+		serial_printf(DEBUG_PORT,
+		              "[kfree] %p was not allocated from cache %s\n",
+		              obj,
+		              cache != NULL ? cache->name : "(null)");
+		return;
+	}
+
+	object_free(cache, slab, obj, obj_index);
+}
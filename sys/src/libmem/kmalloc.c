@@ -1,7 +1,11 @@
 #include <kmalloc.h>
 #include <kfree.h>
 #include <pmm.h>
+#include <vmalloc.h>
+#include <kmprof.h>
+#include <mempool.h>
 #include <paging.h>
+#include <intr.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -10,75 +14,247 @@ extern void serial_printf(uint16_t port, const char *fmt, ...);
 #define DEBUG_PORT 0x3F8
 
 cache_t caches[CACHE_COUNT];
+static cache_t magazine_cache; /* Slab cache the magazines come from */
+static cache_t kmem_cache_cache; /* Slab cache kmem_cache_t comes from */
+static cache_t *kmem_caches = NULL; /* Caches made by kmem_cache_create() */
+static spinlock_t kmem_caches_lock = SPINLOCK_INITIALIZER("kmem_caches");
 static bool kmalloc_initialized = false;
+static mempool_t *kmalloc_reserves[CACHE_COUNT]; /* For KMALLOC_ATOMIC */
 
 static const size_t cache_sizes[CACHE_COUNT] = { 16,  32,   64,   128,  256,
 	                                         512, 1024, 2048, 4096, 8192 };
 
+#define CACHE_MIN_SHIFT 4 /* log2(KMALLOC_MIN_SIZE) */
+
 static inline int
 get_cache_index(size_t size)
 {
-	for (int i = 0; i < CACHE_COUNT; i++) {
-		if (size <= cache_sizes[i]) {
-			return i;
-		}
+	if (size <= KMALLOC_MIN_SIZE) {
+		return 0;
 	}
-	return -1; /* Size too large for caching */
+	if (size > KMALLOC_MAX_SIZE) {
+		return -1; /* Size too large for caching */
+	}
+
+	/* Caches are powers of two, so round up to the next one */
+	return 64 - __builtin_clzll(size - 1) - CACHE_MIN_SHIFT;
 }
 
-static uint32_t
-calculate_objects_per_slab(size_t object_size, size_t align)
+void
+slab_list_add(slab_t **list, slab_t *slab)
 {
-	/* Reserve space for slab header */
-	size_t header_base = sizeof(slab_t);
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list != NULL) {
+		(*list)->prev = slab;
+	}
+	*list = slab;
+}
 
-	uint32_t estimated_objects = 200; /* Start with reasonable estimate */
-	size_t bitmap_size = (estimated_objects + 63) / 64 * sizeof(uint64_t);
+void
+slab_list_del(slab_t **list, slab_t *slab)
+{
+	if (slab->prev != NULL) {
+		slab->prev->next = slab->next;
+	} else {
+		*list = slab->next;
+	}
+	if (slab->next != NULL) {
+		slab->next->prev = slab->prev;
+	}
+	slab->next = NULL;
+	slab->prev = NULL;
+}
+
+#define SLAB_MAX_OBJECTS 256 /* Bitmap bits a slab header can hold */
+#define SLAB_MAX_ORDER 3     /* Largest slab is 8 pages */
+#define SLAB_WASTE_FRACTION 8 /* Aim to leave at most 1/8 of a slab unused */
+#define SLAB_OFF_SLAB_MIN (PAGE_SIZE / 8) /* Header moves out from here */
+#define SLAB_HEADER_SIZE (sizeof(slab_t) + SLAB_MAX_OBJECTS / 8)
+
+/* Headers of off-slab slabs, themselves kept on-slab */
+static cache_t slab_header_cache;
+
+/* Bytes in front of the first object of an on-slab slab */
+static size_t
+slab_header_size(uint32_t objects, size_t align)
+{
+	size_t header = sizeof(slab_t) + (objects + 63) / 64 * sizeof(uint64_t);
 
-	/* Calculate aligned start for objects */
-	size_t header_total = header_base + bitmap_size;
-	size_t aligned_start = (header_total + align - 1) & ~(align - 1);
+	return (header + align - 1) & ~(align - 1);
+}
 
-	size_t usable_size = PAGE_SIZE - aligned_start;
+/* Objects that fit a slab of the given size, possibly 0 */
+static uint32_t
+slab_capacity(size_t object_size, size_t align, size_t bytes, bool off_slab)
+{
+	uint32_t objects = bytes / object_size;
 
-	uint32_t objects = usable_size / object_size;
+	if (objects > SLAB_MAX_OBJECTS)
+		objects = SLAB_MAX_OBJECTS;
 
-	/* Ensure we don't exceed reasonable limits */
-	if (objects > 256)
-		objects = 256;
-	if (objects < 1)
-		objects = 1;
+	if (!off_slab) {
+		while (objects > 0 && slab_header_size(objects, align) +
+		                              (size_t)objects * object_size >
+		                          bytes)
+			objects--;
+	}
 
 	return objects;
 }
 
+/*
+ * Pick the smallest slab order that leaves at most 1/SLAB_WASTE_FRACTION
+ * of the slab unused, or failing that the least wasteful order.  Large
+ * objects keep their header off-slab so it does not cost a whole object.
+ */
+static void
+cache_layout(cache_t *cache)
+{
+	bool off_slab = cache->object_size >= SLAB_OFF_SLAB_MIN;
+	uint32_t best_order = 0;
+	uint32_t best_objects = 0;
+	size_t best_waste = 0;
+
+	for (uint32_t order = 0; order <= SLAB_MAX_ORDER; order++) {
+		size_t bytes = (size_t)PAGE_SIZE << order;
+		uint32_t objects = slab_capacity(
+		    cache->object_size, cache->align, bytes, off_slab);
+
+		if (objects == 0)
+			continue;
+
+		size_t waste = bytes - (size_t)objects * cache->object_size;
+		if (best_objects == 0 ||
+		    waste * ((size_t)PAGE_SIZE << best_order) <
+		        best_waste * bytes) {
+			best_order = order;
+			best_objects = objects;
+			best_waste = waste;
+		}
+
+		if (waste * SLAB_WASTE_FRACTION <= bytes)
+			break;
+	}
+
+	cache->slab_order = best_order;
+	cache->off_slab = off_slab;
+	cache->objects_per_slab = best_objects;
+
+	/*
+	 * Spend the leftover bytes on coloring: successive slabs start their
+	 * first object one cache line further in, so the same object index
+	 * in different slabs does not land in the same cache sets.
+	 */
+	size_t used = (size_t)best_objects * cache->object_size;
+	if (!off_slab) {
+		used += slab_header_size(best_objects, cache->align);
+	}
+	size_t leftover = ((size_t)PAGE_SIZE << best_order) - used;
+
+	cache->color_unit = cache->align > KMEM_CACHE_LINE ? cache->align
+	                                                   : KMEM_CACHE_LINE;
+	cache->color_count = best_objects > 0
+	                         ? (uint32_t)(leftover / cache->color_unit) + 1
+	                         : 1;
+	cache->color_next = 0;
+}
+
 static void
 cache_init(cache_t *cache, const char *name, size_t object_size, size_t align)
 {
 	cache->name = name;
 	cache->object_size = object_size;
 	cache->align = align;
-	cache->objects_per_slab =
-	    calculate_objects_per_slab(object_size, align);
+	cache->free_offset = 0;
+	cache->ctor = NULL;
+	cache->dtor = NULL;
+	cache->next = NULL;
+	cache->size_recip =
+	    (uint32_t)(((1ULL << 32) + object_size - 1) / object_size);
+	cache_layout(cache);
 	cache->partial = NULL;
 	cache->full = NULL;
 	cache->empty = NULL;
+	cache->empty_count = 0;
 	cache->alloc_count = 0;
 	cache->free_count = 0;
+	cache->mag_size = 0;
+	cache->depot_full = NULL;
+	cache->depot_empty = NULL;
+	cache->depot_full_count = 0;
+	cache->depot_empty_count = 0;
+	spinlock_init(&cache->lock, name);
+	memset(cache->cpu, 0, sizeof(cache->cpu));
+}
+
+/*
+ * Small objects are allocated in bursts, so they get deep magazines; large
+ * ones would pin too much memory in rounds.
+ */
+static uint32_t
+default_magazine_size(size_t object_size)
+{
+	if (object_size <= 256) {
+		return 32;
+	}
+	if (object_size <= 1024) {
+		return 16;
+	}
+	return 4;
 }
 
+static void *internal_alloc(cache_t *cache);
+static void internal_free(cache_t *cache, void *obj);
+
 static slab_t *
 slab_create(cache_t *cache)
 {
-	void *page = pmm_alloc();
-	if (page == NULL) {
+	size_t pages = (size_t)1 << cache->slab_order;
+	void *mem = pmm_alloc_order(cache->slab_order);
+	if (mem == NULL) {
 		serial_printf(DEBUG_PORT,
 		              "[kmalloc] Failed to allocate page for slab\n");
 		return NULL;
 	}
 
-	slab_t *slab = (slab_t *)page;
+	slab_t *slab;
+	if (cache->off_slab) {
+		slab = internal_alloc(&slab_header_cache);
+		if (slab == NULL) {
+			pmm_free_order(mem, cache->slab_order);
+			return NULL;
+		}
+		slab->objects = mem;
+	} else {
+		slab = (slab_t *)mem;
+		slab->objects =
+		    (uint8_t *)mem +
+		    slab_header_size(cache->objects_per_slab, cache->align);
+	}
+
+	spinlock_acquire(&cache->lock);
+	uint32_t color = cache->color_next;
+	if (++cache->color_next == cache->color_count) {
+		cache->color_next = 0;
+	}
+	spinlock_release(&cache->lock);
+
+	slab->objects =
+	    (uint8_t *)slab->objects + (size_t)color * cache->color_unit;
+
 	slab->next = NULL;
+	slab->prev = NULL;
+	slab->cache = cache;
+	slab->mem = mem;
+
+	/* Let kfree() find the slab from any object address */
+	for (size_t i = 0; i < pages; i++) {
+		struct page *desc =
+		    virt_to_page((uint8_t *)mem + i * PAGE_SIZE);
+		desc->flags |= PG_SLAB;
+		desc->owner = slab;
+	}
 	slab->total_count = cache->objects_per_slab;
 	slab->free_count = cache->objects_per_slab;
 
@@ -99,36 +275,19 @@ slab_create(cache_t *cache)
 		slab->free_bitmap[bitmap_size - 1] = mask;
 	}
 
-	size_t header_size = sizeof(slab_t) + (bitmap_size * sizeof(uint64_t));
-	size_t aligned_header =
-	    (header_size + cache->align - 1) & ~(cache->align - 1);
-	slab->objects = (void *)((uint8_t *)page + aligned_header);
-
-	return slab;
-}
-
-static int
-slab_find_free(slab_t *slab, cache_t *cache)
-{
-	size_t bitmap_size = (cache->objects_per_slab + 63) / 64;
+	/* Thread the free list through the objects, lowest address first */
+	slab->freelist = NULL;
+	for (uint32_t i = slab->total_count; i-- > 0;) {
+		void *obj = (uint8_t *)slab->objects + i * cache->object_size;
 
-	for (size_t i = 0; i < bitmap_size; i++) {
-		if (slab->free_bitmap[i] != 0) {
-			/* Find first set bit */
-			uint64_t bits = slab->free_bitmap[i];
-			for (int bit = 0; bit < 64; bit++) {
-				if (bits & (1ULL << bit)) {
-					int index = (i * 64) + bit;
-					if ((uint32_t)index <
-					    cache->objects_per_slab) {
-						return index;
-					}
-				}
-			}
+		if (cache->ctor != NULL) {
+			cache->ctor(obj);
 		}
+		*slab_obj_link(cache, obj) = slab->freelist;
+		slab->freelist = obj;
 	}
 
-	return -1;
+	return slab;
 }
 
 static void
@@ -140,35 +299,35 @@ slab_mark_allocated(slab_t *slab, int index)
 	slab->free_count--;
 }
 
+/*
+ * Slab layer allocation, called with cache->lock held.  Returns NULL when
+ * every slab is full; growing the cache is left to slab_alloc().
+ */
 static void *
-cache_alloc(cache_t *cache, uint32_t flags)
+slab_alloc_object(cache_t *cache)
 {
 	slab_t *slab = cache->partial;
 
 	/* If no partial slabs, try to get one from empty list */
 	if (slab == NULL) {
-		if (cache->empty != NULL) {
-			slab = cache->empty;
-			cache->empty = slab->next;
-			slab->next = NULL;
-			cache->partial = slab;
-		} else {
-			slab = slab_create(cache);
-			if (slab == NULL) {
-				return NULL;
-			}
-			cache->partial = slab;
+		if (cache->empty == NULL) {
+			return NULL;
 		}
+		slab = cache->empty;
+		slab_list_del(&cache->empty, slab);
+		cache->empty_count--;
+		slab_list_add(&cache->partial, slab);
 	}
 
-	int obj_index = slab_find_free(slab, cache);
-	if (obj_index < 0) {
+	void *obj = slab->freelist;
+	if (obj == NULL) {
 		serial_printf(
 		    DEBUG_PORT,
 		    "[kmalloc] BUG: No free object in partial slab\n");
 		return NULL;
 	}
 
+	int obj_index = slab_obj_index(cache, slab, obj);
 	size_t bitmap_index = obj_index / 64;
 	size_t bit_index = obj_index % 64;
 	if (!(slab->free_bitmap[bitmap_index] & (1ULL << bit_index))) {
@@ -178,19 +337,403 @@ cache_alloc(cache_t *cache, uint32_t flags)
 		return NULL;
 	}
 
-	void *obj = (uint8_t *)slab->objects + (obj_index * cache->object_size);
-
+	slab->freelist = *slab_obj_link(cache, obj);
 	slab_mark_allocated(slab, obj_index);
 
 	/* If slab is now full, move it to full list */
 	if (slab->free_count == 0) {
-		cache->partial = slab->next;
-		slab->next = cache->full;
-		cache->full = slab;
+		slab_list_del(&cache->partial, slab);
+		slab_list_add(&cache->full, slab);
 	}
 
 	cache->alloc_count++;
 
+	return obj;
+}
+
+static inline int
+kmalloc_cpu_id(void)
+{
+	/* Single CPU until APIC IDs are wired up, as in spinlock.c */
+	return 0;
+}
+
+/* Give an empty slab's pages back, destructing its objects first */
+void
+slab_destroy(cache_t *cache, slab_t *slab)
+{
+	if (cache->dtor != NULL) {
+		for (uint32_t i = 0; i < slab->total_count; i++) {
+			cache->dtor((uint8_t *)slab->objects +
+			            i * cache->object_size);
+		}
+	}
+
+	void *mem = slab->mem;
+
+	if (cache->off_slab) {
+		internal_free(&slab_header_cache, slab);
+	}
+
+	pmm_free_order(mem, cache->slab_order);
+}
+
+/*
+ * Allocate from the slab layer, growing the cache when it is full.  The
+ * new slab is built without cache->lock held: the PMM may run shrinkers
+ * under memory pressure, and those free objects back into caches.
+ */
+static void *
+slab_alloc(cache_t *cache)
+{
+	spinlock_acquire(&cache->lock);
+	void *obj = slab_alloc_object(cache);
+	spinlock_release(&cache->lock);
+
+	if (obj != NULL) {
+		return obj;
+	}
+
+	slab_t *slab = slab_create(cache);
+	if (slab == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&cache->lock);
+	slab_list_add(&cache->partial, slab);
+	obj = slab_alloc_object(cache);
+	spinlock_release(&cache->lock);
+
+	return obj;
+}
+
+/* Allocator bookkeeping goes straight to the slab layer of its cache */
+static void *
+internal_alloc(cache_t *cache)
+{
+	return slab_alloc(cache);
+}
+
+static void
+internal_free(cache_t *cache, void *obj)
+{
+	slab_t *slab = (slab_t *)virt_to_page(obj)->owner;
+
+	spinlock_acquire(&cache->lock);
+	slab_free_object(cache, slab, obj, slab_obj_index(cache, slab, obj));
+	spinlock_release(&cache->lock);
+}
+
+static magazine_t *
+magazine_create(void)
+{
+	magazine_t *mag = internal_alloc(&magazine_cache);
+
+	if (mag != NULL) {
+		mag->next = NULL;
+		mag->rounds = 0;
+	}
+
+	return mag;
+}
+
+static void
+magazine_destroy(magazine_t *mag)
+{
+	internal_free(&magazine_cache, mag);
+}
+
+/* Hand every round back to its slab, called with cache->lock held */
+static void
+magazine_flush(cache_t *cache, magazine_t *mag)
+{
+	while (mag->rounds > 0) {
+		void *obj = mag->objs[--mag->rounds];
+		slab_t *slab = (slab_t *)virt_to_page(obj)->owner;
+
+		slab_free_object(
+		    cache, slab, obj, slab_obj_index(cache, slab, obj));
+	}
+}
+
+/*
+ * Rounds show as free in their slab's bitmap, so kfree() still catches a
+ * second free of an object parked in a magazine.  Only the bit moves;
+ * free_count and the freelist catch up in magazine_flush().  Called with
+ * interrupts off, which like the rest of the magazine layer relies on
+ * KMALLOC_MAXCPU being 1.
+ */
+static void
+magazine_mark(void *obj, bool cached)
+{
+	slab_t *slab = (slab_t *)virt_to_page(obj)->owner;
+	uint32_t index = slab_obj_index(slab->cache, slab, obj);
+	uint64_t bit = 1ULL << (index % 64);
+
+	if (cached) {
+		slab->free_bitmap[index / 64] |= bit;
+	} else {
+		slab->free_bitmap[index / 64] &= ~bit;
+	}
+}
+
+static magazine_t *
+depot_get(magazine_t **list, uint32_t *count)
+{
+	magazine_t *mag = *list;
+
+	if (mag != NULL) {
+		*list = mag->next;
+		mag->next = NULL;
+		(*count)--;
+	}
+
+	return mag;
+}
+
+static void
+depot_put(magazine_t **list, uint32_t *count, magazine_t *mag)
+{
+	mag->next = *list;
+	*list = mag;
+	(*count)++;
+}
+
+/*
+ * Allocate from this CPU's magazines.  The loaded magazine is tried first,
+ * then the previous one; only when both are empty is the depot locked to
+ * trade an empty magazine for one holding objects.
+ */
+static void *
+magazine_alloc(cache_t *cache)
+{
+	cpu_cache_t *cc = &cache->cpu[kmalloc_cpu_id()];
+	magazine_t *spare = NULL;
+	void *obj = NULL;
+	uint64_t flags = intr_disable();
+
+	if (cc->loaded == NULL || cc->loaded->rounds == 0) {
+		if (cc->previous != NULL && cc->previous->rounds > 0) {
+			magazine_t *tmp = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = tmp;
+		} else {
+			spinlock_acquire(&cache->lock);
+			magazine_t *full = depot_get(&cache->depot_full,
+			                             &cache->depot_full_count);
+			if (full != NULL) {
+				if (cc->previous == NULL) {
+					/* Nothing to give back */
+				} else if (cache->depot_empty_count <
+				           KMALLOC_DEPOT_MAX) {
+					depot_put(&cache->depot_empty,
+					          &cache->depot_empty_count,
+					          cc->previous);
+				} else {
+					spare = cc->previous;
+				}
+				cc->previous = cc->loaded;
+				cc->loaded = full;
+			}
+			spinlock_release(&cache->lock);
+		}
+	}
+
+	if (cc->loaded != NULL && cc->loaded->rounds > 0) {
+		obj = cc->loaded->objs[--cc->loaded->rounds];
+		magazine_mark(obj, false);
+		cc->hits++;
+	} else {
+		cc->misses++;
+	}
+
+	intr_restore(flags);
+
+	if (spare != NULL) {
+		magazine_destroy(spare);
+	}
+
+	return obj;
+}
+
+/*
+ * Free into this CPU's magazines, trading a full magazine for an empty one
+ * at the depot when both are full.  kfree() checks for double frees before
+ * calling this, and magazine_mark() keeps cached objects visible to it.
+ */
+bool
+magazine_free(cache_t *cache, void *obj)
+{
+	if (cache->mag_size == 0) {
+		return false;
+	}
+
+	cpu_cache_t *cc = &cache->cpu[kmalloc_cpu_id()];
+	magazine_t *spare = NULL;
+	bool done = false;
+	uint64_t flags = intr_disable();
+
+	if (cc->loaded == NULL || cc->loaded->rounds >= cache->mag_size) {
+		if (cc->previous != NULL &&
+		    cc->previous->rounds < cache->mag_size) {
+			magazine_t *tmp = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = tmp;
+		} else {
+			spinlock_acquire(&cache->lock);
+			magazine_t *empty = depot_get(
+			    &cache->depot_empty, &cache->depot_empty_count);
+			spinlock_release(&cache->lock);
+
+			if (empty == NULL) {
+				empty = magazine_create();
+			}
+
+			if (empty != NULL) {
+				spinlock_acquire(&cache->lock);
+				if (cc->previous == NULL) {
+					/* Nothing to give back */
+				} else if (cache->depot_full_count <
+				           KMALLOC_DEPOT_MAX) {
+					depot_put(&cache->depot_full,
+					          &cache->depot_full_count,
+					          cc->previous);
+				} else {
+					magazine_flush(cache, cc->previous);
+					spare = cc->previous;
+				}
+				spinlock_release(&cache->lock);
+
+				cc->previous = cc->loaded;
+				cc->loaded = empty;
+			}
+		}
+	}
+
+	if (cc->loaded != NULL && cc->loaded->rounds < cache->mag_size) {
+		magazine_mark(obj, true);
+		cc->loaded->objs[cc->loaded->rounds++] = obj;
+		cc->hits++;
+		done = true;
+	} else {
+		cc->misses++;
+	}
+
+	intr_restore(flags);
+
+	if (spare != NULL) {
+		magazine_destroy(spare);
+	}
+
+	return done;
+}
+
+/*
+ * Return every cached object to the slabs and free the magazines.  Other
+ * CPUs' magazines are only safe to touch while those CPUs are not in the
+ * allocator; with KMALLOC_MAXCPU at 1 that is always the case here.
+ */
+void
+cache_drain_magazines(cache_t *cache)
+{
+	magazine_t *dead = NULL;
+	uint32_t dead_count = 0;
+
+	spinlock_acquire(&cache->lock);
+
+	for (int cpu = 0; cpu < KMALLOC_MAXCPU; cpu++) {
+		cpu_cache_t *cc = &cache->cpu[cpu];
+		magazine_t *mags[2] = { cc->loaded, cc->previous };
+
+		for (int i = 0; i < 2; i++) {
+			if (mags[i] != NULL) {
+				magazine_flush(cache, mags[i]);
+				depot_put(&dead, &dead_count, mags[i]);
+			}
+		}
+		cc->loaded = NULL;
+		cc->previous = NULL;
+	}
+
+	magazine_t *mag;
+	while ((mag = depot_get(&cache->depot_full,
+	                        &cache->depot_full_count)) != NULL) {
+		magazine_flush(cache, mag);
+		depot_put(&dead, &dead_count, mag);
+	}
+	while ((mag = depot_get(&cache->depot_empty,
+	                        &cache->depot_empty_count)) != NULL) {
+		depot_put(&dead, &dead_count, mag);
+	}
+
+	spinlock_release(&cache->lock);
+
+	while ((mag = depot_get(&dead, &dead_count)) != NULL) {
+		magazine_destroy(mag);
+	}
+}
+
+/*
+ * Give a cache's idle memory back to the PMM.  Objects parked in depot
+ * magazines go back to their slabs, then every empty slab is released.
+ * The per-CPU magazines are the hot path and are left alone.  A busy
+ * cache is skipped, which keeps this safe to call from reclaim.
+ */
+static size_t
+cache_reap(cache_t *cache)
+{
+	magazine_t *dead = NULL;
+	uint32_t dead_count = 0;
+	size_t pages = 0;
+	magazine_t *mag;
+	slab_t *slab;
+
+	if (!spinlock_try_acquire(&cache->lock)) {
+		return 0;
+	}
+
+	while ((mag = depot_get(&cache->depot_full,
+	                        &cache->depot_full_count)) != NULL) {
+		magazine_flush(cache, mag);
+		depot_put(&dead, &dead_count, mag);
+	}
+	while ((mag = depot_get(&cache->depot_empty,
+	                        &cache->depot_empty_count)) != NULL) {
+		depot_put(&dead, &dead_count, mag);
+	}
+
+	while ((slab = cache->empty) != NULL) {
+		slab_list_del(&cache->empty, slab);
+		slab_destroy(cache, slab);
+		pages += (size_t)1 << cache->slab_order;
+	}
+	cache->empty_count = 0;
+
+	spinlock_release(&cache->lock);
+
+	while ((mag = depot_get(&dead, &dead_count)) != NULL) {
+		magazine_destroy(mag);
+	}
+
+	return pages;
+}
+
+static void *
+cache_alloc(cache_t *cache, uint32_t flags)
+{
+	void *obj = NULL;
+
+	if (cache->mag_size > 0) {
+		obj = magazine_alloc(cache);
+	}
+
+	if (obj == NULL) {
+		obj = slab_alloc(cache);
+		if (obj == NULL) {
+			return NULL;
+		}
+	}
+
 	if (flags & KMALLOC_ZERO) {
 		memset(obj, 0, cache->object_size);
 	}
@@ -198,6 +741,71 @@ cache_alloc(cache_t *cache, uint32_t flags)
 	return obj;
 }
 
+/*
+ * Allocations above KMALLOC_MAX_SIZE come straight from the PMM.  The head
+ * page is tagged PG_LARGE with the page count so kfree() can release the
+ * whole run and kmalloc_size() can report it.  When physical memory is too
+ * fragmented for a contiguous run the request is served by vmalloc().
+ */
+static void *
+large_alloc(size_t size, uint32_t flags)
+{
+	size_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	void *ptr = pmm_try_alloc_contiguous(num_pages);
+
+	if (ptr == NULL) {
+		/* vmalloc() memory is already zeroed */
+		return vmalloc(size);
+	}
+
+	struct page *page = virt_to_page(ptr);
+	page->flags |= PG_LARGE;
+	page->private = num_pages;
+
+	if (flags & KMALLOC_ZERO) {
+		memset(ptr, 0, num_pages * PAGE_SIZE);
+	}
+
+	return ptr;
+}
+
+/* The KMALLOC_ATOMIC reserves refill straight from their size class */
+static void *
+reserve_alloc(uint32_t flags, void *pool_data)
+{
+	return cache_alloc(pool_data, flags);
+}
+
+static void
+reserve_free(void *obj, void *pool_data)
+{
+	(void)pool_data;
+	kfree(obj);
+}
+
+static void
+reserve_init(void)
+{
+	for (int i = 0; i < CACHE_COUNT; i++) {
+		size_t nr = KMALLOC_RESERVE_BYTES / cache_sizes[i];
+
+		if (nr < 2) {
+			nr = 2;
+		} else if (nr > 32) {
+			nr = 32;
+		}
+
+		kmalloc_reserves[i] = mempool_create(caches[i].name,
+		                                     (uint32_t)nr,
+		                                     reserve_alloc,
+		                                     reserve_free,
+		                                     &caches[i]);
+		if (kmalloc_reserves[i] != NULL) {
+			kmalloc_reserves[i]->elem_size = cache_sizes[i];
+		}
+	}
+}
+
 void
 kmalloc_init(void)
 {
@@ -214,23 +822,42 @@ kmalloc_init(void)
 		"kmalloc-4096", "kmalloc-8192"
 	};
 
+	cache_init(&slab_header_cache,
+	           "slab-header",
+	           SLAB_HEADER_SIZE,
+	           sizeof(void *));
+	cache_init(&magazine_cache,
+	           "kmalloc-magazine",
+	           sizeof(magazine_t),
+	           sizeof(void *));
+	cache_init(&kmem_cache_cache, "kmem_cache", sizeof(cache_t), 64);
+
 	for (int i = 0; i < CACHE_COUNT; i++) {
 		cache_init(
 		    &caches[i], cache_names[i], cache_sizes[i], cache_sizes[i]);
+		caches[i].mag_size = default_magazine_size(cache_sizes[i]);
 		serial_printf(
 		    DEBUG_PORT,
-		    "[kmalloc] Created cache: %s (%u bytes, %u objs/slab)\n",
+		    "[kmalloc] Created cache: %s (%u bytes, %u objs/slab, "
+		    "order %u, %u rounds/magazine)\n",
 		    cache_names[i],
 		    (unsigned int)cache_sizes[i],
-		    caches[i].objects_per_slab);
+		    caches[i].objects_per_slab,
+		    caches[i].slab_order,
+		    caches[i].mag_size);
 	}
 
 	kmalloc_initialized = true;
+
+	/* Filling the reserves goes through kmalloc() itself */
+	reserve_init();
+
 	serial_printf(DEBUG_PORT, "[kmalloc] Initialization complete\n");
 }
 
-void *
-kmalloc_flags(size_t size, uint32_t flags)
+/* Entry points wrap this so the profiler sees their caller */
+static void *
+kmalloc_common(size_t size, uint32_t flags)
 {
 	if (!kmalloc_initialized) {
 		kmalloc_init();
@@ -240,46 +867,73 @@ kmalloc_flags(size_t size, uint32_t flags)
 		return NULL;
 	}
 
+	MEMPOOL_REFILL_CHECK(flags);
+
+	/* Caches from KMEM_CACHE_LINE up are aligned to their object size */
+	if ((flags & KMALLOC_CACHEALIGN) && size < KMEM_CACHE_LINE) {
+		size = KMEM_CACHE_LINE;
+	}
+
 	int cache_idx = get_cache_index(size);
 
 	if (cache_idx < 0) {
 		/* Size too large for slab allocator, use direct page allocation
 		 */
-		size_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-		void *ptr = pmm_alloc_contiguous(num_pages);
+		return large_alloc(size, flags);
+	}
 
+	void *ptr = cache_alloc(&caches[cache_idx], flags);
+
+	/* Callers that cannot wait for reclaim fall back on the reserve */
+	if (__predict_false(ptr == NULL) && (flags & KMALLOC_ATOMIC) &&
+	    kmalloc_reserves[cache_idx] != NULL) {
+		ptr = mempool_take(kmalloc_reserves[cache_idx]);
 		if (ptr != NULL && (flags & KMALLOC_ZERO)) {
-			memset(ptr, 0, num_pages * PAGE_SIZE);
+			memset(ptr, 0, cache_sizes[cache_idx]);
 		}
-
-		return ptr;
 	}
 
-	return cache_alloc(&caches[cache_idx], flags);
+	return ptr;
+}
+
+void *
+kmalloc_flags(size_t size, uint32_t flags)
+{
+	void *ptr = kmalloc_common(size, flags);
+
+	KMPROF_ALLOC(KMPROF_KMALLOC, ptr, size);
+	return ptr;
 }
 
 void *
 kmalloc(size_t size)
 {
-	return kmalloc_flags(size, 0);
+	void *ptr = kmalloc_common(size, 0);
+
+	KMPROF_ALLOC(KMPROF_KMALLOC, ptr, size);
+	return ptr;
 }
 
 void *
 kmalloc_aligned(size_t size, size_t align)
 {
-	if (align <= KMALLOC_MIN_SIZE) {
-		return kmalloc(size);
-	}
+	void *ptr;
 
-	size_t required = (size > align) ? size : align;
-	int cache_idx = get_cache_index(required);
+	if (align <= KMALLOC_MIN_SIZE) {
+		ptr = kmalloc_common(size, 0);
+	} else {
+		size_t required = (size > align) ? size : align;
+		int cache_idx = get_cache_index(required);
 
-	if (cache_idx < 0) {
-		size_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-		return pmm_alloc_contiguous(num_pages);
+		if (cache_idx < 0) {
+			ptr = large_alloc(size, 0);
+		} else {
+			ptr = kmalloc_common(cache_sizes[cache_idx], 0);
+		}
 	}
 
-	return kmalloc(cache_sizes[cache_idx]);
+	KMPROF_ALLOC(KMPROF_KMALLOC, ptr, size);
+	return ptr;
 }
 
 size_t
@@ -289,30 +943,284 @@ kmalloc_size(void *ptr)
 		return 0;
 	}
 
+	if (is_vmalloc_addr(ptr)) {
+		return vmalloc_size(ptr);
+	}
+
+	struct page *page = virt_to_page(ptr);
+	if (page == NULL) {
+		return 0;
+	}
+
+	if (page->flags & PG_SLAB) {
+		return ((slab_t *)page->owner)->cache->object_size;
+	}
+
+	if (page->flags & PG_LARGE) {
+		return (size_t)page->private * PAGE_SIZE;
+	}
+
+	return 0; /* Unknown size */
+}
+
+kmem_cache_t *
+kmem_cache_create(const char *name,
+                  size_t size,
+                  size_t align,
+                  void (*ctor)(void *obj),
+                  void (*dtor)(void *obj))
+{
+	if (!kmalloc_initialized) {
+		kmalloc_init();
+	}
+
+	if (name == NULL || size == 0) {
+		return NULL;
+	}
+
+	if (align == 0 || align < sizeof(void *)) {
+		align = sizeof(void *);
+	}
+	if (align & (align - 1)) {
+		serial_printf(DEBUG_PORT,
+		              "[kmalloc] %s: alignment %u is not a power of 2\n",
+		              name,
+		              (unsigned int)align);
+		return NULL;
+	}
+
+	/*
+	 * A constructed object must survive being free, so its free-list
+	 * link goes in a word past the end rather than over its first bytes.
+	 */
+	size_t free_offset = 0;
+	size_t object_size = size;
+	if (ctor != NULL) {
+		free_offset =
+		    (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+		object_size = free_offset + sizeof(void *);
+	}
+	object_size = (object_size + align - 1) & ~(align - 1);
+
+	cache_t *cache = internal_alloc(&kmem_cache_cache);
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	cache_init(cache, name, object_size, align);
+	if (cache->objects_per_slab == 0) {
+		serial_printf(DEBUG_PORT,
+		              "[kmalloc] %s: %u byte objects do not fit a slab\n",
+		              name,
+		              (unsigned int)object_size);
+		internal_free(&kmem_cache_cache, cache);
+		return NULL;
+	}
+	cache->free_offset = free_offset;
+	cache->ctor = ctor;
+	cache->dtor = dtor;
+	cache->mag_size = default_magazine_size(object_size);
+
+	spinlock_acquire(&kmem_caches_lock);
+	cache->next = kmem_caches;
+	kmem_caches = cache;
+	spinlock_release(&kmem_caches_lock);
+
+	serial_printf(
+	    DEBUG_PORT,
+	    "[kmalloc] Created cache: %s (%u bytes, %u objs/slab, order %u)\n",
+	    name,
+	    (unsigned int)object_size,
+	    cache->objects_per_slab,
+	    cache->slab_order);
+
+	return cache;
+}
+
+/*
+ * Release a cache made by kmem_cache_create().  Every object must have
+ * been freed; if not, the cache is left alive rather than freed under the
+ * objects still using it.
+ */
+void
+kmem_cache_destroy(kmem_cache_t *cache)
+{
+	if (cache == NULL) {
+		return;
+	}
+
+	cache->mag_size = 0;
+	cache_drain_magazines(cache);
+
+	spinlock_acquire(&cache->lock);
+	if (cache->partial != NULL || cache->full != NULL) {
+		spinlock_release(&cache->lock);
+		serial_printf(DEBUG_PORT,
+		              "[kmalloc] %s: destroying cache with objects in "
+		              "use, leaking it\n",
+		              cache->name);
+		return;
+	}
+
+	slab_t *slab;
+	while ((slab = cache->empty) != NULL) {
+		slab_list_del(&cache->empty, slab);
+		slab_destroy(cache, slab);
+	}
+	cache->empty_count = 0;
+	spinlock_release(&cache->lock);
+
+	spinlock_acquire(&kmem_caches_lock);
+	cache_t **link = &kmem_caches;
+	while (*link != NULL && *link != cache) {
+		link = &(*link)->next;
+	}
+	if (*link != NULL) {
+		*link = cache->next;
+	}
+	spinlock_release(&kmem_caches_lock);
+
+	internal_free(&kmem_cache_cache, cache);
+}
+
+void *
+kmem_cache_alloc(kmem_cache_t *cache, uint32_t flags)
+{
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	void *obj = cache_alloc(cache, flags);
+
+	KMPROF_ALLOC(KMPROF_KMALLOC, obj, cache->object_size);
+	return obj;
+}
+
+/*
+ * Reap every cache, returning the number of slab pages released.  The
+ * bookkeeping caches go last since reaping the others frees into them.
+ */
+size_t
+kmem_cache_reap(void)
+{
+	size_t pages = 0;
+
+	if (!kmalloc_initialized) {
+		return 0;
+	}
+
 	for (int i = 0; i < CACHE_COUNT; i++) {
-		cache_t *cache = &caches[i];
+		pages += cache_reap(&caches[i]);
+	}
 
-		/* Check all slabs in this cache */
-		slab_t *slab = cache->partial;
-		while (slab != NULL) {
-			if ((uintptr_t)ptr >= (uintptr_t)slab &&
-			    (uintptr_t)ptr < (uintptr_t)slab + PAGE_SIZE) {
-				return cache->object_size;
-			}
-			slab = slab->next;
+	if (spinlock_try_acquire(&kmem_caches_lock)) {
+		for (cache_t *cache = kmem_caches; cache != NULL;
+		     cache = cache->next) {
+			pages += cache_reap(cache);
 		}
+		spinlock_release(&kmem_caches_lock);
+	}
 
-		slab = cache->full;
-		while (slab != NULL) {
-			if ((uintptr_t)ptr >= (uintptr_t)slab &&
-			    (uintptr_t)ptr < (uintptr_t)slab + PAGE_SIZE) {
-				return cache->object_size;
-			}
-			slab = slab->next;
-		}
+	pages += cache_reap(&magazine_cache);
+	pages += cache_reap(&kmem_cache_cache);
+	pages += cache_reap(&slab_header_cache);
+
+	return pages;
+}
+
+/* Change the magazine depth of the cache serving size; 0 disables it */
+bool
+kmalloc_set_magazine_size(size_t size, uint32_t rounds)
+{
+	int cache_idx = get_cache_index(size);
+
+	if (cache_idx < 0 || rounds > KMALLOC_MAG_MAX) {
+		return false;
 	}
 
-	return 0; /* Unknown size */
+	cache_t *cache = &caches[cache_idx];
+
+	/* Stop new rounds from arriving, then empty what is cached */
+	cache->mag_size = 0;
+	cache_drain_magazines(cache);
+	cache->mag_size = rounds;
+
+	return true;
+}
+
+static void
+cache_print_stats(cache_t *cache)
+{
+	int partial_count = 0, full_count = 0, empty_count = 0;
+	uint64_t hits = 0, misses = 0, cached = 0;
+	slab_t *slab;
+	magazine_t *mag;
+
+	spinlock_acquire(&cache->lock);
+	for (slab = cache->partial; slab != NULL; slab = slab->next)
+		partial_count++;
+	for (slab = cache->full; slab != NULL; slab = slab->next)
+		full_count++;
+	for (slab = cache->empty; slab != NULL; slab = slab->next)
+		empty_count++;
+	for (mag = cache->depot_full; mag != NULL; mag = mag->next)
+		cached += mag->rounds;
+	for (int cpu = 0; cpu < KMALLOC_MAXCPU; cpu++) {
+		cpu_cache_t *cc = &cache->cpu[cpu];
+
+		hits += cc->hits;
+		misses += cc->misses;
+		if (cc->loaded != NULL)
+			cached += cc->loaded->rounds;
+		if (cc->previous != NULL)
+			cached += cc->previous->rounds;
+	}
+	spinlock_release(&cache->lock);
+
+	serial_printf(DEBUG_PORT, "%s:\n", cache->name);
+	serial_printf(DEBUG_PORT,
+	              "  Object size: %u bytes\n",
+	              (unsigned int)cache->object_size);
+	size_t slab_bytes = (size_t)PAGE_SIZE << cache->slab_order;
+	size_t waste = slab_bytes - cache->objects_per_slab * cache->object_size;
+
+	serial_printf(
+	    DEBUG_PORT, "  Objects per slab: %u\n", cache->objects_per_slab);
+	serial_printf(DEBUG_PORT,
+	              "  Slab order: %u (%u pages), header %s-slab\n",
+	              cache->slab_order,
+	              1U << cache->slab_order,
+	              cache->off_slab ? "off" : "on");
+	serial_printf(DEBUG_PORT,
+	              "  Colors: %u, %u bytes apart\n",
+	              cache->color_count,
+	              cache->color_unit);
+	serial_printf(DEBUG_PORT,
+	              "  Waste: %u bytes per slab (%u.%u%%)\n",
+	              (unsigned int)waste,
+	              (unsigned int)(waste * 100 / slab_bytes),
+	              (unsigned int)(waste * 1000 / slab_bytes % 10));
+	serial_printf(DEBUG_PORT,
+	              "  Slabs: %d partial, %d full, %d empty\n",
+	              partial_count,
+	              full_count,
+	              empty_count);
+	serial_printf(DEBUG_PORT,
+	              "  Allocations: %llu, Frees: %llu\n",
+	              cache->alloc_count,
+	              cache->free_count);
+	serial_printf(DEBUG_PORT,
+	              "  Magazines: %u rounds, %u full + %u empty in "
+	              "depot, %llu objects cached\n",
+	              cache->mag_size,
+	              cache->depot_full_count,
+	              cache->depot_empty_count,
+	              cached);
+	serial_printf(DEBUG_PORT,
+	              "  Magazine hits: %llu, misses: %llu (%llu%%)\n",
+	              hits,
+	              misses,
+	              (hits + misses) ? hits * 100 / (hits + misses) : 0ULL);
 }
 
 void
@@ -327,41 +1235,27 @@ kmalloc_stats(void)
 	for (int i = 0; i < CACHE_COUNT; i++) {
 		cache_t *cache = &caches[i];
 
-		int partial_count = 0, full_count = 0, empty_count = 0;
-		slab_t *slab;
+		cache_print_stats(cache);
 
-		for (slab = cache->partial; slab != NULL; slab = slab->next)
-			partial_count++;
-		for (slab = cache->full; slab != NULL; slab = slab->next)
-			full_count++;
-		for (slab = cache->empty; slab != NULL; slab = slab->next)
-			empty_count++;
+		total_allocs += cache->alloc_count;
+		total_frees += cache->free_count;
+	}
 
-		serial_printf(DEBUG_PORT, "%s:\n", cache->name);
-		serial_printf(DEBUG_PORT,
-		              "  Object size: %u bytes\n",
-		              (unsigned int)cache->object_size);
-		serial_printf(DEBUG_PORT,
-		              "  Objects per slab: %u\n",
-		              cache->objects_per_slab);
-		serial_printf(DEBUG_PORT,
-		              "  Slabs: %d partial, %d full, %d empty\n",
-		              partial_count,
-		              full_count,
-		              empty_count);
-		serial_printf(DEBUG_PORT,
-		              "  Allocations: %llu, Frees: %llu\n",
-		              cache->alloc_count,
-		              cache->free_count);
+	spinlock_acquire(&kmem_caches_lock);
+	for (cache_t *cache = kmem_caches; cache != NULL; cache = cache->next) {
+		cache_print_stats(cache);
 
 		total_allocs += cache->alloc_count;
 		total_frees += cache->free_count;
 	}
+	spinlock_release(&kmem_caches_lock);
 
 	serial_printf(DEBUG_PORT, "\nTotal allocations: %llu\n", total_allocs);
 	serial_printf(DEBUG_PORT, "Total frees: %llu\n", total_frees);
 	serial_printf(
 	    DEBUG_PORT, "Outstanding: %llu\n", total_allocs - total_frees);
+	vmalloc_stats();
+	mempool_stats();
 	serial_printf(DEBUG_PORT,
 	              "==========================================\n\n");
-}
\ No newline at end of file
+}
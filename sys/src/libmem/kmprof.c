@@ -0,0 +1,386 @@
+#include <kmprof.h>
+#include <pmm.h>
+#include <string.h>
+#include <sys/spinlock.h>
+
+extern void serial_printf(uint16_t port, const char *fmt, ...);
+#define DEBUG_PORT 0x3F8
+
+extern uint64_t tsc_get_time_ns(void);
+
+#define KMPROF_SITE_BITS 9    /* log2(KMPROF_SITES) */
+#define KMPROF_OBJECT_BITS 13 /* log2(KMPROF_OBJECTS) */
+#define KMPROF_LEAK_REPORT 32 /* Old objects printed per leak scan */
+
+struct kmprof_site {
+	void *caller;          /* Return address of the allocation call */
+	uint32_t kind;         /* enum kmprof_kind */
+	uint32_t live_objects; /* Tracked objects not yet freed */
+	uint64_t allocs;       /* Allocations since profiling started */
+	uint64_t frees;        /* Tracked objects freed */
+	uint64_t bytes;        /* Bytes allocated since profiling started */
+	uint64_t live_bytes;   /* Bytes in tracked live objects */
+};
+
+/* A live object; slots are empty while ptr is NULL */
+struct kmprof_object {
+	const void *ptr;
+	uint32_t size;
+	uint16_t site; /* Index into kmprof_sites */
+	uint16_t kind;
+	uint32_t born; /* Uptime in seconds at allocation */
+};
+
+volatile bool kmprof_enabled = false;
+
+static struct kmprof_site kmprof_sites[KMPROF_SITES];
+static struct kmprof_object kmprof_objects[KMPROF_OBJECTS];
+static uint32_t kmprof_site_count = 0;
+static uint32_t kmprof_object_count = 0;
+static uint64_t kmprof_dropped = 0; /* Allocations with no room to track */
+static uint64_t kmprof_started = 0; /* Uptime when profiling was enabled */
+static spinlock_t kmprof_lock = SPINLOCK_INITIALIZER("kmprof");
+
+static inline uint32_t
+kmprof_hash(uintptr_t key, unsigned int bits)
+{
+	return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+static inline uint64_t
+kmprof_now(void)
+{
+	return tsc_get_time_ns() / 1000000000ULL;
+}
+
+/*
+ * Start profiling with empty tables, or stop it.  Stopping keeps the
+ * tables so they can still be dumped.
+ */
+void
+kmprof_enable(bool enable)
+{
+	spinlock_acquire(&kmprof_lock);
+
+	if (enable && !kmprof_enabled) {
+		memset(kmprof_sites, 0, sizeof(kmprof_sites));
+		memset(kmprof_objects, 0, sizeof(kmprof_objects));
+		kmprof_site_count = 0;
+		kmprof_object_count = 0;
+		kmprof_dropped = 0;
+		kmprof_started = kmprof_now();
+	}
+	kmprof_enabled = enable;
+
+	spinlock_release(&kmprof_lock);
+}
+
+/* Find or add the site for caller, NULL once the table is full */
+static struct kmprof_site *
+site_get(enum kmprof_kind kind, void *caller)
+{
+	uint32_t i = kmprof_hash((uintptr_t)caller ^ kind, KMPROF_SITE_BITS);
+
+	for (uint32_t n = 0; n < KMPROF_SITES; n++) {
+		struct kmprof_site *site = &kmprof_sites[i];
+
+		if (site->caller == caller && site->kind == kind) {
+			return site;
+		}
+
+		if (site->caller == NULL) {
+			/* Keep a free slot so lookups always terminate */
+			if (kmprof_site_count + 1 >= KMPROF_SITES) {
+				return NULL;
+			}
+			site->caller = caller;
+			site->kind = kind;
+			kmprof_site_count++;
+			return site;
+		}
+
+		i = (i + 1) & (KMPROF_SITES - 1);
+	}
+
+	return NULL;
+}
+
+static inline uint32_t
+object_slot(enum kmprof_kind kind, const void *ptr)
+{
+	return kmprof_hash((uintptr_t)ptr ^ kind, KMPROF_OBJECT_BITS);
+}
+
+static int32_t
+object_find(enum kmprof_kind kind, const void *ptr)
+{
+	uint32_t i = object_slot(kind, ptr);
+
+	while (kmprof_objects[i].ptr != NULL) {
+		const struct kmprof_object *obj = &kmprof_objects[i];
+
+		if (obj->ptr == ptr && obj->kind == kind) {
+			return (int32_t)i;
+		}
+		i = (i + 1) & (KMPROF_OBJECTS - 1);
+	}
+
+	return -1;
+}
+
+/*
+ * Empty slot i and shift later members of the probe run back, so the
+ * table needs no tombstones.
+ */
+static void
+object_remove(uint32_t i)
+{
+	uint32_t j = i;
+
+	for (;;) {
+		j = (j + 1) & (KMPROF_OBJECTS - 1);
+		if (kmprof_objects[j].ptr == NULL) {
+			break;
+		}
+
+		uint32_t home = object_slot(kmprof_objects[j].kind,
+		                            kmprof_objects[j].ptr);
+
+		/* Move j into the hole unless its home lies in (i, j] */
+		if (((j - home) & (KMPROF_OBJECTS - 1)) >=
+		    ((j - i) & (KMPROF_OBJECTS - 1))) {
+			kmprof_objects[i] = kmprof_objects[j];
+			i = j;
+		}
+	}
+
+	kmprof_objects[i].ptr = NULL;
+	kmprof_object_count--;
+}
+
+void
+kmprof_record_alloc(enum kmprof_kind kind,
+                    void *caller,
+                    const void *ptr,
+                    size_t size)
+{
+	spinlock_acquire(&kmprof_lock);
+
+	if (!kmprof_enabled) {
+		spinlock_release(&kmprof_lock);
+		return;
+	}
+
+	struct kmprof_site *site = site_get(kind, caller);
+
+	/* Keep the object table at most 3/4 full so probes stay short */
+	if (site == NULL || kmprof_object_count >= KMPROF_OBJECTS / 4 * 3) {
+		kmprof_dropped++;
+		spinlock_release(&kmprof_lock);
+		return;
+	}
+
+	site->allocs++;
+	site->bytes += size;
+
+	uint32_t i = object_slot(kind, ptr);
+	while (kmprof_objects[i].ptr != NULL) {
+		i = (i + 1) & (KMPROF_OBJECTS - 1);
+	}
+
+	kmprof_objects[i].ptr = ptr;
+	kmprof_objects[i].size = (uint32_t)size;
+	kmprof_objects[i].site = (uint16_t)(site - kmprof_sites);
+	kmprof_objects[i].kind = (uint16_t)kind;
+	kmprof_objects[i].born = (uint32_t)kmprof_now();
+	kmprof_object_count++;
+
+	site->live_objects++;
+	site->live_bytes += size;
+
+	spinlock_release(&kmprof_lock);
+}
+
+/* Objects allocated before profiling started are simply not found */
+void
+kmprof_record_free(enum kmprof_kind kind, const void *ptr)
+{
+	spinlock_acquire(&kmprof_lock);
+
+	int32_t i = object_find(kind, ptr);
+	if (i >= 0) {
+		struct kmprof_object *obj = &kmprof_objects[i];
+		struct kmprof_site *site = &kmprof_sites[obj->site];
+
+		site->frees++;
+		site->live_objects--;
+		site->live_bytes -= obj->size;
+		object_remove((uint32_t)i);
+	}
+
+	spinlock_release(&kmprof_lock);
+}
+
+static const char *
+kind_name(uint32_t kind)
+{
+	return kind == KMPROF_PAGES ? "pages" : "kmalloc";
+}
+
+/* Insert site into the top-n table, ordered by key descending */
+static size_t
+top_insert(struct kmprof_site *top,
+           size_t count,
+           size_t n,
+           const struct kmprof_site *site,
+           bool by_allocs)
+{
+	uint64_t key = by_allocs ? site->allocs : site->live_bytes;
+	size_t pos = count;
+
+	while (pos > 0 &&
+	       (by_allocs ? top[pos - 1].allocs : top[pos - 1].live_bytes) <
+	           key) {
+		pos--;
+	}
+
+	if (pos >= n) {
+		return count;
+	}
+
+	if (count < n) {
+		count++;
+	}
+	memmove(&top[pos + 1], &top[pos], (count - pos - 1) * sizeof(*top));
+	top[pos] = *site;
+
+	return count;
+}
+
+static void
+top_print(const struct kmprof_site *top, size_t count, uint64_t elapsed)
+{
+	serial_printf(DEBUG_PORT,
+	              "  %-18s %-7s %10s %10s %12s %10s\n",
+	              "caller",
+	              "kind",
+	              "allocs",
+	              "allocs/s",
+	              "live bytes",
+	              "live objs");
+
+	for (size_t i = 0; i < count; i++) {
+		serial_printf(DEBUG_PORT,
+		              "  %p %-7s %10llu %10llu %12llu %10u\n",
+		              top[i].caller,
+		              kind_name(top[i].kind),
+		              top[i].allocs,
+		              top[i].allocs / elapsed,
+		              top[i].live_bytes,
+		              top[i].live_objects);
+	}
+}
+
+/* Print the top callers by live bytes and by allocation rate */
+void
+kmprof_dump(size_t top)
+{
+	struct kmprof_site by_bytes[KMPROF_TOP_MAX];
+	struct kmprof_site by_allocs[KMPROF_TOP_MAX];
+	size_t bytes_count = 0, allocs_count = 0;
+
+	if (top > KMPROF_TOP_MAX) {
+		top = KMPROF_TOP_MAX;
+	}
+
+	spinlock_acquire(&kmprof_lock);
+
+	for (uint32_t i = 0; i < KMPROF_SITES; i++) {
+		const struct kmprof_site *site = &kmprof_sites[i];
+
+		if (site->caller == NULL) {
+			continue;
+		}
+		bytes_count =
+		    top_insert(by_bytes, bytes_count, top, site, false);
+		allocs_count =
+		    top_insert(by_allocs, allocs_count, top, site, true);
+	}
+
+	uint64_t elapsed = kmprof_now() - kmprof_started;
+	uint32_t sites = kmprof_site_count;
+	uint32_t objects = kmprof_object_count;
+	uint64_t dropped = kmprof_dropped;
+	bool enabled = kmprof_enabled;
+
+	spinlock_release(&kmprof_lock);
+
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+
+	serial_printf(DEBUG_PORT,
+	              "\n=== Allocation Profile (%s, %llu s) ===\n",
+	              enabled ? "running" : "stopped",
+	              elapsed);
+	serial_printf(DEBUG_PORT,
+	              "%u sites, %u live objects tracked, %llu untracked\n",
+	              sites,
+	              objects,
+	              dropped);
+	serial_printf(DEBUG_PORT, "Top callers by live bytes:\n");
+	top_print(by_bytes, bytes_count, elapsed);
+	serial_printf(DEBUG_PORT, "Top callers by allocation rate:\n");
+	top_print(by_allocs, allocs_count, elapsed);
+	serial_printf(DEBUG_PORT,
+	              "==========================================\n\n");
+}
+
+/*
+ * Report tracked objects alive for at least min_age seconds, the first
+ * KMPROF_LEAK_REPORT of them in full.  Returns how many there are.
+ */
+size_t
+kmprof_leak_scan(uint64_t min_age)
+{
+	struct kmprof_object old[KMPROF_LEAK_REPORT];
+	void *callers[KMPROF_LEAK_REPORT];
+	size_t found = 0;
+
+	spinlock_acquire(&kmprof_lock);
+
+	uint64_t now = kmprof_now();
+
+	for (uint32_t i = 0; i < KMPROF_OBJECTS; i++) {
+		const struct kmprof_object *obj = &kmprof_objects[i];
+
+		if (obj->ptr == NULL || now - obj->born < min_age) {
+			continue;
+		}
+
+		if (found < KMPROF_LEAK_REPORT) {
+			old[found] = *obj;
+			callers[found] = kmprof_sites[obj->site].caller;
+		}
+		found++;
+	}
+
+	spinlock_release(&kmprof_lock);
+
+	serial_printf(DEBUG_PORT,
+	              "[kmprof] %zu objects older than %llu s\n",
+	              found,
+	              min_age);
+
+	for (size_t i = 0; i < found && i < KMPROF_LEAK_REPORT; i++) {
+		serial_printf(DEBUG_PORT,
+		              "  %p %-7s %8u bytes, %llu s old, from %p\n",
+		              old[i].ptr,
+		              kind_name(old[i].kind),
+		              old[i].size,
+		              now - old[i].born,
+		              callers[i]);
+	}
+
+	return found;
+}
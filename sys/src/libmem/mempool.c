@@ -0,0 +1,361 @@
+#include <mempool.h>
+#include <kmalloc.h>
+#include <kfree.h>
+#include <pmm.h>
+#include <timer.h>
+#include <string.h>
+
+extern void serial_printf(uint16_t port, const char *fmt, ...);
+#define DEBUG_PORT 0x3F8
+
+volatile bool mempool_refill_pending = false;
+
+static mempool_t *mempools = NULL;
+static spinlock_t mempools_lock = SPINLOCK_INITIALIZER("mempools");
+static bool refilling = false; /* Under mempools_lock */
+
+/* Top the reserve up to min_nr, allocating without the pool lock held */
+static size_t
+pool_fill(mempool_t *pool)
+{
+	size_t added = 0;
+
+	for (;;) {
+		spinlock_acquire(&pool->lock);
+		bool full = pool->curr_nr >= pool->min_nr;
+		if (full) {
+			pool->refill = false;
+		}
+		spinlock_release(&pool->lock);
+
+		if (full) {
+			break;
+		}
+
+		void *element = pool->alloc(0, pool->pool_data);
+		if (element == NULL) {
+			break;
+		}
+
+		spinlock_acquire(&pool->lock);
+		if (pool->curr_nr < pool->min_nr) {
+			pool->elements[pool->curr_nr++] = element;
+			element = NULL;
+			added++;
+		}
+		spinlock_release(&pool->lock);
+
+		if (element != NULL) {
+			pool->free(element, pool->pool_data);
+		}
+	}
+
+	return added;
+}
+
+mempool_t *
+mempool_create(const char *name,
+               uint32_t min_nr,
+               mempool_alloc_t alloc,
+               mempool_free_t free,
+               void *pool_data)
+{
+	if (min_nr == 0 || alloc == NULL || free == NULL) {
+		return NULL;
+	}
+
+	mempool_t *pool = kmalloc_flags(sizeof(mempool_t), KMALLOC_ZERO);
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	pool->elements = kmalloc(min_nr * sizeof(void *));
+	if (pool->elements == NULL) {
+		kfree(pool);
+		return NULL;
+	}
+
+	pool->name = name;
+	spinlock_init(&pool->lock, "mempool");
+	pool->min_nr = min_nr;
+	pool->alloc = alloc;
+	pool->free = free;
+	pool->pool_data = pool_data;
+
+	/* A reserve that cannot be filled now guarantees nothing */
+	if (pool_fill(pool) < min_nr) {
+		serial_printf(DEBUG_PORT,
+		              "[mempool] %s: could not preallocate %u elements\n",
+		              name,
+		              min_nr);
+		mempool_destroy(pool);
+		return NULL;
+	}
+
+	spinlock_acquire(&mempools_lock);
+	pool->next = mempools;
+	mempools = pool;
+	spinlock_release(&mempools_lock);
+
+	return pool;
+}
+
+void
+mempool_destroy(mempool_t *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	/* A refill walks the list unlocked, wait for it to finish */
+	for (;;) {
+		spinlock_acquire(&mempools_lock);
+		if (!refilling) {
+			break;
+		}
+		spinlock_release(&mempools_lock);
+	}
+
+	mempool_t **link = &mempools;
+	while (*link != NULL && *link != pool) {
+		link = &(*link)->next;
+	}
+	if (*link != NULL) {
+		*link = pool->next;
+	}
+	spinlock_release(&mempools_lock);
+
+	while (pool->curr_nr > 0) {
+		pool->free(pool->elements[--pool->curr_nr], pool->pool_data);
+	}
+
+	kfree(pool->elements);
+	kfree(pool);
+}
+
+/* Take an element from the reserve only, NULL once it is empty */
+void *
+mempool_take(mempool_t *pool)
+{
+	void *element = NULL;
+
+	spinlock_acquire(&pool->lock);
+	if (pool->curr_nr > 0) {
+		element = pool->elements[--pool->curr_nr];
+		pool->reserve_allocs++;
+	} else {
+		pool->failures++;
+	}
+	pool->refill = true;
+	spinlock_release(&pool->lock);
+
+	mempool_refill_pending = true;
+
+	if (element == NULL) {
+		serial_printf(
+		    DEBUG_PORT, "[mempool] %s: reserve exhausted\n", pool->name);
+	}
+
+	return element;
+}
+
+void *
+mempool_alloc(mempool_t *pool, uint32_t flags)
+{
+	MEMPOOL_REFILL_CHECK(flags);
+
+	void *element = pool->alloc(flags, pool->pool_data);
+	if (__predict_false(element == NULL)) {
+		element = mempool_take(pool);
+		if (element != NULL && (flags & KMALLOC_ZERO)) {
+			memset(element, 0, pool->elem_size);
+		}
+	}
+
+	return element;
+}
+
+void
+mempool_free(void *element, mempool_t *pool)
+{
+	if (element == NULL) {
+		return;
+	}
+
+	/* Checked unlocked first; a full reserve is the common case */
+	if (__predict_false(pool->curr_nr < pool->min_nr)) {
+		spinlock_acquire(&pool->lock);
+		if (pool->curr_nr < pool->min_nr) {
+			pool->elements[pool->curr_nr++] = element;
+			element = NULL;
+		}
+		spinlock_release(&pool->lock);
+	}
+
+	if (element != NULL) {
+		pool->free(element, pool->pool_data);
+	}
+}
+
+/*
+ * Refill every pool drawn below its reserve.  Returns the elements added;
+ * pools the allocators cannot refill yet stay pending for the next run.
+ * The backing allocators may block, so this is for process context only;
+ * mempools_lock is dropped while they run and refilling keeps
+ * mempool_destroy() and nested refills out.
+ */
+size_t
+mempool_refill(void)
+{
+	size_t added = 0;
+	bool pending = false;
+
+	/* Backing allocators end up in kmalloc(), which checks for us */
+	if (!spinlock_try_acquire(&mempools_lock)) {
+		return 0;
+	}
+	if (refilling) {
+		spinlock_release(&mempools_lock);
+		return 0;
+	}
+	refilling = true;
+	mempool_refill_pending = false;
+	spinlock_release(&mempools_lock);
+
+	/* New pools go in at the head, behind this walk */
+	for (mempool_t *pool = mempools; pool != NULL; pool = pool->next) {
+		if (pool->refill) {
+			added += pool_fill(pool);
+			pending |= pool->refill;
+		}
+	}
+
+	spinlock_acquire(&mempools_lock);
+	if (pending) {
+		mempool_refill_pending = true;
+	}
+	refilling = false;
+	spinlock_release(&mempools_lock);
+
+	return added;
+}
+
+/*
+ * Runs in IRQ context, where the backing allocators must not be entered:
+ * it only flags the work for scheduler_idle() and the next allocation
+ * that may block.
+ */
+static void
+mempool_refill_timer(void *data)
+{
+	(void)data;
+
+	mempool_refill_pending = true;
+}
+
+void
+mempool_init(void)
+{
+	if (timer_register_periodic(
+	        mempool_refill_timer, NULL, MEMPOOL_REFILL_MS) == NULL) {
+		serial_printf(DEBUG_PORT,
+		              "[mempool] No timer slot, refilling on demand\n");
+	}
+}
+
+static void *
+kmalloc_pool_alloc(uint32_t flags, void *pool_data)
+{
+	return kmalloc_flags((size_t)pool_data, flags);
+}
+
+static void
+kmalloc_pool_free(void *element, void *pool_data)
+{
+	(void)pool_data;
+	kfree(element);
+}
+
+mempool_t *
+mempool_create_kmalloc_pool(const char *name, uint32_t min_nr, size_t size)
+{
+	mempool_t *pool = mempool_create(name,
+	                                 min_nr,
+	                                 kmalloc_pool_alloc,
+	                                 kmalloc_pool_free,
+	                                 (void *)size);
+	if (pool != NULL) {
+		pool->elem_size = size;
+	}
+
+	return pool;
+}
+
+static void *
+page_pool_alloc(uint32_t flags, void *pool_data)
+{
+	(void)pool_data;
+	return (flags & KMALLOC_ZERO) ? pmm_alloc_zeroed() : pmm_alloc();
+}
+
+static void
+page_pool_free(void *element, void *pool_data)
+{
+	(void)pool_data;
+	pmm_free(element);
+}
+
+mempool_t *
+mempool_create_page_pool(const char *name, uint32_t min_nr)
+{
+	mempool_t *pool = mempool_create(
+	    name, min_nr, page_pool_alloc, page_pool_free, NULL);
+	if (pool != NULL) {
+		pool->elem_size = PAGE_SIZE;
+	}
+
+	return pool;
+}
+
+static void *
+slab_pool_alloc(uint32_t flags, void *pool_data)
+{
+	return kmem_cache_alloc(pool_data, flags);
+}
+
+static void
+slab_pool_free(void *element, void *pool_data)
+{
+	kmem_cache_free(pool_data, element);
+}
+
+mempool_t *
+mempool_create_slab_pool(const char *name,
+                         uint32_t min_nr,
+                         kmem_cache_t *cache)
+{
+	mempool_t *pool = mempool_create(
+	    name, min_nr, slab_pool_alloc, slab_pool_free, cache);
+	if (pool != NULL) {
+		pool->elem_size = cache->object_size;
+	}
+
+	return pool;
+}
+
+void
+mempool_stats(void)
+{
+	spinlock_acquire(&mempools_lock);
+	for (mempool_t *pool = mempools; pool != NULL; pool = pool->next) {
+		serial_printf(DEBUG_PORT,
+		              "[mempool] %-16s %u/%u reserved, %llu served, "
+		              "%llu exhausted\n",
+		              pool->name,
+		              pool->curr_nr,
+		              pool->min_nr,
+		              pool->reserve_allocs,
+		              pool->failures);
+	}
+	spinlock_release(&mempools_lock);
+}
@@ -2,12 +2,31 @@
 #include <pmm.h>
 #include <limine.h>
 #include <string.h>
+#include <sys/atomic.h>
+#include <cpuid.h>
+
+/*
+ * PCIDs are 12 bits wide.  PCID 0 is what the boot page tables were
+ * loaded under and is never handed out, so flushing it is never needed.
+ */
+#define MMU_ASID_COUNT 4096
+
+#define INVPCID_ALL_GLOBAL 2 /* Every PCID, global entries included */
+#define INVPCID_ALL 3        /* Every PCID, global entries excepted */
+
+#define MMU_KERNEL_BASE 0xFFFF800000000000ULL
+#define MMU_USER_TOP 0x0000800000000000ULL /* Tables above are shared */
 
 static uint64_t hhdm_offset;
 static page_directory_t *kernel_pd;
 static page_directory_t *current_pd = NULL;
 static page_fault_handler_t page_fault_handler;
 
+static bool pcid_enabled = false;
+static bool invpcid_supported = false;
+static uint64_t asid_generation = 1;
+static uint16_t next_asid = 1;
+
 static inline uint64_t
 read_cr3(void)
 {
@@ -22,6 +41,45 @@ write_cr3(uint64_t cr3)
 	__asm__ volatile("mov %0, %%cr3" ::"r"(cr3) : "memory");
 }
 
+static inline uint64_t
+read_cr0(void)
+{
+	uint64_t cr0;
+	__asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+	return cr0;
+}
+
+static inline void
+write_cr0(uint64_t cr0)
+{
+	__asm__ volatile("mov %0, %%cr0" ::"r"(cr0) : "memory");
+}
+
+static inline uint64_t
+read_cr4(void)
+{
+	uint64_t cr4;
+	__asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+	return cr4;
+}
+
+static inline void
+write_cr4(uint64_t cr4)
+{
+	__asm__ volatile("mov %0, %%cr4" ::"r"(cr4) : "memory");
+}
+
+static inline void
+invpcid(uint64_t type, uint64_t pcid, uint64_t addr)
+{
+	struct {
+		uint64_t pcid;
+		uint64_t addr;
+	} desc = { pcid, addr };
+
+	__asm__ volatile("invpcid %0, %1" ::"m"(desc), "r"(type) : "memory");
+}
+
 static inline uint64_t
 read_cr2(void)
 {
@@ -42,6 +100,97 @@ virt_to_phys(void *virt)
 	return (uint64_t)virt - hhdm_offset;
 }
 
+/* The descriptor of a table we allocated, NULL for boot-time tables */
+static inline struct page *
+table_page(const void *table)
+{
+	struct page *page =
+	    phys_to_page(virt_to_phys((void *)((uint64_t)table & ~0xFFFULL)));
+
+	return (page != NULL && (page->flags & PG_PGTABLE)) ? page : NULL;
+}
+
+/* A zeroed page-table page, counting its present entries in private */
+static void *
+alloc_table(void)
+{
+	void *table = pmm_alloc_zeroed();
+	if (table == NULL) {
+		return NULL;
+	}
+
+	struct page *page = phys_to_page(virt_to_phys(table));
+	if (page != NULL) {
+		page->flags |= PG_PGTABLE;
+		page->private = 0;
+	}
+
+	return table;
+}
+
+/*
+ * Store a page-table entry, keeping the population count of the table
+ * it lives in up to date.  Every entry that turns present or not present
+ * after creation goes through here.
+ */
+void
+mmu_set_entry(uint64_t *entry, uint64_t value)
+{
+	if ((*entry ^ value) & PAGE_PRESENT) {
+		struct page *page = table_page(entry);
+
+		if (page != NULL) {
+			if (value & PAGE_PRESENT) {
+				page->private++;
+			} else {
+				page->private--;
+			}
+		}
+	}
+
+	*entry = value;
+}
+
+/* Count or uncount every frame a present leaf of size bytes maps */
+static void
+leaf_mapcount(uint64_t entry, uint64_t size, bool map)
+{
+	if (!(entry & PAGE_PRESENT)) {
+		return;
+	}
+
+	uint64_t phys = entry & PAGE_ADDR_MASK & ~(size - 1);
+
+	for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+		struct page *page = phys_to_page(phys + off);
+		if (page == NULL || (page->flags & PG_RESERVED)) {
+			continue;
+		}
+
+		if (map) {
+			atomic_inc_int(&page->mapcount);
+		} else if (page->mapcount > 0) {
+			atomic_dec_int(&page->mapcount);
+		}
+	}
+}
+
+/*
+ * Store a leaf entry mapping size bytes, moving the mapcount from the
+ * frames it used to map to the ones it maps now.  A 2 MiB leaf counts
+ * each of its frames once, so splitting it leaves the counts alone.
+ */
+void
+mmu_set_leaf(uint64_t *entry, uint64_t value, uint64_t size)
+{
+	if ((*entry ^ value) & (PAGE_ADDR_MASK | PAGE_PRESENT)) {
+		leaf_mapcount(*entry, size, false);
+		leaf_mapcount(value, size, true);
+	}
+
+	mmu_set_entry(entry, value);
+}
+
 static uint64_t *
 get_next_level(uint64_t *table, size_t index, bool create, uint64_t flags)
 {
@@ -50,19 +199,63 @@ get_next_level(uint64_t *table, size_t index, bool create, uint64_t flags)
 			return NULL;
 		}
 
-		void *new_table = pmm_alloc();
+		void *new_table = alloc_table();
 		if (new_table == NULL) {
 			return NULL;
 		}
 
-		memset(new_table, 0, PAGE_SIZE);
-		table[index] = virt_to_phys(new_table) | flags | PAGE_PRESENT;
+		mmu_set_entry(&table[index],
+		              virt_to_phys(new_table) | flags | PAGE_PRESENT);
 	}
 
 	uint64_t phys = table[index] & PAGE_ADDR_MASK;
 	return (uint64_t *)phys_to_virt(phys);
 }
 
+/*
+ * Mark every leaf of the boot kernel half global, the HHDM included.
+ * mmu_create_address_space() shares these tables with every space, so
+ * once CR4.PGE is on their translations survive CR3 loads.
+ */
+static void
+mark_kernel_global(pml4e_t *pml4)
+{
+	for (int pml4_idx = 256; pml4_idx < 512; pml4_idx++) {
+		if (!(pml4[pml4_idx] & PAGE_PRESENT))
+			continue;
+
+		pdpte_t *pdpt = phys_to_virt(pml4[pml4_idx] & PAGE_ADDR_MASK);
+
+		for (int pdpt_idx = 0; pdpt_idx < 512; pdpt_idx++) {
+			if (!(pdpt[pdpt_idx] & PAGE_PRESENT))
+				continue;
+			if (pdpt[pdpt_idx] & PAGE_HUGE) {
+				pdpt[pdpt_idx] |= PAGE_GLOBAL;
+				continue;
+			}
+
+			pde_t *pd_table =
+			    phys_to_virt(pdpt[pdpt_idx] & PAGE_ADDR_MASK);
+
+			for (int pd_idx = 0; pd_idx < 512; pd_idx++) {
+				if (!(pd_table[pd_idx] & PAGE_PRESENT))
+					continue;
+				if (pd_table[pd_idx] & PAGE_HUGE) {
+					pd_table[pd_idx] |= PAGE_GLOBAL;
+					continue;
+				}
+
+				pte_t *pt = phys_to_virt(pd_table[pd_idx] &
+				                         PAGE_ADDR_MASK);
+				for (int pt_idx = 0; pt_idx < 512; pt_idx++) {
+					if (pt[pt_idx] & PAGE_PRESENT)
+						pt[pt_idx] |= PAGE_GLOBAL;
+				}
+			}
+		}
+	}
+}
+
 void
 mmu_init(struct limine_hhdm_response *hhdm)
 {
@@ -80,9 +273,17 @@ mmu_init(struct limine_hhdm_response *hhdm)
 
 	kernel_pd->pml4 = (pml4e_t *)phys_to_virt(current_cr3);
 	kernel_pd->phys_addr = current_cr3;
+	kernel_pd->asid = 0;
+	kernel_pd->asid_gen = 0;
 
 	current_pd = kernel_pd;
 
+	/* Copy-on-write needs kernel writes to user pages to fault as well */
+	write_cr0(read_cr0() | CR0_WP);
+
+	mark_kernel_global(kernel_pd->pml4);
+	write_cr4(read_cr4() | CR4_PGE);
+
 	page_fault_handler = NULL;
 }
 
@@ -94,25 +295,26 @@ mmu_create_address_space(void)
 		return NULL;
 	}
 
-	void *pml4 = pmm_alloc();
+	void *pml4 = alloc_table();
 	if (pml4 == NULL) {
 		pmm_free(pd);
 		return NULL;
 	}
 
-	memset(pml4, 0, PAGE_SIZE);
-
+	/* Shared kernel tables, their global leaves come along */
 	if (kernel_pd != NULL && kernel_pd->pml4 != NULL) {
 		pml4e_t *kernel_pml4 = kernel_pd->pml4;
 		pml4e_t *new_pml4 = pml4;
 
 		for (int i = 256; i < 512; i++) {
-			new_pml4[i] = kernel_pml4[i];
+			mmu_set_entry(&new_pml4[i], kernel_pml4[i]);
 		}
 	}
 
 	pd->pml4 = pml4;
 	pd->phys_addr = virt_to_phys(pml4);
+	pd->asid = 0;
+	pd->asid_gen = 0;
 
 	return pd;
 }
@@ -124,6 +326,13 @@ mmu_destroy_address_space(page_directory_t *pd)
 		return;
 	}
 
+	/* A kernel thread may still be borrowing pd, move it off first */
+	if (pd->phys_addr == (read_cr3() & PAGE_ADDR_MASK)) {
+		mmu_switch_address_space(kernel_pd);
+	} else if (current_pd == pd) {
+		current_pd = kernel_pd;
+	}
+
 	pml4e_t *pml4 = pd->pml4;
 
 	for (int pml4_idx = 0; pml4_idx < 256; pml4_idx++) {
@@ -169,8 +378,79 @@ mmu_switch_address_space(page_directory_t *pd)
 		return;
 	}
 
-	write_cr3(pd->phys_addr);
+	write_cr3(mmu_activate(pd));
+}
+
+/*
+ * Drop the TLB entries of every PCID.  Toggling CR4.PGE does the same
+ * job where INVPCID is missing, global entries included.
+ */
+static void
+flush_all_contexts(bool global)
+{
+	if (invpcid_supported) {
+		invpcid(global ? INVPCID_ALL_GLOBAL : INVPCID_ALL, 0, 0);
+		return;
+	}
+
+	uint64_t cr4 = read_cr4();
+	write_cr4(cr4 ^ CR4_PGE);
+	write_cr4(cr4);
+}
+
+/*
+ * Make pd the current address space and return the CR3 value that loads
+ * it.  With PCIDs the value carries pd's ASID and the no-flush bit, so
+ * its translations survive switching away and back.  An ASID from an
+ * older generation is stale: another space may own that PCID by now.
+ */
+uint64_t
+mmu_activate(page_directory_t *pd)
+{
 	current_pd = pd;
+
+	if (!pcid_enabled) {
+		return pd->phys_addr;
+	}
+
+	if (pd->asid_gen != asid_generation) {
+		if (next_asid >= MMU_ASID_COUNT) {
+			/* Out of PCIDs: start over on a clean TLB */
+			asid_generation++;
+			next_asid = 1;
+			flush_all_contexts(false);
+		}
+		pd->asid = next_asid++;
+		pd->asid_gen = asid_generation;
+	}
+
+	return pd->phys_addr | pd->asid | CR3_REUSE_PCID;
+}
+
+bool
+mmu_enable_pcid(void)
+{
+	if (!cpuid_has_pcid()) {
+		return false;
+	}
+
+	invpcid_supported = cpuid_has_invpcid();
+
+	/* CR4.PCIDE can only be set while CR3 selects PCID 0 */
+	if (read_cr3() & CR3_PCID) {
+		return false;
+	}
+
+	write_cr4(read_cr4() | CR4_PCIDE);
+	pcid_enabled = true;
+
+	return true;
+}
+
+page_directory_t *
+mmu_get_kernel_address_space(void)
+{
+	return kernel_pd;
 }
 
 page_directory_t *
@@ -179,8 +459,79 @@ mmu_get_current_address_space(void)
 	return current_pd;
 }
 
-bool
-mmu_map_page(page_directory_t *pd, uint64_t virt, uint64_t phys, uint64_t flags)
+/*
+ * Describe the address space loaded in CR3.  Process switches load CR3
+ * directly, so during a fault this can differ from current_pd.
+ */
+void
+mmu_get_active_directory(page_directory_t *pd)
+{
+	pd->phys_addr = read_cr3() & PAGE_ADDR_MASK;
+	pd->pml4 = phys_to_virt(pd->phys_addr);
+}
+
+/*
+ * Invalidate virt after changing its entry in pd.  Kernel-half mappings
+ * are global, and invlpg drops a global entry from every PCID.  A space
+ * that is not loaded has its ASID retired instead; it picks up a fresh
+ * one the next time it is activated.
+ */
+static void
+flush_page(page_directory_t *pd, uint64_t virt)
+{
+	if (!pcid_enabled || virt >= MMU_KERNEL_BASE) {
+		mmu_flush_tlb_single(virt);
+	} else if (pd->phys_addr == (read_cr3() & PAGE_ADDR_MASK)) {
+		mmu_flush_tlb_single(virt);
+	} else {
+		pd->asid_gen = 0;
+	}
+}
+
+/* The kernel half is the same in every space, so its leaves are global */
+static inline uint64_t
+leaf_flags(uint64_t virt, uint64_t flags)
+{
+	return virt >= MMU_KERNEL_BASE ? flags | PAGE_GLOBAL : flags;
+}
+
+static void
+invalidate(page_directory_t *pd, mmu_gather_t *tlb, uint64_t virt)
+{
+	if (tlb != NULL) {
+		mmu_gather_page(tlb, virt);
+	} else {
+		flush_page(pd, virt);
+	}
+}
+
+/* Find the page directory entry covering virt, optionally building it */
+static pde_t *
+get_pde(page_directory_t *pd, uint64_t virt, bool create, uint64_t flags)
+{
+	uint64_t table_flags = PAGE_WRITE | (flags & PAGE_USER);
+
+	pdpte_t *pdpt = get_next_level(
+	    (uint64_t *)pd->pml4, PML4_INDEX(virt), create, table_flags);
+	if (pdpt == NULL || (pdpt[PDPT_INDEX(virt)] & PAGE_HUGE)) {
+		return NULL;
+	}
+
+	pde_t *pd_table = get_next_level(
+	    (uint64_t *)pdpt, PDPT_INDEX(virt), create, table_flags);
+	if (pd_table == NULL) {
+		return NULL;
+	}
+
+	return &pd_table[PD_INDEX(virt)];
+}
+
+static bool
+map_page(page_directory_t *pd,
+         uint64_t virt,
+         uint64_t phys,
+         uint64_t flags,
+         mmu_gather_t *tlb)
 {
 	if (pd == NULL || pd->pml4 == NULL) {
 		return false;
@@ -189,37 +540,33 @@ mmu_map_page(page_directory_t *pd, uint64_t virt, uint64_t phys, uint64_t flags)
 	virt &= ~0xFFF;
 	phys &= ~0xFFF;
 
-	pml4e_t *pml4 = pd->pml4;
-
 	uint64_t table_flags = PAGE_WRITE | (flags & PAGE_USER);
 
-	pdpte_t *pdpt = get_next_level(
-	    (uint64_t *)pml4, PML4_INDEX(virt), true, table_flags);
-	if (pdpt == NULL) {
+	pde_t *pde = get_pde(pd, virt, true, flags);
+	if (pde == NULL) {
 		return false;
 	}
 
-	pde_t *pd_table = get_next_level(
-	    (uint64_t *)pdpt, PDPT_INDEX(virt), true, table_flags);
-	if (pd_table == NULL) {
+	if ((*pde & PAGE_HUGE) && !mmu_split_huge_page(pd, virt)) {
 		return false;
 	}
 
-	pte_t *pt = get_next_level(
-	    (uint64_t *)pd_table, PD_INDEX(virt), true, table_flags);
+	pte_t *pt = get_next_level(pde, 0, true, table_flags);
 	if (pt == NULL) {
 		return false;
 	}
 
-	pt[PT_INDEX(virt)] = phys | flags | PAGE_PRESENT;
+	mmu_set_leaf(&pt[PT_INDEX(virt)],
+	             phys | leaf_flags(virt, flags) | PAGE_PRESENT,
+	             PAGE_SIZE);
 
-	mmu_flush_tlb_single(virt);
+	invalidate(pd, tlb, virt);
 
 	return true;
 }
 
-bool
-mmu_unmap_page(page_directory_t *pd, uint64_t virt)
+static bool
+unmap_page(page_directory_t *pd, uint64_t virt, mmu_gather_t *tlb)
 {
 	if (pd == NULL || pd->pml4 == NULL) {
 		return false;
@@ -227,31 +574,274 @@ mmu_unmap_page(page_directory_t *pd, uint64_t virt)
 
 	virt &= ~0xFFF;
 
-	pml4e_t *pml4 = pd->pml4;
+	pde_t *pde = get_pde(pd, virt, false, 0);
+	if (pde == NULL || !(*pde & PAGE_PRESENT)) {
+		return false;
+	}
 
-	if (!(pml4[PML4_INDEX(virt)] & PAGE_PRESENT)) {
+	/* Partial unmap of a 2 MiB mapping: keep the other 511 pages */
+	if ((*pde & PAGE_HUGE) && !mmu_split_huge_page(pd, virt)) {
 		return false;
 	}
 
-	pdpte_t *pdpt = phys_to_virt(pml4[PML4_INDEX(virt)] & PAGE_ADDR_MASK);
-	if (!(pdpt[PDPT_INDEX(virt)] & PAGE_PRESENT)) {
+	pte_t *pt = phys_to_virt(*pde & PAGE_ADDR_MASK);
+
+	mmu_set_leaf(&pt[PT_INDEX(virt)], 0, PAGE_SIZE);
+
+	invalidate(pd, tlb, virt);
+
+	/* A gathered unmap reclaims tables once, at the end of the range */
+	if (tlb == NULL) {
+		mmu_reclaim_tables(pd, NULL, virt, virt + PAGE_SIZE);
+	}
+
+	return true;
+}
+
+static bool
+map_huge_page(page_directory_t *pd,
+              uint64_t virt,
+              uint64_t phys,
+              uint64_t flags,
+              mmu_gather_t *tlb)
+{
+	if (pd == NULL || pd->pml4 == NULL) {
 		return false;
 	}
 
-	pde_t *pd_table = phys_to_virt(pdpt[PDPT_INDEX(virt)] & PAGE_ADDR_MASK);
-	if (!(pd_table[PD_INDEX(virt)] & PAGE_PRESENT)) {
+	if ((virt & (HUGE_PAGE_SIZE - 1)) || (phys & (HUGE_PAGE_SIZE - 1))) {
 		return false;
 	}
 
-	pte_t *pt = phys_to_virt(pd_table[PD_INDEX(virt)] & PAGE_ADDR_MASK);
+	pde_t *pde = get_pde(pd, virt, true, flags);
+	if (pde == NULL) {
+		return false;
+	}
+
+	/* Refuse to drop a page table that may still hold mappings */
+	if ((*pde & PAGE_PRESENT) && !(*pde & PAGE_HUGE)) {
+		return false;
+	}
+
+	mmu_set_leaf(pde,
+	             phys | leaf_flags(virt, flags) | PAGE_HUGE | PAGE_PRESENT,
+	             HUGE_PAGE_SIZE);
+
+	invalidate(pd, tlb, virt);
+
+	return true;
+}
+
+static bool
+unmap_huge_page(page_directory_t *pd, uint64_t virt, mmu_gather_t *tlb)
+{
+	if (pd == NULL || pd->pml4 == NULL) {
+		return false;
+	}
+
+	pde_t *pde = get_pde(pd, virt, false, 0);
+	if (pde == NULL || (*pde & (PAGE_PRESENT | PAGE_HUGE)) !=
+	                       (PAGE_PRESENT | PAGE_HUGE)) {
+		return false;
+	}
 
-	pt[PT_INDEX(virt)] = 0;
+	mmu_set_leaf(pde, 0, HUGE_PAGE_SIZE);
 
-	mmu_flush_tlb_single(virt);
+	invalidate(pd, tlb, virt & ~(HUGE_PAGE_SIZE - 1));
+
+	if (tlb == NULL) {
+		mmu_reclaim_tables(pd, NULL, virt, virt + HUGE_PAGE_SIZE);
+	}
 
 	return true;
 }
 
+bool
+mmu_map_page(page_directory_t *pd, uint64_t virt, uint64_t phys, uint64_t flags)
+{
+	return map_page(pd, virt, phys, flags, NULL);
+}
+
+bool
+mmu_unmap_page(page_directory_t *pd, uint64_t virt)
+{
+	return unmap_page(pd, virt, NULL);
+}
+
+bool
+mmu_map_huge_page(page_directory_t *pd,
+                  uint64_t virt,
+                  uint64_t phys,
+                  uint64_t flags)
+{
+	return map_huge_page(pd, virt, phys, flags, NULL);
+}
+
+bool
+mmu_unmap_huge_page(page_directory_t *pd, uint64_t virt)
+{
+	return unmap_huge_page(pd, virt, NULL);
+}
+
+void
+mmu_gather_init(mmu_gather_t *tlb, page_directory_t *pd)
+{
+	tlb->pd = pd;
+	tlb->nr_addrs = 0;
+	tlb->flush_all = false;
+	tlb->kernel = false;
+	tlb->nr_frames = 0;
+}
+
+/* As mmu_map_page(), leaving the invalidation to mmu_gather_flush() */
+bool
+mmu_gather_map_page(mmu_gather_t *tlb,
+                    uint64_t virt,
+                    uint64_t phys,
+                    uint64_t flags)
+{
+	return map_page(tlb->pd, virt, phys, flags, tlb);
+}
+
+bool
+mmu_gather_unmap_page(mmu_gather_t *tlb, uint64_t virt)
+{
+	return unmap_page(tlb->pd, virt, tlb);
+}
+
+bool
+mmu_gather_map_huge_page(mmu_gather_t *tlb,
+                         uint64_t virt,
+                         uint64_t phys,
+                         uint64_t flags)
+{
+	return map_huge_page(tlb->pd, virt, phys, flags, tlb);
+}
+
+bool
+mmu_gather_unmap_huge_page(mmu_gather_t *tlb, uint64_t virt)
+{
+	return unmap_huge_page(tlb->pd, virt, tlb);
+}
+
+/* Note that the cached translation of virt is stale */
+void
+mmu_gather_page(mmu_gather_t *tlb, uint64_t virt)
+{
+	if (virt >= MMU_KERNEL_BASE) {
+		tlb->kernel = true;
+	}
+
+	if (tlb->flush_all) {
+		return;
+	}
+
+	if (tlb->nr_addrs == MMU_GATHER_FLUSH_MAX) {
+		tlb->flush_all = true;
+		return;
+	}
+
+	tlb->addrs[tlb->nr_addrs++] = virt;
+}
+
+/* Queue 2^order frames for the PMM, to be freed after the flush */
+void
+mmu_gather_free(mmu_gather_t *tlb, void *frame, unsigned int order)
+{
+	if (tlb->nr_frames == MMU_GATHER_FRAMES) {
+		mmu_gather_flush(tlb);
+	}
+
+	tlb->frames[tlb->nr_frames] = frame;
+	tlb->orders[tlb->nr_frames] = order;
+	tlb->nr_frames++;
+}
+
+/*
+ * Invalidate what the batch changed, one invlpg per address while there
+ * are few of them and one flush of the space past MMU_GATHER_FLUSH_MAX,
+ * then hand the queued frames back.
+ */
+void
+mmu_gather_flush(mmu_gather_t *tlb)
+{
+	if (tlb->flush_all) {
+		if (tlb->kernel) {
+			flush_all_contexts(true);
+		} else {
+			mmu_flush_address_space(tlb->pd);
+		}
+	} else {
+		for (size_t i = 0; i < tlb->nr_addrs; i++) {
+			flush_page(tlb->pd, tlb->addrs[i]);
+		}
+	}
+
+	tlb->nr_addrs = 0;
+	tlb->flush_all = false;
+	tlb->kernel = false;
+
+	for (size_t i = 0; i < tlb->nr_frames; i++) {
+		pmm_free_order(tlb->frames[i], tlb->orders[i]);
+	}
+	tlb->nr_frames = 0;
+}
+
+/*
+ * Replace a 2 MiB mapping with a page table of 512 4 KiB entries for the
+ * same frames and permissions, so part of it can be unmapped or changed.
+ */
+bool
+mmu_split_huge_page(page_directory_t *pd, uint64_t virt)
+{
+	if (pd == NULL || pd->pml4 == NULL) {
+		return false;
+	}
+
+	pde_t *pde = get_pde(pd, virt, false, 0);
+	if (pde == NULL || !(*pde & PAGE_HUGE)) {
+		return false;
+	}
+
+	pte_t *pt = alloc_table();
+	if (pt == NULL) {
+		return false;
+	}
+
+	uint64_t phys = *pde & HUGE_PAGE_ADDR_MASK;
+	uint64_t flags =
+	    *pde & ~(HUGE_PAGE_ADDR_MASK | PAGE_HUGE | PAGE_HUGE_PAT);
+
+	for (int i = 0; i < 512; i++) {
+		pt[i] = (phys + (uint64_t)i * PAGE_SIZE) | flags;
+	}
+
+	struct page *page = table_page(pt);
+	if (page != NULL) {
+		page->private = 512;
+	}
+
+	*pde = virt_to_phys(pt) | PAGE_PRESENT | PAGE_WRITE |
+	       (flags & PAGE_USER);
+
+	flush_page(pd, virt & ~(HUGE_PAGE_SIZE - 1));
+
+	return true;
+}
+
+bool
+mmu_is_huge_mapped(page_directory_t *pd, uint64_t virt)
+{
+	if (pd == NULL || pd->pml4 == NULL) {
+		return false;
+	}
+
+	pde_t *pde = get_pde(pd, virt, false, 0);
+
+	return pde != NULL && (*pde & (PAGE_PRESENT | PAGE_HUGE)) ==
+	                          (PAGE_PRESENT | PAGE_HUGE);
+}
+
 uint64_t
 mmu_get_physical_address(page_directory_t *pd, uint64_t virt)
 {
@@ -260,6 +850,7 @@ mmu_get_physical_address(page_directory_t *pd, uint64_t virt)
 	}
 
 	uint64_t page_offset = virt & 0xFFF;
+	uint64_t full_virt = virt;
 	virt &= ~0xFFF;
 
 	pml4e_t *pml4 = pd->pml4;
@@ -273,11 +864,21 @@ mmu_get_physical_address(page_directory_t *pd, uint64_t virt)
 		return 0;
 	}
 
+	if (pdpt[PDPT_INDEX(virt)] & PAGE_HUGE) {
+		return (pdpt[PDPT_INDEX(virt)] & GIANT_PAGE_ADDR_MASK) |
+		       (full_virt & 0x3FFFFFFF);
+	}
+
 	pde_t *pd_table = phys_to_virt(pdpt[PDPT_INDEX(virt)] & PAGE_ADDR_MASK);
 	if (!(pd_table[PD_INDEX(virt)] & PAGE_PRESENT)) {
 		return 0;
 	}
 
+	if (pd_table[PD_INDEX(virt)] & PAGE_HUGE) {
+		return (pd_table[PD_INDEX(virt)] & HUGE_PAGE_ADDR_MASK) |
+		       (full_virt & (HUGE_PAGE_SIZE - 1));
+	}
+
 	pte_t *pt = phys_to_virt(pd_table[PD_INDEX(virt)] & PAGE_ADDR_MASK);
 	if (!(pt[PT_INDEX(virt)] & PAGE_PRESENT)) {
 		return 0;
@@ -286,6 +887,239 @@ mmu_get_physical_address(page_directory_t *pd, uint64_t virt)
 	return (pt[PT_INDEX(virt)] & PAGE_ADDR_MASK) | page_offset;
 }
 
+/* The 4 KiB entry mapping virt, NULL if its table is missing or huge */
+pte_t *
+mmu_get_pte(page_directory_t *pd, uint64_t virt)
+{
+	if (pd == NULL || pd->pml4 == NULL) {
+		return NULL;
+	}
+
+	pde_t *pde = get_pde(pd, virt, false, 0);
+	if (pde == NULL ||
+	    (*pde & (PAGE_PRESENT | PAGE_HUGE)) != PAGE_PRESENT) {
+		return NULL;
+	}
+
+	pte_t *pt = phys_to_virt(*pde & PAGE_ADDR_MASK);
+	return &pt[PT_INDEX(virt)];
+}
+
+/*
+ * Walk one table level.  shift is the span of its entries; the entry
+ * covering virt is found once and the walk then moves sideways, so an
+ * absent table skips its whole span without looking underneath.
+ */
+static bool
+walk_level(uint64_t *table,
+           unsigned int shift,
+           uint64_t virt,
+           uint64_t end,
+           mmu_walk_fn_t fn,
+           void *arg)
+{
+	uint64_t span = 1ULL << shift;
+
+	while (virt < end) {
+		uint64_t base = virt & ~(span - 1);
+		uint64_t next = base + span;
+		uint64_t stop = (next > virt && next < end) ? next : end;
+		uint64_t *entry = &table[(virt >> shift) & 0x1FF];
+
+		if (*entry & PAGE_PRESENT) {
+			bool leaf = shift == PT_SHIFT ||
+			            (shift != PML4_SHIFT && (*entry & PAGE_HUGE));
+
+			if (leaf) {
+				if (!fn(base, entry, span, arg)) {
+					return false;
+				}
+			} else if (!walk_level(phys_to_virt(*entry &
+			                                    PAGE_ADDR_MASK),
+			                       shift - 9,
+			                       virt,
+			                       stop,
+			                       fn,
+			                       arg)) {
+				return false;
+			}
+		}
+
+		if (stop == end) {
+			break;
+		}
+		virt = next;
+	}
+
+	return true;
+}
+
+/*
+ * Call fn for every present leaf entry overlapping [start, end), lowest
+ * address first, descending each level once instead of once per page.
+ * fn gets where the entry's span begins, which for a 2 MiB or 1 GiB
+ * mapping can lie below start, and may rewrite or clear that entry but
+ * no other.  Returns false as soon as fn does.
+ */
+bool
+mmu_walk_range(page_directory_t *pd,
+               uint64_t start,
+               uint64_t end,
+               mmu_walk_fn_t fn,
+               void *arg)
+{
+	if (pd == NULL || pd->pml4 == NULL) {
+		return false;
+	}
+
+	return walk_level((uint64_t *)pd->pml4,
+	                  PML4_SHIFT,
+	                  start & ~0xFFFULL,
+	                  end,
+	                  fn,
+	                  arg);
+}
+
+/*
+ * Map num_pages 4 KiB pages from virt, taking each frame from next_frame.
+ * The page table of every 2 MiB stretch is found or built once and its
+ * entries filled in sideways.  Returns how many pages were mapped, short
+ * of num_pages when a table or a frame could not be had.
+ */
+size_t
+mmu_map_range_batch(page_directory_t *pd,
+                    uint64_t virt,
+                    size_t num_pages,
+                    uint64_t flags,
+                    mmu_frame_fn_t next_frame,
+                    void *arg)
+{
+	if (pd == NULL || pd->pml4 == NULL) {
+		return 0;
+	}
+
+	virt &= ~0xFFFULL;
+
+	uint64_t table_flags = PAGE_WRITE | (flags & PAGE_USER);
+	size_t done = 0;
+
+	while (done < num_pages) {
+		pde_t *pde = get_pde(pd, virt, true, flags);
+		if (pde == NULL) {
+			break;
+		}
+
+		if ((*pde & PAGE_HUGE) && !mmu_split_huge_page(pd, virt)) {
+			break;
+		}
+
+		pte_t *pt = get_next_level(pde, 0, true, table_flags);
+		if (pt == NULL) {
+			break;
+		}
+
+		for (size_t idx = PT_INDEX(virt); idx < 512 && done < num_pages;
+		     idx++) {
+			uint64_t phys;
+			if (!next_frame(done, &phys, arg)) {
+				return done;
+			}
+
+			/* Filling a hole needs no invalidation */
+			pte_t old = pt[idx];
+			mmu_set_leaf(&pt[idx],
+			             (phys & PAGE_ADDR_MASK) |
+			                 leaf_flags(virt, flags) | PAGE_PRESENT,
+			             PAGE_SIZE);
+			if (old & PAGE_PRESENT) {
+				flush_page(pd, virt);
+			}
+
+			virt += PAGE_SIZE;
+			done++;
+		}
+	}
+
+	return done;
+}
+
+/* Unlink the empty table entry points to and free it after the flush */
+static void
+release_table(page_directory_t *pd,
+              mmu_gather_t *tlb,
+              uint64_t *entry,
+              uint64_t virt)
+{
+	void *table = phys_to_virt(*entry & PAGE_ADDR_MASK);
+
+	mmu_set_entry(entry, 0);
+
+	/* invlpg also drops the paging-structure caches of the PCID */
+	if (tlb != NULL) {
+		mmu_gather_page(tlb, virt);
+		mmu_gather_free(tlb, table, 0);
+	} else {
+		flush_page(pd, virt);
+		pmm_free(table);
+	}
+}
+
+static void
+reclaim_level(page_directory_t *pd,
+              mmu_gather_t *tlb,
+              uint64_t *table,
+              unsigned int shift,
+              uint64_t virt,
+              uint64_t end)
+{
+	uint64_t span = 1ULL << shift;
+
+	while (virt < end) {
+		uint64_t base = virt & ~(span - 1);
+		uint64_t next = base + span;
+		uint64_t stop = next < end ? next : end;
+		uint64_t *entry = &table[(virt >> shift) & 0x1FF];
+
+		if ((*entry & PAGE_PRESENT) && !(*entry & PAGE_HUGE)) {
+			uint64_t *child = phys_to_virt(*entry & PAGE_ADDR_MASK);
+			struct page *page = table_page(child);
+
+			if (shift > PD_SHIFT) {
+				reclaim_level(
+				    pd, tlb, child, shift - 9, virt, stop);
+			}
+
+			if (page != NULL && page->private == 0) {
+				release_table(pd, tlb, entry, base);
+			}
+		}
+
+		virt = next;
+	}
+}
+
+/*
+ * Free the page tables under the user half of [start, end) that have no
+ * present entries left, bottom up, so a PD whose last PT goes is freed
+ * as well.  With a gather the frees and invalidations join its batch.
+ */
+void
+mmu_reclaim_tables(page_directory_t *pd,
+                   mmu_gather_t *tlb,
+                   uint64_t start,
+                   uint64_t end)
+{
+	if (pd == NULL || pd->pml4 == NULL || start >= MMU_USER_TOP) {
+		return;
+	}
+
+	if (end > MMU_USER_TOP) {
+		end = MMU_USER_TOP;
+	}
+
+	reclaim_level(pd, tlb, (uint64_t *)pd->pml4, PML4_SHIFT, start, end);
+}
+
 bool
 mmu_is_mapped(page_directory_t *pd, uint64_t virt)
 {
@@ -298,12 +1132,14 @@ mmu_set_page_fault_handler(page_fault_handler_t handler)
 	page_fault_handler = handler;
 }
 
-void
+bool
 mmu_handle_page_fault(uint64_t fault_addr, uint64_t error_code)
 {
 	if (page_fault_handler != NULL) {
-		page_fault_handler(fault_addr, error_code);
+		return page_fault_handler(fault_addr, error_code);
 	}
+
+	return false;
 }
 
 void
@@ -318,6 +1154,17 @@ mmu_flush_tlb_all(void)
 	write_cr3(read_cr3());
 }
 
+/* Drop every user translation pd may have cached, loaded or not */
+void
+mmu_flush_address_space(page_directory_t *pd)
+{
+	if (!pcid_enabled || pd->phys_addr == (read_cr3() & PAGE_ADDR_MASK)) {
+		mmu_flush_tlb_all();
+	} else {
+		pd->asid_gen = 0;
+	}
+}
+
 void *
 mmu_phys_to_virt(uint64_t phys)
 {
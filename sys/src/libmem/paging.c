@@ -18,6 +18,14 @@ paging_init(void)
 	kernel_directory = mmu_get_current_address_space();
 }
 
+/* Frame source for a physically contiguous range, arg is its base */
+static bool
+next_contiguous_frame(size_t index, uint64_t *phys, void *arg)
+{
+	*phys = *(uint64_t *)arg + (index * PAGE_SIZE);
+	return true;
+}
+
 bool
 paging_map_range(page_directory_t *pd,
                  uint64_t virt_base,
@@ -32,21 +40,88 @@ paging_map_range(page_directory_t *pd,
 	virt_base &= ~0xFFFULL;
 	phys_base &= ~0xFFFULL;
 
-	for (size_t i = 0; i < num_pages; i++) {
-		uint64_t virt = virt_base + (i * PAGE_SIZE);
-		uint64_t phys = phys_base + (i * PAGE_SIZE);
+	size_t mapped = mmu_map_range_batch(
+	    pd, virt_base, num_pages, flags, next_contiguous_frame, &phys_base);
+	if (mapped < num_pages) {
+		paging_unmap_range(pd, virt_base, mapped);
+		return false;
+	}
 
-		if (!mmu_map_page(pd, virt, phys, flags)) {
-			for (size_t j = 0; j < i; j++) {
-				mmu_unmap_page(pd, virt_base + (j * PAGE_SIZE));
-			}
-			return false;
+	return true;
+}
+
+struct unmap_walk {
+	mmu_gather_t tlb;
+	uint64_t start;
+	uint64_t end;
+	bool free;
+	size_t freed;
+};
+
+static bool
+unmap_entry(uint64_t virt, uint64_t *entry, uint64_t size, void *arg)
+{
+	struct unmap_walk *w = arg;
+	uint64_t phys = *entry & PAGE_ADDR_MASK & ~(size - 1);
+
+	/* 1 GiB mappings belong to the kernel and are never taken apart */
+	if (size > HUGE_PAGE_SIZE) {
+		return true;
+	}
+
+	/* Partial unmap of a 2 MiB mapping: the first page splits it */
+	if (virt < w->start || virt + size > w->end) {
+		uint64_t from = virt < w->start ? w->start : virt;
+		uint64_t to = virt + size > w->end ? w->end : virt + size;
+
+		for (uint64_t page = from; page < to; page += PAGE_SIZE) {
+			if (!mmu_gather_unmap_page(&w->tlb, page) || !w->free)
+				continue;
+			mmu_gather_free(
+			    &w->tlb, mmu_phys_to_virt(phys + (page - virt)), 0);
+			w->freed++;
 		}
+		return true;
+	}
+
+	mmu_set_leaf(entry, 0, size);
+	mmu_gather_page(&w->tlb, virt);
+
+	if (w->free) {
+		mmu_gather_free(&w->tlb,
+		                mmu_phys_to_virt(phys),
+		                size == PAGE_SIZE ? 0 : HUGE_PAGE_ORDER);
+		w->freed += size / PAGE_SIZE;
 	}
 
 	return true;
 }
 
+static size_t
+unmap_walk_range(page_directory_t *pd,
+                 uint64_t virt_base,
+                 size_t num_pages,
+                 bool free)
+{
+	struct unmap_walk w;
+
+	virt_base &= ~0xFFFULL;
+
+	mmu_gather_init(&w.tlb, pd);
+	w.start = virt_base;
+	w.end = virt_base + (num_pages * PAGE_SIZE);
+	w.free = free;
+	w.freed = 0;
+
+	mmu_walk_range(pd, w.start, w.end, unmap_entry, &w);
+
+	/* Tables left empty join the batch, flushed and freed with the rest */
+	mmu_reclaim_tables(pd, &w.tlb, w.start, w.end);
+	mmu_gather_flush(&w.tlb);
+
+	return w.freed;
+}
+
 bool
 paging_unmap_range(page_directory_t *pd, uint64_t virt_base, size_t num_pages)
 {
@@ -54,11 +129,175 @@ paging_unmap_range(page_directory_t *pd, uint64_t virt_base, size_t num_pages)
 		return false;
 	}
 
+	unmap_walk_range(pd, virt_base, num_pages, false);
+
+	return true;
+}
+
+/*
+ * Unmap a range and free the frames behind it.  Whole 2 MiB mappings go
+ * back to the PMM as one block; partly covered ones are split first.
+ * Returns the number of 4 KiB frames freed.
+ */
+size_t
+paging_unmap_free_range(page_directory_t *pd,
+                        uint64_t virt_base,
+                        size_t num_pages)
+{
+	if (pd == NULL) {
+		return 0;
+	}
+
+	return unmap_walk_range(pd, virt_base, num_pages, true);
+}
+
+/* Frame source handing out freshly zeroed frames */
+static bool
+next_zeroed_frame(size_t index, uint64_t *phys, void *arg)
+{
+	(void)index;
+	(void)arg;
+
+	void *page = pmm_alloc_zeroed();
+	if (page == NULL) {
+		return false;
+	}
+
+	*phys = mmu_virt_to_phys(page);
+	return true;
+}
+
+/*
+ * As paging_alloc_range(), but always with 4 KiB pages, for ranges that
+ * are later shared or changed page by page.
+ */
+bool
+paging_alloc_pages(page_directory_t *pd,
+                   uint64_t virt_base,
+                   size_t num_pages,
+                   uint64_t flags)
+{
+	if (pd == NULL) {
+		return false;
+	}
+
 	virt_base &= ~0xFFFULL;
 
-	for (size_t i = 0; i < num_pages; i++) {
+	size_t mapped = mmu_map_range_batch(
+	    pd, virt_base, num_pages, flags, next_zeroed_frame, NULL);
+	if (mapped < num_pages) {
+		paging_unmap_free_range(pd, virt_base, mapped);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Back a range with zeroed memory.  Every 2 MiB aligned stretch gets a
+ * huge page when the PMM has a free order-9 block; the rest, or all of
+ * it under fragmentation, is mapped with 4 KiB pages.  On failure the
+ * part already mapped is released again.
+ */
+bool
+paging_alloc_range(page_directory_t *pd,
+                   uint64_t virt_base,
+                   size_t num_pages,
+                   uint64_t flags)
+{
+	if (pd == NULL) {
+		return false;
+	}
+
+	virt_base &= ~0xFFFULL;
+
+	size_t i = 0;
+
+	while (i < num_pages) {
 		uint64_t virt = virt_base + (i * PAGE_SIZE);
-		mmu_unmap_page(pd, virt);
+
+		if ((virt & (HUGE_PAGE_SIZE - 1)) == 0 &&
+		    num_pages - i >= HUGE_PAGE_PAGES) {
+			void *block = pmm_alloc_order(HUGE_PAGE_ORDER);
+
+			if (block != NULL) {
+				memset(block, 0, HUGE_PAGE_SIZE);
+				if (mmu_map_huge_page(pd,
+				                      virt,
+				                      mmu_virt_to_phys(block),
+				                      flags)) {
+					i += HUGE_PAGE_PAGES;
+					continue;
+				}
+				pmm_free_order(block, HUGE_PAGE_ORDER);
+			}
+		}
+
+		/* 4 KiB pages up to the next 2 MiB boundary */
+		size_t run = (HUGE_PAGE_SIZE - (virt & (HUGE_PAGE_SIZE - 1))) /
+		             PAGE_SIZE;
+		if (run > num_pages - i) {
+			run = num_pages - i;
+		}
+
+		size_t mapped = mmu_map_range_batch(
+		    pd, virt, run, flags, next_zeroed_frame, NULL);
+		i += mapped;
+		if (mapped < run) {
+			break;
+		}
+	}
+
+	if (i < num_pages) {
+		paging_unmap_free_range(pd, virt_base, i);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Give dst a private copy of the 2 MiB page at src_phys.  Falls back to
+ * 512 separate 4 KiB frames when no free 2 MiB block is left.
+ */
+bool
+paging_copy_huge_page(page_directory_t *dst,
+                      uint64_t virt,
+                      uint64_t src_phys,
+                      uint64_t flags)
+{
+	void *block = pmm_alloc_order(HUGE_PAGE_ORDER);
+
+	if (block != NULL) {
+		memcpy(block, mmu_phys_to_virt(src_phys), HUGE_PAGE_SIZE);
+		if (mmu_map_huge_page(dst, virt, mmu_virt_to_phys(block), flags)) {
+			return true;
+		}
+		pmm_free_order(block, HUGE_PAGE_ORDER);
+		return false;
+	}
+
+	uint64_t page_flags = flags & ~(PAGE_HUGE | PAGE_HUGE_PAT);
+
+	for (size_t i = 0; i < HUGE_PAGE_PAGES; i++) {
+		void *page = pmm_alloc();
+		if (page == NULL) {
+			paging_unmap_free_range(dst, virt, i);
+			return false;
+		}
+
+		memcpy(page,
+		       mmu_phys_to_virt(src_phys + (i * PAGE_SIZE)),
+		       PAGE_SIZE);
+
+		if (!mmu_map_page(dst,
+		                  virt + (i * PAGE_SIZE),
+		                  mmu_virt_to_phys(page),
+		                  page_flags)) {
+			pmm_free(page);
+			paging_unmap_free_range(dst, virt, i);
+			return false;
+		}
 	}
 
 	return true;
@@ -136,28 +375,99 @@ paging_create_user_address_space(void)
 	return pd;
 }
 
-page_directory_t *
-paging_clone_address_space(page_directory_t *src)
+/*
+ * Map the frame behind *src_pte into dst at virt as well.  Writable pages
+ * lose PAGE_WRITE in both spaces and gain PAGE_COW, so the first write on
+ * either side faults and gets its own copy.  Frames the PMM does not hand
+ * out (device memory, reserved ranges) cannot be refcounted and are still
+ * copied.  Both sides batch their invalidations.
+ */
+static bool
+share_page(mmu_gather_t *dst, mmu_gather_t *src, pte_t *src_pte, uint64_t virt)
 {
-	if (src == NULL || src->pml4 == NULL) {
-		return NULL;
+	uint64_t phys = *src_pte & PAGE_ADDR_MASK;
+	struct page *page = phys_to_page(phys);
+
+	if (page == NULL || (page->flags & PG_RESERVED) ||
+	    page_refcount(page) == 0) {
+		void *copy = pmm_alloc();
+		if (copy == NULL) {
+			return false;
+		}
+
+		memcpy(copy, mmu_phys_to_virt(phys), PAGE_SIZE);
+		if (!mmu_gather_map_page(dst,
+		                         virt,
+		                         mmu_virt_to_phys(copy),
+		                         *src_pte & ~PAGE_ADDR_MASK)) {
+			pmm_free(copy);
+			return false;
+		}
+		return true;
 	}
 
-	page_directory_t *new_pd = mmu_create_address_space();
-	if (new_pd == NULL) {
-		return NULL;
+	if (*src_pte & (PAGE_WRITE | PAGE_COW)) {
+		if (*src_pte & PAGE_WRITE) {
+			mmu_gather_page(src, virt);
+		}
+		*src_pte = (*src_pte & ~PAGE_WRITE) | PAGE_COW;
+		page->flags |= PG_COW;
+	}
+
+	if (!mmu_gather_map_page(dst, virt, phys, *src_pte & ~PAGE_ADDR_MASK)) {
+		return false;
+	}
+
+	page_get(page);
+	return true;
+}
+
+/* Share every page of the page table pde points to, mapping 2 MiB at virt */
+static bool
+share_table(mmu_gather_t *dst, mmu_gather_t *src, pde_t pde, uint64_t virt)
+{
+	pte_t *pt = (pte_t *)mmu_phys_to_virt(pde & PAGE_ADDR_MASK);
+
+	for (int pt_idx = 0; pt_idx < 512; pt_idx++) {
+		if (!(pt[pt_idx] & PAGE_PRESENT))
+			continue;
+
+		uint64_t page_virt = virt | ((uint64_t)pt_idx << PT_SHIFT);
+		if (!share_page(dst, src, &pt[pt_idx], page_virt)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Give dst the user half of src for fork().  4 KiB pages are shared
+ * copy-on-write, so the cost is the page tables rather than the memory
+ * they map; 2 MiB pages are still copied.  On failure dst holds whatever
+ * was shared so far and is torn down by the caller as usual.
+ */
+bool
+paging_copy_user_pages(page_directory_t *dst, page_directory_t *src)
+{
+	if (dst == NULL || src == NULL || src->pml4 == NULL) {
+		return false;
 	}
 
 	pml4e_t *src_pml4 = src->pml4;
+	bool ok = true;
+	mmu_gather_t dst_tlb, src_tlb;
+	mmu_gather_init(&dst_tlb, dst);
+	mmu_gather_init(&src_tlb, src);
 
-	for (int pml4_idx = 0; pml4_idx < 256; pml4_idx++) {
+	for (int pml4_idx = 0; pml4_idx < 256 && ok; pml4_idx++) {
 		if (!(src_pml4[pml4_idx] & PAGE_PRESENT))
 			continue;
 
 		uint64_t pdpt_phys = src_pml4[pml4_idx] & PAGE_ADDR_MASK;
 		pdpte_t *pdpt = (pdpte_t *)mmu_phys_to_virt(pdpt_phys);
 
-		for (int pdpt_idx = 0; pdpt_idx < 512; pdpt_idx++) {
+		for (int pdpt_idx = 0; pdpt_idx < 512 && ok; pdpt_idx++) {
 			if (!(pdpt[pdpt_idx] & PAGE_PRESENT))
 				continue;
 			if (pdpt[pdpt_idx] & PAGE_HUGE)
@@ -166,60 +476,126 @@ paging_clone_address_space(page_directory_t *src)
 			uint64_t pd_phys = pdpt[pdpt_idx] & PAGE_ADDR_MASK;
 			pde_t *pd_table = (pde_t *)mmu_phys_to_virt(pd_phys);
 
-			for (int pd_idx = 0; pd_idx < 512; pd_idx++) {
+			for (int pd_idx = 0; pd_idx < 512 && ok; pd_idx++) {
 				if (!(pd_table[pd_idx] & PAGE_PRESENT))
 					continue;
-				if (pd_table[pd_idx] & PAGE_HUGE)
-					continue; // Skip huge pages
 
-				uint64_t pt_phys =
-				    pd_table[pd_idx] & PAGE_ADDR_MASK;
-				pte_t *pt = (pte_t *)mmu_phys_to_virt(pt_phys);
+				uint64_t virt =
+				    ((uint64_t)pml4_idx << PML4_SHIFT) |
+				    ((uint64_t)pdpt_idx << PDPT_SHIFT) |
+				    ((uint64_t)pd_idx << PD_SHIFT);
 
-				for (int pt_idx = 0; pt_idx < 512; pt_idx++) {
-					if (!(pt[pt_idx] & PAGE_PRESENT))
-						continue;
+				pde_t pde = pd_table[pd_idx];
+				if (pde & PAGE_HUGE) {
+					ok = paging_copy_huge_page(
+					    dst,
+					    virt,
+					    pde & HUGE_PAGE_ADDR_MASK,
+					    pde & ~HUGE_PAGE_ADDR_MASK);
+					continue;
+				}
 
-					uint64_t src_page_phys =
-					    pt[pt_idx] & PAGE_ADDR_MASK;
-					uint64_t flags =
-					    pt[pt_idx] & ~PAGE_ADDR_MASK;
-
-					void *new_page = pmm_alloc();
-					if (new_page == NULL) {
-						mmu_destroy_address_space(
-						    new_pd);
-						return NULL;
-					}
+				ok = share_table(&dst_tlb, &src_tlb, pde, virt);
+			}
+		}
+	}
 
-					void *src_page_virt =
-					    mmu_phys_to_virt(src_page_phys);
-					memcpy(
-					    new_page, src_page_virt, PAGE_SIZE);
+	/* src may be live, drop the writable translations it had cached */
+	mmu_gather_flush(&src_tlb);
+	mmu_gather_flush(&dst_tlb);
 
-					uint64_t new_phys =
-					    mmu_virt_to_phys(new_page);
+	return ok;
+}
 
-					uint64_t virt =
-					    ((uint64_t)pml4_idx << PML4_SHIFT) |
-					    ((uint64_t)pdpt_idx << PDPT_SHIFT) |
-					    ((uint64_t)pd_idx << PD_SHIFT) |
-					    ((uint64_t)pt_idx << PT_SHIFT);
-
-					if (!mmu_map_page(new_pd,
-					                  virt,
-					                  new_phys,
-					                  flags)) {
-						pmm_free(new_page);
-						mmu_destroy_address_space(
-						    new_pd);
-						return NULL;
-					}
-				}
-			}
+struct share_walk {
+	mmu_gather_t dst;
+	mmu_gather_t src;
+	uint64_t start;
+	uint64_t end;
+};
+
+static bool
+share_entry(uint64_t virt, uint64_t *entry, uint64_t size, void *arg)
+{
+	struct share_walk *w = arg;
+
+	if (size == PAGE_SIZE) {
+		return share_page(&w->dst, &w->src, entry, virt);
+	}
+
+	if (size != HUGE_PAGE_SIZE) {
+		return true;
+	}
+
+	if (virt >= w->start && virt + size <= w->end) {
+		return paging_copy_huge_page(w->dst.pd,
+		                             virt,
+		                             *entry & HUGE_PAGE_ADDR_MASK,
+		                             *entry & ~HUGE_PAGE_ADDR_MASK);
+	}
+
+	/* Only part of it is in range: split it and share those pages */
+	if (!mmu_split_huge_page(w->src.pd, virt)) {
+		return false;
+	}
+
+	uint64_t from = virt < w->start ? w->start : virt;
+	uint64_t to = virt + size > w->end ? w->end : virt + size;
+
+	for (uint64_t page = from; page < to; page += PAGE_SIZE) {
+		if (!share_page(&w->dst,
+		                &w->src,
+		                mmu_get_pte(w->src.pd, page),
+		                page)) {
+			return false;
 		}
 	}
 
+	return true;
+}
+
+/* As paging_copy_user_pages(), for one range */
+bool
+paging_share_range(page_directory_t *dst,
+                   page_directory_t *src,
+                   uint64_t virt_base,
+                   size_t num_pages)
+{
+	struct share_walk w;
+
+	virt_base &= ~0xFFFULL;
+
+	mmu_gather_init(&w.dst, dst);
+	mmu_gather_init(&w.src, src);
+	w.start = virt_base;
+	w.end = virt_base + (num_pages * PAGE_SIZE);
+
+	bool ok = mmu_walk_range(src, w.start, w.end, share_entry, &w);
+
+	mmu_gather_flush(&w.src);
+	mmu_gather_flush(&w.dst);
+
+	return ok;
+}
+
+page_directory_t *
+paging_clone_address_space(page_directory_t *src)
+{
+	if (src == NULL || src->pml4 == NULL) {
+		return NULL;
+	}
+
+	page_directory_t *new_pd = mmu_create_address_space();
+	if (new_pd == NULL) {
+		return NULL;
+	}
+
+	if (!paging_copy_user_pages(new_pd, src)) {
+		paging_free_user_pages(new_pd);
+		mmu_destroy_address_space(new_pd);
+		return NULL;
+	}
+
 	return new_pd;
 }
 
@@ -279,6 +655,74 @@ paging_get_flags_for_region_type(region_type_t type)
 	}
 }
 
+/* True if the PMM frame behind phys has references besides this one */
+static bool
+frame_is_shared(uint64_t phys)
+{
+	struct page *page = phys_to_page(phys);
+
+	return page != NULL && !(page->flags & PG_RESERVED) &&
+	       page_refcount(page) > 1;
+}
+
+struct protect_walk {
+	mmu_gather_t tlb;
+	uint64_t start;
+	uint64_t end;
+	uint64_t flags;
+};
+
+/* A frame someone else still maps only becomes writable by COW */
+static uint64_t
+protect_flags(uint64_t phys, uint64_t flags)
+{
+	if ((flags & PAGE_WRITE) && frame_is_shared(phys)) {
+		return (flags & ~PAGE_WRITE) | PAGE_COW;
+	}
+
+	return flags;
+}
+
+static bool
+protect_entry(uint64_t virt, uint64_t *entry, uint64_t size, void *arg)
+{
+	struct protect_walk *w = arg;
+	uint64_t phys = *entry & PAGE_ADDR_MASK & ~(size - 1);
+
+	/* Rewriting the PTE in place, the frame stays mapped throughout */
+	if (size == PAGE_SIZE) {
+		*entry = phys | protect_flags(phys, w->flags) |
+		         (*entry & PAGE_GLOBAL) | PAGE_PRESENT;
+		mmu_gather_page(&w->tlb, virt);
+		return true;
+	}
+
+	if (size != HUGE_PAGE_SIZE) {
+		return true;
+	}
+
+	/* Whole 2 MiB mappings keep their size, only the PDE changes */
+	if (virt >= w->start && virt + size <= w->end) {
+		return mmu_gather_map_huge_page(&w->tlb, virt, phys, w->flags);
+	}
+
+	uint64_t from = virt < w->start ? w->start : virt;
+	uint64_t to = virt + size > w->end ? w->end : virt + size;
+
+	for (uint64_t page = from; page < to; page += PAGE_SIZE) {
+		uint64_t page_phys = phys + (page - virt);
+
+		if (!mmu_gather_map_page(&w->tlb,
+		                         page,
+		                         page_phys,
+		                         protect_flags(page_phys, w->flags))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 bool
 paging_protect_range(page_directory_t *pd,
                      uint64_t virt_base,
@@ -289,28 +733,19 @@ paging_protect_range(page_directory_t *pd,
 		return false;
 	}
 
-	virt_base &= ~0xFFFULL;
+	struct protect_walk w;
 
-	for (size_t i = 0; i < num_pages; i++) {
-		uint64_t virt = virt_base + (i * PAGE_SIZE);
-
-		if (!mmu_is_mapped(pd, virt)) {
-			continue;
-		}
+	virt_base &= ~0xFFFULL;
 
-		uint64_t phys = mmu_get_physical_address(pd, virt);
+	mmu_gather_init(&w.tlb, pd);
+	w.start = virt_base;
+	w.end = virt_base + (num_pages * PAGE_SIZE);
+	w.flags = flags;
 
-		if (!mmu_unmap_page(pd, virt)) {
-			return false;
-		}
+	bool ok = mmu_walk_range(pd, w.start, w.end, protect_entry, &w);
+	mmu_gather_flush(&w.tlb);
 
-		if (!mmu_map_page(pd, virt, phys, flags)) {
-			return false;
-		}
-	}
-	mmu_flush_tlb_all();
-
-	return true;
+	return ok;
 }
 
 void
@@ -346,8 +781,18 @@ paging_free_user_pages(page_directory_t *pd)
 			for (int pd_idx = 0; pd_idx < 512; pd_idx++) {
 				if (!(pd_table[pd_idx] & PAGE_PRESENT))
 					continue;
-				if (pd_table[pd_idx] & PAGE_HUGE)
+
+				if (pd_table[pd_idx] & PAGE_HUGE) {
+					uint64_t block_phys =
+					    pd_table[pd_idx] &
+					    HUGE_PAGE_ADDR_MASK;
+
+					pmm_free_order(
+					    mmu_phys_to_virt(block_phys),
+					    HUGE_PAGE_ORDER);
+					pages_freed += HUGE_PAGE_PAGES;
 					continue;
+				}
 
 				uint64_t pt_phys =
 				    pd_table[pd_idx] & PAGE_ADDR_MASK;
@@ -377,7 +822,7 @@ paging_free_user_pages(page_directory_t *pd)
 		pmm_free(pdpt);
 		tables_freed++;
 
-		pml4[pml4_idx] = 0;
+		mmu_set_entry(&pml4[pml4_idx], 0);
 	}
 
 	serial_printf(DEBUG_PORT,
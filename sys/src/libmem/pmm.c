@@ -1,6 +1,10 @@
 #include <pmm.h>
+#include <shrinker.h>
+#include <kmprof.h>
 #include <limine.h>
 #include <string.h>
+#include <intr.h>
+#include <sys/atomic.h>
 
 extern void serial_printf(uint16_t port, const char *fmt, ...);
 #define DEBUG_PORT 0x3F8
@@ -10,16 +14,71 @@ static uint64_t total_pages = 0;
 static uint64_t free_pages = 0;
 static uint64_t usable_pages = 0;
 static uint64_t bitmap_size = 0;
+static uint64_t bitmap_qwords = 0;
 static uint64_t hhdm_offset = 0;
 
-static uint64_t last_alloc_hint = 0;
+/*
+ * Free-space summaries over the bitmap.  Bit i of summary_l0 is set when
+ * bitmap qword i has a free page, bit j of summary_l1 when summary_l0
+ * word j is nonzero (a 64-qword group has a free page), and bit k of
+ * summary_l2 when summary_l1 word k is nonzero (a 4096-qword group).
+ */
+static uint64_t *summary_l0 = NULL;
+static uint64_t *summary_l1 = NULL;
+static uint64_t *summary_l2 = NULL;
+static uint64_t summary_l0_words = 0;
+static uint64_t summary_l1_words = 0;
+static uint64_t summary_l2_words = 0;
+
+/* Frame descriptors, one per tracked page, indexed by PFN */
+static struct page *page_array = NULL;
+
+/*
+ * Per-CPU magazines of free frames.  Frames in a magazine are marked
+ * allocated in the bitmap and are off the buddy lists, but still count
+ * toward free_pages.  A magazine is refilled or drained PMM_PCP_BATCH
+ * frames at a time, and drained once it reaches PMM_PCP_HIGH.
+ */
+#define PMM_MAXCPU 1
+#define PMM_PCP_BATCH 16
+#define PMM_PCP_HIGH 64
+
+struct pmm_pcp {
+	uint64_t count;
+	uint64_t pfns[PMM_PCP_HIGH];
+};
+
+static struct pmm_pcp pmm_pcp[PMM_MAXCPU];
+static uint64_t cached_pages = 0;
+
+/*
+ * Pool of frames zeroed ahead of time by the idle task for
+ * pmm_alloc_zeroed().  Like the CPU caches, pooled frames are marked
+ * allocated in the bitmap but still count toward free_pages.
+ */
+static uint64_t zero_pool[PMM_ZERO_POOL_MAX];
+static uint64_t zero_pool_count = 0;
+
+/*
+ * Free page watermarks.  Below low, allocations ask the shrinkers for
+ * memory back up to high, backing off for PMM_RECLAIM_BACKOFF allocations
+ * when they come back empty-handed; below min they always ask.  An
+ * allocation that finds nothing free reclaims once before failing.
+ */
+#define PMM_WMARK_MIN_PAGES 32
+#define PMM_WMARK_MAX_PAGES 4096
+#define PMM_RECLAIM_BACKOFF 64
+static uint64_t wmark_min = 0;
+static uint64_t wmark_low = 0;
+static uint64_t wmark_high = 0;
+static uint64_t reclaim_backoff = 0;
+
 static pmm_stats_t stats = { 0 };
 static struct limine_memmap_response *saved_memmap = NULL;
 
-#define BITMAP_INDEX(page) ((page) / 8)
-#define BITMAP_BIT(page) ((page) % 8)
 #define BITMAP_QWORD_INDEX(page) ((page) / 64)
 #define BITMAP_QWORD_BIT(page) ((page) % 64)
+#define QWORDS_FOR(bits) (((bits) + 63) / 64)
 
 static inline uint64_t
 bytes_to_mb(uint64_t bytes)
@@ -45,70 +104,375 @@ bytes_to_kb_frac(uint64_t bytes)
 	return ((bytes % 1024) * 100) / 1024;
 }
 
+static inline uint64_t *
+bitmap_as_qwords(void)
+{
+	return (uint64_t *)bitmap;
+}
+
+static inline void
+summary_mark_free(uint64_t qword)
+{
+	uint64_t l0 = qword / 64;
+	uint64_t l1 = l0 / 64;
+
+	summary_l0[l0] |= 1ULL << (qword % 64);
+	summary_l1[l1] |= 1ULL << (l0 % 64);
+	summary_l2[l1 / 64] |= 1ULL << (l1 % 64);
+}
+
+static inline void
+summary_mark_full(uint64_t qword)
+{
+	uint64_t l0 = qword / 64;
+	uint64_t l1 = l0 / 64;
+
+	summary_l0[l0] &= ~(1ULL << (qword % 64));
+	if (summary_l0[l0] != 0) {
+		return;
+	}
+
+	summary_l1[l1] &= ~(1ULL << (l0 % 64));
+	if (summary_l1[l1] != 0) {
+		return;
+	}
+
+	summary_l2[l1 / 64] &= ~(1ULL << (l1 % 64));
+}
+
 static inline void
 bitmap_set(uint64_t index)
 {
-	bitmap[BITMAP_INDEX(index)] |= (1 << BITMAP_BIT(index));
+	uint64_t *qwords = bitmap_as_qwords();
+	uint64_t qword = BITMAP_QWORD_INDEX(index);
+
+	qwords[qword] |= 1ULL << BITMAP_QWORD_BIT(index);
+	if (qwords[qword] == 0xFFFFFFFFFFFFFFFFULL) {
+		summary_mark_full(qword);
+	}
 }
 
 static inline void
 bitmap_clear(uint64_t index)
 {
-	bitmap[BITMAP_INDEX(index)] &= ~(1 << BITMAP_BIT(index));
+	uint64_t qword = BITMAP_QWORD_INDEX(index);
+
+	bitmap_as_qwords()[qword] &= ~(1ULL << BITMAP_QWORD_BIT(index));
+	summary_mark_free(qword);
 }
 
 static inline bool
 bitmap_test(uint64_t index)
 {
-	return bitmap[BITMAP_INDEX(index)] & (1 << BITMAP_BIT(index));
+	return bitmap_as_qwords()[BITMAP_QWORD_INDEX(index)] &
+	       (1ULL << BITMAP_QWORD_BIT(index));
 }
 
-static inline uint64_t *
-bitmap_as_qwords(void)
+/*
+ * Walk the summaries top-down: one ctz per level lands on a bitmap qword
+ * with a free page, so the cost does not depend on how full memory is.
+ * Only the top level is scanned, and it has one word per 64 GiB of RAM.
+ */
+static uint64_t
+find_free_page_fast(void)
 {
-	return (uint64_t *)bitmap;
+	uint64_t *qwords = bitmap_as_qwords();
+
+	for (uint64_t i = 0; i < summary_l2_words; i++) {
+		if (summary_l2[i] == 0) {
+			continue;
+		}
+
+		uint64_t l1 = i * 64 + __builtin_ctzll(summary_l2[i]);
+		uint64_t l0 = l1 * 64 + __builtin_ctzll(summary_l1[l1]);
+		uint64_t qword = l0 * 64 + __builtin_ctzll(summary_l0[l0]);
+		uint64_t page = qword * 64 + __builtin_ctzll(~qwords[qword]);
+
+		if (page < total_pages) {
+			return page;
+		}
+	}
+
+	return (uint64_t)-1; /* No free pages */
+}
+
+/*
+ * Buddy free lists.  Every free page belongs to exactly one naturally
+ * aligned block of 2^order pages that sits on free_area[order]; the list
+ * links live in the first page of the free block itself, reached through
+ * the HHDM.  page_order[pfn] holds the order of the free block headed at
+ * pfn, or PMM_ORDER_NONE, so finding a buddy on free is a single lookup.
+ * The bitmap above stays the per-page allocated/free record.
+ */
+struct pmm_free_block {
+	struct pmm_free_block *next;
+	struct pmm_free_block *prev;
+};
+
+#define PMM_ORDER_NONE 0xFF
+
+static struct pmm_free_block *free_area[PMM_MAX_ORDER];
+static uint64_t free_area_count[PMM_MAX_ORDER];
+static uint8_t *page_order = NULL;
+
+static inline struct pmm_free_block *
+pfn_to_block(uint64_t pfn)
+{
+	return (struct pmm_free_block *)(pfn * PAGE_SIZE + hhdm_offset);
+}
+
+static inline uint64_t
+block_to_pfn(struct pmm_free_block *block)
+{
+	return ((uint64_t)block - hhdm_offset) / PAGE_SIZE;
+}
+
+static void
+buddy_list_add(uint64_t pfn, unsigned int order)
+{
+	struct pmm_free_block *block = pfn_to_block(pfn);
+
+	block->prev = NULL;
+	block->next = free_area[order];
+	if (free_area[order] != NULL) {
+		free_area[order]->prev = block;
+	}
+	free_area[order] = block;
+	free_area_count[order]++;
+	page_order[pfn] = order;
+}
+
+static void
+buddy_list_del(uint64_t pfn, unsigned int order)
+{
+	struct pmm_free_block *block = pfn_to_block(pfn);
+
+	if (block->prev != NULL) {
+		block->prev->next = block->next;
+	} else {
+		free_area[order] = block->next;
+	}
+	if (block->next != NULL) {
+		block->next->prev = block->prev;
+	}
+	free_area_count[order]--;
+	page_order[pfn] = PMM_ORDER_NONE;
 }
 
+/* Return a free block to the lists, coalescing with free buddies */
+static void
+buddy_insert(uint64_t pfn, unsigned int order)
+{
+	while (order < PMM_MAX_ORDER - 1) {
+		uint64_t buddy = pfn ^ (1ULL << order);
+
+		if (buddy >= total_pages || page_order[buddy] != order) {
+			break;
+		}
+
+		buddy_list_del(buddy, order);
+		pfn &= ~(1ULL << order);
+		order++;
+		stats.merge_count++;
+	}
+
+	buddy_list_add(pfn, order);
+}
+
+/* Take a block of the given order, splitting a larger one if needed */
 static uint64_t
-find_free_page_fast(void)
+buddy_take(unsigned int order)
 {
-	size_t bitmap_qwords = (total_pages + 63) / 64;
-	uint64_t *qwords = bitmap_as_qwords();
+	unsigned int current = order;
+
+	while (current < PMM_MAX_ORDER && free_area[current] == NULL) {
+		current++;
+	}
+
+	if (current == PMM_MAX_ORDER) {
+		return (uint64_t)-1;
+	}
+
+	uint64_t pfn = block_to_pfn(free_area[current]);
+	buddy_list_del(pfn, current);
+
+	while (current > order) {
+		current--;
+		buddy_list_add(pfn + (1ULL << current), current);
+		stats.split_count++;
+	}
+
+	return pfn;
+}
+
+/*
+ * Remove a single free page from whichever free block contains it.  The
+ * containing block is found by probing each aligned head below pfn, and
+ * the remainder is split back onto the lists, so this is O(PMM_MAX_ORDER).
+ */
+static bool
+buddy_carve(uint64_t pfn)
+{
+	for (unsigned int order = 0; order < PMM_MAX_ORDER; order++) {
+		uint64_t head = pfn & ~((1ULL << order) - 1);
+
+		if (page_order[head] != order) {
+			continue;
+		}
 
-	size_t start_qword = BITMAP_QWORD_INDEX(last_alloc_hint);
+		buddy_list_del(head, order);
 
-	for (size_t i = start_qword; i < bitmap_qwords; i++) {
-		if (qwords[i] != 0xFFFFFFFFFFFFFFFFULL) {
-			/* Found a qword with free bits (0s in bitmap = free) */
-			uint64_t bits =
-			    ~qwords[i]; /* Invert: free bits become 1s */
-			int bit =
-			    __builtin_ctzll(bits); /* Count trailing zeros */
-			uint64_t page = (i * 64) + bit;
+		while (order > 0) {
+			order--;
+			uint64_t half = 1ULL << order;
 
-			if (page < total_pages) {
-				last_alloc_hint = page;
-				return page;
+			if (pfn >= head + half) {
+				buddy_list_add(head, order);
+				head += half;
+			} else {
+				buddy_list_add(head + half, order);
 			}
+			stats.split_count++;
 		}
+
+		return true;
 	}
 
-	for (size_t i = 0; i < start_qword; i++) {
-		if (qwords[i] != 0xFFFFFFFFFFFFFFFFULL) {
-			uint64_t bits = ~qwords[i];
-			int bit = __builtin_ctzll(bits);
-			uint64_t page = (i * 64) + bit;
+	return false;
+}
 
-			if (page < total_pages) {
-				last_alloc_hint = page;
-				return page;
-			}
+/* Hand a run of free pages to the buddy lists as aligned blocks */
+static void
+buddy_free_range(uint64_t pfn, uint64_t count)
+{
+	while (count > 0) {
+		unsigned int order = 0;
+
+		while (order < PMM_MAX_ORDER - 1 &&
+		       (pfn & ((2ULL << order) - 1)) == 0 &&
+		       (2ULL << order) <= count) {
+			order++;
 		}
+
+		buddy_insert(pfn, order);
+		pfn += 1ULL << order;
+		count -= 1ULL << order;
+	}
+}
+
+static unsigned int
+order_for_pages(size_t num_pages)
+{
+	unsigned int order = 0;
+
+	while ((1ULL << order) < num_pages) {
+		order++;
 	}
 
-	return (uint64_t)-1; /* No free pages */
+	return order;
+}
+
+static void
+bitmap_set_range(uint64_t start, uint64_t count)
+{
+	for (uint64_t i = start; i < start + count; i++) {
+		bitmap_set(i);
+	}
+}
+
+static void
+bitmap_clear_range(uint64_t start, uint64_t count)
+{
+	for (uint64_t i = start; i < start + count; i++) {
+		bitmap_clear(i);
+	}
+}
+
+/* Fresh descriptor for a frame being handed out */
+static inline void
+page_reset(uint64_t pfn, unsigned int refcount)
+{
+	struct page *page = &page_array[pfn];
+
+	page->refcount = refcount;
+	page->mapcount = 0;
+	page->flags = 0;
+	page->private = 0;
+	page->owner = NULL;
+}
+
+static inline int
+pmm_cpu_id(void)
+{
+	/* Single CPU until APIC IDs are wired up, as in spinlock.c */
+	return 0;
 }
 
+static uint64_t
+global_alloc_page(void)
+{
+	uint64_t page_index = find_free_page_fast();
+
+	if (page_index == (uint64_t)-1) {
+		return (uint64_t)-1;
+	}
+
+	if (!buddy_carve(page_index)) {
+		serial_printf(DEBUG_PORT,
+		              "[PMM] ERROR: Free page %llu missing from buddy "
+		              "lists\n",
+		              page_index);
+		return (uint64_t)-1;
+	}
+
+	bitmap_set(page_index);
+	return page_index;
+}
+
+static void
+global_free_page(uint64_t page_index)
+{
+	bitmap_clear(page_index);
+	buddy_insert(page_index, 0);
+}
+
+static void
+pcp_refill(struct pmm_pcp *pcp)
+{
+	while (pcp->count < PMM_PCP_BATCH) {
+		uint64_t page_index = global_alloc_page();
+
+		if (page_index == (uint64_t)-1) {
+			break;
+		}
+
+		page_array[page_index].flags = PG_CACHED;
+		pcp->pfns[pcp->count++] = page_index;
+		cached_pages++;
+	}
+}
+
+/* Return the oldest (coldest) frames to the global allocator */
+static void
+pcp_drain(struct pmm_pcp *pcp, uint64_t count)
+{
+	if (count > pcp->count) {
+		count = pcp->count;
+	}
+
+	for (uint64_t i = 0; i < count; i++) {
+		global_free_page(pcp->pfns[i]);
+	}
+
+	pcp->count -= count;
+	memmove(pcp->pfns, pcp->pfns + count, pcp->count * sizeof(uint64_t));
+	cached_pages -= count;
+}
+
+/*
+ * Linear bitmap scan, only used for requests larger than the biggest
+ * buddy block.
+ */
 static uint64_t
 find_free_contiguous(size_t num_pages)
 {
@@ -227,7 +591,11 @@ pmm_init(struct limine_memmap_response *memmap,
 	}
 
 	total_pages = highest_usable_addr / PAGE_SIZE;
-	bitmap_size = (total_pages + 7) / 8;
+	bitmap_qwords = QWORDS_FOR(total_pages);
+	bitmap_size = bitmap_qwords * sizeof(uint64_t);
+	summary_l0_words = QWORDS_FOR(bitmap_qwords);
+	summary_l1_words = QWORDS_FOR(summary_l0_words);
+	summary_l2_words = QWORDS_FOR(summary_l1_words);
 
 	uint64_t track_mb = bytes_to_mb(total_pages * PAGE_SIZE);
 	uint64_t track_mb_frac = bytes_to_mb_frac(total_pages * PAGE_SIZE);
@@ -245,16 +613,33 @@ pmm_init(struct limine_memmap_response *memmap,
 	              bitmap_kb,
 	              bitmap_kb_frac);
 
+	/*
+	 * Summaries, frame descriptors and the buddy order map share the
+	 * bitmap's carve-out, in that order so each stays 8-byte aligned.
+	 */
+	uint64_t summary_size =
+	    (summary_l0_words + summary_l1_words + summary_l2_words) *
+	    sizeof(uint64_t);
+	uint64_t page_array_size = total_pages * sizeof(struct page);
+	uint64_t metadata_size =
+	    bitmap_size + summary_size + page_array_size + total_pages;
+
 	bitmap = NULL;
 	for (uint64_t i = 0; i < entry_count; i++) {
 		struct limine_memmap_entry *entry = entries[i];
 
 		if (entry->type == LIMINE_MEMMAP_USABLE &&
-		    entry->length >= bitmap_size) {
+		    entry->length >= metadata_size) {
 			bitmap = (uint8_t *)(entry->base + hhdm_offset);
+			summary_l0 = (uint64_t *)(bitmap + bitmap_size);
+			summary_l1 = summary_l0 + summary_l0_words;
+			summary_l2 = summary_l1 + summary_l1_words;
+			page_array =
+			    (struct page *)(summary_l2 + summary_l2_words);
+			page_order = (uint8_t *)(page_array + total_pages);
 
-			entry->base += bitmap_size;
-			entry->length -= bitmap_size;
+			entry->base += metadata_size;
+			entry->length -= metadata_size;
 
 			serial_printf(DEBUG_PORT,
 			              "[PMM] Bitmap placed at virtual 0x%p\n",
@@ -269,12 +654,15 @@ pmm_init(struct limine_memmap_response *memmap,
 		return;
 	}
 
+	/* Pages past total_pages stay marked allocated forever */
 	memset(bitmap, 0xFF, bitmap_size);
+	memset(summary_l0, 0, summary_size);
 
-	uint64_t excess_bits = total_pages % 8;
-	if (excess_bits != 0) {
-		uint8_t mask = (1 << excess_bits) - 1;
-		bitmap[bitmap_size - 1] = 0xFF & ~mask;
+	memset(page_array, 0, page_array_size);
+	memset(page_order, PMM_ORDER_NONE, total_pages);
+	for (unsigned int order = 0; order < PMM_MAX_ORDER; order++) {
+		free_area[order] = NULL;
+		free_area_count[order] = 0;
 	}
 
 	free_pages = 0;
@@ -292,21 +680,33 @@ pmm_init(struct limine_memmap_response *memmap,
 
 			if (aligned_end > aligned_base) {
 				uint64_t base_page = aligned_base / PAGE_SIZE;
-				uint64_t page_count =
-				    (aligned_end - aligned_base) / PAGE_SIZE;
+				uint64_t end_page = aligned_end / PAGE_SIZE;
 
-				for (uint64_t j = 0; j < page_count; j++) {
-					uint64_t page = base_page + j;
-					if (page < total_pages) {
-						bitmap_clear(page);
-						free_pages++;
-						usable_pages++;
-					}
+				if (end_page > total_pages) {
+					end_page = total_pages;
+				}
+
+				if (end_page > base_page) {
+					uint64_t page_count =
+					    end_page - base_page;
+
+					bitmap_clear_range(base_page,
+					                   page_count);
+					buddy_free_range(base_page, page_count);
+					free_pages += page_count;
+					usable_pages += page_count;
 				}
 			}
 		}
 	}
 
+	/* Frames the PMM never hands out keep PG_RESERVED */
+	for (uint64_t i = 0; i < total_pages; i++) {
+		if (bitmap_test(i)) {
+			page_array[i].flags = PG_RESERVED;
+		}
+	}
+
 	stats.total_pages = total_pages;
 	stats.free_pages = free_pages;
 	stats.used_pages = 0;
@@ -314,6 +714,22 @@ pmm_init(struct limine_memmap_response *memmap,
 	stats.alloc_count = 0;
 	stats.free_count = 0;
 	stats.bitmap_size = bitmap_size;
+	stats.split_count = 0;
+	stats.merge_count = 0;
+
+	/* min is 1/256 of usable memory, within fixed bounds */
+	wmark_min = usable_pages / 256;
+	if (wmark_min < PMM_WMARK_MIN_PAGES) {
+		wmark_min = PMM_WMARK_MIN_PAGES;
+	}
+	if (wmark_min > PMM_WMARK_MAX_PAGES) {
+		wmark_min = PMM_WMARK_MAX_PAGES;
+	}
+	wmark_low = wmark_min + wmark_min / 4;
+	wmark_high = wmark_min + wmark_min / 2;
+	stats.wmark_min = wmark_min;
+	stats.wmark_low = wmark_low;
+	stats.wmark_high = wmark_high;
 
 	uint64_t free_mb = bytes_to_mb(free_pages * PAGE_SIZE);
 	uint64_t free_mb_frac = bytes_to_mb_frac(free_pages * PAGE_SIZE);
@@ -336,18 +752,66 @@ pmm_init(struct limine_memmap_response *memmap,
 	    reserved_mb_frac);
 }
 
-void *
-pmm_alloc(void)
+/* Run the shrinkers until free memory is back at the high watermark */
+static size_t
+pmm_reclaim(void)
 {
-	uint64_t page_index = find_free_page_fast();
+	if (free_pages >= wmark_high) {
+		return 0;
+	}
 
-	if (page_index == (uint64_t)-1) {
-		serial_printf(DEBUG_PORT, "[PMM] ERROR: Out of memory\n");
-		return NULL;
+	size_t freed = shrink_memory(wmark_high - free_pages);
+
+	stats.reclaim_runs++;
+	stats.reclaimed_pages += freed;
+	return freed;
+}
+
+static void
+pmm_balance(void)
+{
+	if (free_pages >= wmark_low) {
+		return;
 	}
 
-	bitmap_set(page_index);
+	if (free_pages >= wmark_min && reclaim_backoff > 0) {
+		reclaim_backoff--;
+		return;
+	}
+
+	if (pmm_reclaim() == 0) {
+		reclaim_backoff = PMM_RECLAIM_BACKOFF;
+	}
+}
+
+/* Single frame from this CPU's cache, without the failure message */
+static void *
+alloc_page(void)
+{
+	uint64_t flags = intr_disable();
+	struct pmm_pcp *pcp = &pmm_pcp[pmm_cpu_id()];
+
+	if (pcp->count > 0) {
+		stats.cache_hits++;
+	} else {
+		stats.cache_misses++;
+		pcp_refill(pcp);
+
+		if (pcp->count == 0 && zero_pool_count > 0) {
+			pcp->pfns[pcp->count++] = zero_pool[--zero_pool_count];
+			cached_pages++;
+		}
+
+		if (pcp->count == 0) {
+			intr_restore(flags);
+			return NULL;
+		}
+	}
+
+	uint64_t page_index = pcp->pfns[--pcp->count];
+	cached_pages--;
 	free_pages--;
+	page_reset(page_index, 1);
 
 	stats.free_pages = free_pages;
 	stats.used_pages = usable_pages - free_pages;
@@ -357,10 +821,39 @@ pmm_alloc(void)
 		stats.peak_used_pages = stats.used_pages;
 	}
 
+	intr_restore(flags);
+
 	uint64_t phys_addr = page_index * PAGE_SIZE;
 	return (void *)(phys_addr + hhdm_offset);
 }
 
+/* Entry points wrap this so the profiler sees their caller */
+static void *
+page_alloc(void)
+{
+	pmm_balance();
+
+	void *page = alloc_page();
+	if (page == NULL && pmm_reclaim() > 0) {
+		page = alloc_page();
+	}
+
+	if (page == NULL) {
+		serial_printf(DEBUG_PORT, "[PMM] ERROR: Out of memory\n");
+	}
+
+	return page;
+}
+
+void *
+pmm_alloc(void)
+{
+	void *page = page_alloc();
+
+	KMPROF_ALLOC(KMPROF_PAGES, page, PAGE_SIZE);
+	return page;
+}
+
 void
 pmm_free(void *page)
 {
@@ -382,7 +875,9 @@ pmm_free(void *page)
 		return;
 	}
 
-	if (!bitmap_test(page_index)) {
+	/* Cached and pre-zeroed frames are free but still set in the bitmap */
+	if (!bitmap_test(page_index) ||
+	    (page_array[page_index].flags & (PG_CACHED | PG_ZEROED))) {
 		serial_printf(DEBUG_PORT,
 		              "[PMM] WARNING: Double-free detected at physical "
 		              "0x%llx (page %llu)\n",
@@ -391,42 +886,212 @@ pmm_free(void *page)
 		return;
 	}
 
-	bitmap_clear(page_index);
+	/* A shared frame only loses this reference */
+	if (page_array[page_index].refcount > 1) {
+		atomic_dec_int(&page_array[page_index].refcount);
+		return;
+	}
+
+	/* DMA may still target a pinned frame, it stays until unpinned */
+	if (page_array[page_index].flags & PG_PINNED) {
+		serial_printf(DEBUG_PORT,
+		              "[PMM] WARNING: Refusing to free pinned page at "
+		              "0x%llx (page %llu)\n",
+		              phys_addr,
+		              page_index);
+		return;
+	}
+
+	KMPROF_FREE(KMPROF_PAGES, page);
+
+	uint64_t flags = intr_disable();
+	struct pmm_pcp *pcp = &pmm_pcp[pmm_cpu_id()];
+
+	page_reset(page_index, 0);
+	page_array[page_index].flags = PG_CACHED;
+	pcp->pfns[pcp->count++] = page_index;
+	cached_pages++;
+	if (pcp->count >= PMM_PCP_HIGH) {
+		pcp_drain(pcp, PMM_PCP_BATCH);
+	}
+
 	free_pages++;
 
 	stats.free_pages = free_pages;
 	stats.used_pages = usable_pages - free_pages;
 	stats.free_count++;
 
-	if (page_index < last_alloc_hint) {
-		last_alloc_hint = page_index;
+	intr_restore(flags);
+}
+
+static void *
+alloc_zeroed(void)
+{
+	pmm_balance();
+
+	uint64_t flags = intr_disable();
+
+	if (zero_pool_count == 0) {
+		stats.zero_pool_misses++;
+		intr_restore(flags);
+
+		void *page = page_alloc();
+		if (page != NULL) {
+			memset(page, 0, PAGE_SIZE);
+		}
+		return page;
+	}
+
+	uint64_t page_index = zero_pool[--zero_pool_count];
+	free_pages--;
+	page_reset(page_index, 1);
+
+	stats.zero_pool_hits++;
+	stats.free_pages = free_pages;
+	stats.used_pages = usable_pages - free_pages;
+	stats.alloc_count++;
+
+	if (stats.used_pages > stats.peak_used_pages) {
+		stats.peak_used_pages = stats.used_pages;
 	}
+
+	intr_restore(flags);
+
+	uint64_t phys_addr = page_index * PAGE_SIZE;
+	return (void *)(phys_addr + hhdm_offset);
 }
 
 void *
-pmm_alloc_contiguous(size_t num_pages)
+pmm_alloc_zeroed(void)
 {
-	if (num_pages == 0) {
-		return NULL;
+	void *page = alloc_zeroed();
+
+	KMPROF_ALLOC(KMPROF_PAGES, page, PAGE_SIZE);
+	return page;
+}
+
+/*
+ * Zero up to max_pages frames into the pool.  Meant for the idle task,
+ * so it stops early once the pool is full or free memory runs low, and
+ * only keeps interrupts off for one page at a time.  Returns the number
+ * of pages added.
+ */
+size_t
+pmm_refill_zero_pool(size_t max_pages)
+{
+	size_t added = 0;
+
+	while (added < max_pages) {
+		uint64_t flags = intr_disable();
+
+		uint64_t global_free =
+		    free_pages - cached_pages - zero_pool_count;
+		if (zero_pool_count >= PMM_ZERO_POOL_MAX ||
+		    global_free < PMM_ZERO_POOL_MAX) {
+			intr_restore(flags);
+			break;
+		}
+
+		uint64_t page_index = global_alloc_page();
+		if (page_index == (uint64_t)-1) {
+			intr_restore(flags);
+			break;
+		}
+
+		memset((void *)(page_index * PAGE_SIZE + hhdm_offset),
+		       0,
+		       PAGE_SIZE);
+		page_array[page_index].flags = PG_ZEROED;
+		zero_pool[zero_pool_count++] = page_index;
+		added++;
+
+		intr_restore(flags);
 	}
 
-	if (num_pages == 1) {
-		return pmm_alloc();
+	return added;
+}
+
+static void
+zero_pool_drain(void)
+{
+	uint64_t flags = intr_disable();
+
+	while (zero_pool_count > 0) {
+		uint64_t page_index = zero_pool[--zero_pool_count];
+
+		page_reset(page_index, 0);
+		global_free_page(page_index);
+	}
+
+	intr_restore(flags);
+}
+
+void
+pmm_drain_cpu_caches(void)
+{
+	uint64_t flags = intr_disable();
+
+	for (int cpu = 0; cpu < PMM_MAXCPU; cpu++) {
+		pcp_drain(&pmm_pcp[cpu], pmm_pcp[cpu].count);
+	}
+
+	intr_restore(flags);
+}
+
+/*
+ * Take num_pages frames in one run.  Requests that fit a buddy block come
+ * off the buddy lists; when those are too fragmented, callers that do not
+ * need natural alignment still get any free run from the bitmap, as do
+ * requests larger than the biggest block.
+ */
+static void *
+take_contiguous(size_t num_pages, bool aligned)
+{
+	unsigned int order = order_for_pages(num_pages);
+	uint64_t start_page = (uint64_t)-1;
+	bool from_buddy = false;
+	uint64_t flags = intr_disable();
+
+	if (order < PMM_MAX_ORDER) {
+		start_page = buddy_take(order);
+		if (start_page == (uint64_t)-1 &&
+		    cached_pages + zero_pool_count > 0) {
+			/* Cached frames may be what keeps buddies apart */
+			pmm_drain_cpu_caches();
+			zero_pool_drain();
+			start_page = buddy_take(order);
+		}
+		from_buddy = start_page != (uint64_t)-1;
 	}
 
-	uint64_t start_page = find_free_contiguous(num_pages);
+	if (start_page == (uint64_t)-1 && !aligned) {
+		pmm_drain_cpu_caches();
+		zero_pool_drain();
+		start_page = find_free_contiguous(num_pages);
+	}
 
 	if (start_page == (uint64_t)-1) {
-		serial_printf(
-		    DEBUG_PORT,
-		    "[PMM] ERROR: Could not find %zu contiguous pages\n",
-		    num_pages);
+		intr_restore(flags);
 		return NULL;
 	}
 
+	if (from_buddy) {
+		/* Give back the unused tail of the power-of-two block */
+		uint64_t block_pages = 1ULL << order;
+		if (block_pages > num_pages) {
+			buddy_free_range(start_page + num_pages,
+			                 block_pages - num_pages);
+		}
+	} else {
+		for (size_t i = 0; i < num_pages; i++) {
+			buddy_carve(start_page + i);
+		}
+	}
+
+	bitmap_set_range(start_page, num_pages);
+	free_pages -= num_pages;
 	for (size_t i = 0; i < num_pages; i++) {
-		bitmap_set(start_page + i);
-		free_pages--;
+		page_reset(start_page + i, 1);
 	}
 
 	stats.free_pages = free_pages;
@@ -437,10 +1102,71 @@ pmm_alloc_contiguous(size_t num_pages)
 		stats.peak_used_pages = stats.used_pages;
 	}
 
+	intr_restore(flags);
+
 	uint64_t phys_addr = start_page * PAGE_SIZE;
 	return (void *)(phys_addr + hhdm_offset);
 }
 
+/* Contiguous allocation without the failure message */
+static void *
+alloc_contiguous(size_t num_pages, bool aligned)
+{
+	pmm_balance();
+
+	void *base = take_contiguous(num_pages, aligned);
+	if (base == NULL && pmm_reclaim() > 0) {
+		base = take_contiguous(num_pages, aligned);
+	}
+
+	return base;
+}
+
+void *
+pmm_alloc_contiguous(size_t num_pages)
+{
+	void *base;
+
+	if (num_pages == 0) {
+		return NULL;
+	}
+
+	if (num_pages == 1) {
+		base = page_alloc();
+	} else {
+		base = alloc_contiguous(num_pages, false);
+		if (base == NULL) {
+			serial_printf(
+			    DEBUG_PORT,
+			    "[PMM] ERROR: Could not find %zu contiguous pages\n",
+			    num_pages);
+		}
+	}
+
+	KMPROF_ALLOC(KMPROF_PAGES, base, num_pages * PAGE_SIZE);
+	return base;
+}
+
+/* As pmm_alloc_contiguous(), for callers with a fallback of their own */
+void *
+pmm_try_alloc_contiguous(size_t num_pages)
+{
+	void *base;
+
+	if (num_pages == 0) {
+		return NULL;
+	}
+
+	if (num_pages == 1) {
+		base = page_alloc();
+	} else {
+		base = alloc_contiguous(num_pages, false);
+	}
+
+	KMPROF_ALLOC(KMPROF_PAGES, base, num_pages * PAGE_SIZE);
+	return base;
+}
+
 void
 pmm_free_contiguous(void *base, size_t num_pages)
 {
@@ -448,9 +1174,15 @@ pmm_free_contiguous(void *base, size_t num_pages)
 		return;
 	}
 
+	KMPROF_FREE(KMPROF_PAGES, base);
+
 	uint64_t virt_addr = (uint64_t)base;
 	uint64_t phys_addr = virt_addr - hhdm_offset;
 	uint64_t start_page = phys_addr / PAGE_SIZE;
+	uint64_t run_start = 0;
+	uint64_t run_length = 0;
+	uint64_t freed = 0;
+	uint64_t flags = intr_disable();
 
 	for (size_t i = 0; i < num_pages; i++) {
 		uint64_t page_index = start_page + i;
@@ -461,25 +1193,164 @@ pmm_free_contiguous(void *base, size_t num_pages)
 			    "[PMM] WARNING: Page %llu out of range in "
 			    "contiguous free\n",
 			    page_index);
-			continue;
+			break;
 		}
 
-		if (!bitmap_test(page_index)) {
+		if (!bitmap_test(page_index) ||
+		    (page_array[page_index].flags & (PG_CACHED | PG_ZEROED))) {
 			serial_printf(
 			    DEBUG_PORT,
 			    "[PMM] WARNING: Page %llu already free in "
 			    "contiguous free\n",
 			    page_index);
+			if (run_length > 0) {
+				buddy_free_range(run_start, run_length);
+				run_length = 0;
+			}
+			continue;
+		}
+
+		if (page_array[page_index].flags & PG_PINNED) {
+			serial_printf(
+			    DEBUG_PORT,
+			    "[PMM] WARNING: Page %llu pinned in contiguous free\n",
+			    page_index);
+			if (run_length > 0) {
+				buddy_free_range(run_start, run_length);
+				run_length = 0;
+			}
 			continue;
 		}
 
+		if (run_length == 0) {
+			run_start = page_index;
+		}
+		run_length++;
+
+		page_reset(page_index, 0);
 		bitmap_clear(page_index);
 		free_pages++;
+		freed++;
+	}
+
+	if (run_length > 0) {
+		buddy_free_range(run_start, run_length);
 	}
 
 	stats.free_pages = free_pages;
 	stats.used_pages = usable_pages - free_pages;
-	stats.free_count += num_pages;
+	stats.free_count += freed;
+
+	intr_restore(flags);
+}
+
+/*
+ * Allocate a naturally aligned block of 2^order pages.  Failure is quiet
+ * since callers such as huge page mappings fall back to smaller pages.
+ */
+void *
+pmm_alloc_order(unsigned int order)
+{
+	if (order >= PMM_MAX_ORDER) {
+		return NULL;
+	}
+
+	void *base = order == 0 ? page_alloc()
+	                        : alloc_contiguous((size_t)1 << order, true);
+
+	KMPROF_ALLOC(KMPROF_PAGES, base, PAGE_SIZE << order);
+	return base;
+}
+
+void
+pmm_free_order(void *base, unsigned int order)
+{
+	if (order >= PMM_MAX_ORDER) {
+		return;
+	}
+
+	if (order == 0) {
+		pmm_free(base);
+		return;
+	}
+
+	pmm_free_contiguous(base, (size_t)1 << order);
+}
+
+struct page *
+pfn_to_page(uint64_t pfn)
+{
+	if (page_array == NULL || pfn >= total_pages) {
+		return NULL;
+	}
+
+	return &page_array[pfn];
+}
+
+struct page *
+phys_to_page(uint64_t phys)
+{
+	return pfn_to_page(phys / PAGE_SIZE);
+}
+
+struct page *
+virt_to_page(const void *virt)
+{
+	return phys_to_page((uint64_t)virt - hhdm_offset);
+}
+
+uint64_t
+page_to_pfn(const struct page *page)
+{
+	return (uint64_t)(page - page_array);
+}
+
+uint64_t
+page_to_phys(const struct page *page)
+{
+	return page_to_pfn(page) * PAGE_SIZE;
+}
+
+void *
+page_to_virt(const struct page *page)
+{
+	return (void *)(page_to_phys(page) + hhdm_offset);
+}
+
+void
+page_get(struct page *page)
+{
+	if (page == NULL || (page->flags & PG_RESERVED)) {
+		return;
+	}
+
+	atomic_inc_int(&page->refcount);
+}
+
+void
+page_put(struct page *page)
+{
+	if (page == NULL || (page->flags & PG_RESERVED)) {
+		return;
+	}
+
+	if (page->refcount == 0) {
+		serial_printf(DEBUG_PORT,
+		              "[PMM] WARNING: page_put on free page %llu\n",
+		              page_to_pfn(page));
+		return;
+	}
+
+	if (atomic_dec_int_nv(&page->refcount) == 0) {
+		/* pmm_free() sees refcount 0 and releases the frame */
+		pmm_free(page_to_virt(page));
+	}
+}
+
+unsigned int
+page_refcount(const struct page *page)
+{
+	return page != NULL ? page->refcount : 0;
 }
 
 void
@@ -512,7 +1383,9 @@ pmm_reclaim_bootloader_memory(void)
 					uint64_t page = base_page + j;
 					if (page < total_pages &&
 					    bitmap_test(page)) {
+						page_reset(page, 0);
 						bitmap_clear(page);
+						buddy_insert(page, 0);
 						free_pages++;
 						usable_pages++;
 						reclaimed_pages++;
@@ -572,6 +1445,15 @@ pmm_get_stats(pmm_stats_t *out_stats)
 	if (out_stats != NULL) {
 		stats.free_pages = free_pages;
 		stats.used_pages = usable_pages - free_pages;
+		stats.cached_pages = cached_pages;
+		stats.zeroed_pages = zero_pool_count;
+		stats.largest_free_order = 0;
+		for (unsigned int order = 0; order < PMM_MAX_ORDER; order++) {
+			stats.free_blocks[order] = free_area_count[order];
+			if (free_area_count[order] > 0) {
+				stats.largest_free_order = order;
+			}
+		}
 		*out_stats = stats;
 	}
 }
@@ -649,6 +1531,35 @@ pmm_print_stats(void)
 	              stats.bitmap_size,
 	              bitmap_kb,
 	              bitmap_frac);
+	serial_printf(DEBUG_PORT, "\n");
+	serial_printf(DEBUG_PORT, "Buddy Free Blocks:    ");
+	for (unsigned int order = 0; order < PMM_MAX_ORDER; order++) {
+		serial_printf(DEBUG_PORT, " %llu", free_area_count[order]);
+	}
+	serial_printf(DEBUG_PORT, "\n");
+	serial_printf(DEBUG_PORT,
+	              "Buddy Splits/Merges:   %llu / %llu\n",
+	              stats.split_count,
+	              stats.merge_count);
+	serial_printf(DEBUG_PORT,
+	              "CPU Cache Hits/Misses: %llu / %llu (%llu cached)\n",
+	              stats.cache_hits,
+	              stats.cache_misses,
+	              cached_pages);
+	serial_printf(DEBUG_PORT,
+	              "Zero Pool Hits/Misses: %llu / %llu (%llu pooled)\n",
+	              stats.zero_pool_hits,
+	              stats.zero_pool_misses,
+	              zero_pool_count);
+	serial_printf(DEBUG_PORT,
+	              "Watermarks min/low/high: %llu / %llu / %llu pages\n",
+	              wmark_min,
+	              wmark_low,
+	              wmark_high);
+	serial_printf(DEBUG_PORT,
+	              "Reclaim Runs/Pages:    %llu / %llu\n",
+	              stats.reclaim_runs,
+	              stats.reclaimed_pages);
 	serial_printf(DEBUG_PORT,
 	              "==========================================\n\n");
 }
@@ -706,10 +1617,19 @@ pmm_validate(void)
 	for (uint64_t i = 0; i < total_pages; i++) {
 		if (!bitmap_test(i)) {
 			counted_free++;
+
+			if (page_array[i].refcount != 0) {
+				serial_printf(DEBUG_PORT,
+				              "[PMM] VALIDATION FAILED: free "
+				              "page %llu has refcount %u\n",
+				              i,
+				              page_array[i].refcount);
+				return false;
+			}
 		}
 	}
 
-	if (counted_free != free_pages) {
+	if (counted_free + cached_pages + zero_pool_count != free_pages) {
 		serial_printf(DEBUG_PORT,
 		              "[PMM] VALIDATION FAILED: free_pages=%llu but "
 		              "counted %llu\n",
@@ -718,6 +1638,121 @@ pmm_validate(void)
 		return false;
 	}
 
+	uint64_t buddy_free = 0;
+	for (unsigned int order = 0; order < PMM_MAX_ORDER; order++) {
+		uint64_t blocks = 0;
+
+		for (struct pmm_free_block *block = free_area[order];
+		     block != NULL;
+		     block = block->next) {
+			uint64_t pfn = block_to_pfn(block);
+
+			if (page_order[pfn] != order ||
+			    (pfn & ((1ULL << order) - 1)) != 0) {
+				serial_printf(DEBUG_PORT,
+				              "[PMM] VALIDATION FAILED: bad "
+				              "order %u block at page %llu\n",
+				              order,
+				              pfn);
+				return false;
+			}
+
+			for (uint64_t i = 0; i < (1ULL << order); i++) {
+				if (bitmap_test(pfn + i)) {
+					serial_printf(
+					    DEBUG_PORT,
+					    "[PMM] VALIDATION FAILED: page "
+					    "%llu on free list but allocated\n",
+					    pfn + i);
+					return false;
+				}
+			}
+
+			buddy_free += 1ULL << order;
+			blocks++;
+		}
+
+		if (blocks != free_area_count[order]) {
+			serial_printf(DEBUG_PORT,
+			              "[PMM] VALIDATION FAILED: order %u count "
+			              "%llu but listed %llu\n",
+			              order,
+			              free_area_count[order],
+			              blocks);
+			return false;
+		}
+	}
+
+	if (buddy_free + cached_pages + zero_pool_count != free_pages) {
+		serial_printf(DEBUG_PORT,
+		              "[PMM] VALIDATION FAILED: buddy lists hold %llu "
+		              "pages, free_pages=%llu\n",
+		              buddy_free,
+		              free_pages);
+		return false;
+	}
+
+	uint64_t magazine_pages = 0;
+	for (int cpu = 0; cpu < PMM_MAXCPU; cpu++) {
+		for (uint64_t i = 0; i < pmm_pcp[cpu].count; i++) {
+			if (!bitmap_test(pmm_pcp[cpu].pfns[i])) {
+				serial_printf(DEBUG_PORT,
+				              "[PMM] VALIDATION FAILED: cached "
+				              "page %llu marked free\n",
+				              pmm_pcp[cpu].pfns[i]);
+				return false;
+			}
+		}
+		magazine_pages += pmm_pcp[cpu].count;
+	}
+
+	if (magazine_pages != cached_pages) {
+		serial_printf(DEBUG_PORT,
+		              "[PMM] VALIDATION FAILED: cached_pages=%llu but "
+		              "magazines hold %llu\n",
+		              cached_pages,
+		              magazine_pages);
+		return false;
+	}
+
+	uint64_t *qwords = bitmap_as_qwords();
+	for (uint64_t i = 0; i < bitmap_qwords; i++) {
+		bool has_free = qwords[i] != 0xFFFFFFFFFFFFFFFFULL;
+		bool l0 = (summary_l0[i / 64] >> (i % 64)) & 1;
+
+		if (has_free != l0) {
+			serial_printf(DEBUG_PORT,
+			              "[PMM] VALIDATION FAILED: L0 summary "
+			              "wrong for qword %llu\n",
+			              i);
+			return false;
+		}
+	}
+
+	for (uint64_t i = 0; i < summary_l0_words; i++) {
+		bool l1 = (summary_l1[i / 64] >> (i % 64)) & 1;
+
+		if ((summary_l0[i] != 0) != l1) {
+			serial_printf(DEBUG_PORT,
+			              "[PMM] VALIDATION FAILED: L1 summary "
+			              "wrong for group %llu\n",
+			              i);
+			return false;
+		}
+	}
+
+	for (uint64_t i = 0; i < summary_l1_words; i++) {
+		bool l2 = (summary_l2[i / 64] >> (i % 64)) & 1;
+
+		if ((summary_l1[i] != 0) != l2) {
+			serial_printf(DEBUG_PORT,
+			              "[PMM] VALIDATION FAILED: L2 summary "
+			              "wrong for group %llu\n",
+			              i);
+			return false;
+		}
+	}
+
 	serial_printf(DEBUG_PORT, "[PMM] Validation passed\n");
 	return true;
 }
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include <shrinker.h>
+#include <kmalloc.h>
+#include <pmm.h>
+#include <sys/spinlock.h>
+#include <stdbool.h>
+
+static struct shrinker *shrinkers = NULL;
+static spinlock_t shrinker_lock = SPINLOCK_INITIALIZER("shrinker");
+static bool shrinking = false;
+
+void
+shrinker_register(struct shrinker *shrinker)
+{
+	if (shrinker == NULL || shrinker->count == NULL ||
+	    shrinker->scan == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&shrinker_lock);
+	shrinker->next = shrinkers;
+	shrinkers = shrinker;
+	spinlock_release(&shrinker_lock);
+}
+
+void
+shrinker_unregister(struct shrinker *shrinker)
+{
+	/* shrink_memory() walks the list unlocked, wait for it to finish */
+	for (;;) {
+		spinlock_acquire(&shrinker_lock);
+		if (!shrinking) {
+			break;
+		}
+		spinlock_release(&shrinker_lock);
+	}
+
+	struct shrinker **link = &shrinkers;
+	while (*link != NULL && *link != shrinker) {
+		link = &(*link)->next;
+	}
+	if (*link != NULL) {
+		*link = shrinker->next;
+		shrinker->next = NULL;
+	}
+
+	spinlock_release(&shrinker_lock);
+}
+
+static uint64_t
+free_page_count(void)
+{
+	return pmm_get_free_memory() / PAGE_SIZE;
+}
+
+/*
+ * Scan a growing share of every shrinker's objects until nr_pages more
+ * pages are free, reaping empty slabs after each pass so what the
+ * shrinkers dropped actually reaches the PMM.  Returns the pages gained.
+ */
+size_t
+shrink_memory(size_t nr_pages)
+{
+	/*
+	 * The lock only guards claiming the walk, so the scans and the reap
+	 * run with interrupts on.  A shrinker that ends up in the PMM finds
+	 * shrinking set and must not recurse.
+	 */
+	if (!spinlock_try_acquire(&shrinker_lock)) {
+		return 0;
+	}
+	if (shrinking) {
+		spinlock_release(&shrinker_lock);
+		return 0;
+	}
+	shrinking = true;
+	spinlock_release(&shrinker_lock);
+
+	uint64_t start = free_page_count();
+
+	for (int priority = SHRINK_PRIORITY_MAX; priority >= 0; priority--) {
+		for (struct shrinker *s = shrinkers; s != NULL; s = s->next) {
+			size_t nr = s->count(s) >> priority;
+
+			if (nr > 0) {
+				s->scan(s, nr);
+			}
+		}
+
+		kmem_cache_reap();
+
+		if (free_page_count() >= start + nr_pages) {
+			break;
+		}
+	}
+
+	spinlock_acquire(&shrinker_lock);
+	shrinking = false;
+	spinlock_release(&shrinker_lock);
+
+	uint64_t end = free_page_count();
+	return end > start ? end - start : 0;
+}
@@ -0,0 +1,187 @@
+#include <vmalloc.h>
+#include <avl.h>
+#include <vmm.h>
+#include <paging.h>
+#include <kmalloc.h>
+#include <sys/spinlock.h>
+
+extern void serial_printf(uint16_t port, const char *fmt, ...);
+#define DEBUG_PORT 0x3F8
+
+/*
+ * Busy extents of the vmalloc window, keyed by start address.  Free space
+ * is the gaps between them, found first-fit by an in-order walk.
+ */
+typedef struct vmap_area {
+	struct avl_node node;
+	uint64_t start; /* First mapped byte */
+	size_t pages;   /* Mapped pages, not counting the guard page */
+} vmap_area_t;
+
+static int vmap_area_cmp(const struct avl_node *a, const struct avl_node *b);
+
+static struct avl_tree vmap_areas = AVL_TREE_INITIALIZER(vmap_area_cmp);
+static spinlock_t vmap_lock = SPINLOCK_INITIALIZER("vmalloc");
+static kmem_cache_t *vmap_area_cache = NULL;
+static uint64_t vmalloc_pages = 0;
+
+static int
+vmap_area_cmp(const struct avl_node *a, const struct avl_node *b)
+{
+	uint64_t x = avl_entry(a, vmap_area_t, node)->start;
+	uint64_t y = avl_entry(b, vmap_area_t, node)->start;
+
+	return x < y ? -1 : x > y;
+}
+
+bool
+is_vmalloc_addr(const void *ptr)
+{
+	uint64_t addr = (uint64_t)ptr;
+
+	return addr >= VMM_VMALLOC_START && addr < VMM_VMALLOC_END;
+}
+
+/* Reserve pages plus a guard page of address space, vmap_lock held */
+static bool
+vmap_reserve(vmap_area_t *area, size_t pages)
+{
+	uint64_t span = (pages + 1) * PAGE_SIZE;
+	uint64_t addr = VMM_VMALLOC_START;
+
+	for (struct avl_node *n = avl_first(&vmap_areas); n != NULL;
+	     n = avl_next(n)) {
+		vmap_area_t *busy = avl_entry(n, vmap_area_t, node);
+
+		if (busy->start - addr >= span) {
+			break;
+		}
+		addr = busy->start + (busy->pages + 1) * PAGE_SIZE;
+	}
+
+	if (addr + span > VMM_VMALLOC_END || addr + span < addr) {
+		return false;
+	}
+
+	area->start = addr;
+	area->pages = pages;
+	avl_insert(&vmap_areas, &area->node);
+	vmalloc_pages += pages;
+
+	return true;
+}
+
+static vmap_area_t *
+vmap_find(uint64_t addr)
+{
+	vmap_area_t key = { .start = addr };
+	struct avl_node *n = avl_find(&vmap_areas, &key.node);
+
+	return n != NULL ? avl_entry(n, vmap_area_t, node) : NULL;
+}
+
+void *
+vmalloc(size_t size)
+{
+	if (size == 0) {
+		return NULL;
+	}
+
+	if (vmap_area_cache == NULL) {
+		vmap_area_cache = kmem_cache_create(
+		    "vmap_area", sizeof(vmap_area_t), 0, NULL, NULL);
+		if (vmap_area_cache == NULL) {
+			return NULL;
+		}
+	}
+
+	size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	vmap_area_t *area = kmem_cache_alloc(vmap_area_cache, 0);
+	if (area == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&vmap_lock);
+	bool reserved = vmap_reserve(area, pages);
+	spinlock_release(&vmap_lock);
+
+	if (!reserved) {
+		serial_printf(DEBUG_PORT,
+		              "[vmalloc] No room for %zu pages\n",
+		              pages);
+		kmem_cache_free(vmap_area_cache, area);
+		return NULL;
+	}
+
+	/* The window shares its page tables with every address space */
+	if (!paging_alloc_range(paging_get_kernel_directory(),
+	                        area->start,
+	                        pages,
+	                        PAGE_PRESENT | PAGE_WRITE)) {
+		spinlock_acquire(&vmap_lock);
+		avl_remove(&vmap_areas, &area->node);
+		vmalloc_pages -= pages;
+		spinlock_release(&vmap_lock);
+
+		kmem_cache_free(vmap_area_cache, area);
+		return NULL;
+	}
+
+	return (void *)area->start;
+}
+
+void
+vfree(void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&vmap_lock);
+	vmap_area_t *area = vmap_find((uint64_t)ptr);
+	if (area != NULL) {
+		avl_remove(&vmap_areas, &area->node);
+		vmalloc_pages -= area->pages;
+	}
+	spinlock_release(&vmap_lock);
+
+	if (area == NULL) {
+		serial_printf(
+		    DEBUG_PORT, "[vmalloc] vfree of unknown area %p\n", ptr);
+		return;
+	}
+
+	paging_unmap_free_range(
+	    paging_get_kernel_directory(), area->start, area->pages);
+	kmem_cache_free(vmap_area_cache, area);
+}
+
+size_t
+vmalloc_size(const void *ptr)
+{
+	size_t size = 0;
+
+	spinlock_acquire(&vmap_lock);
+	vmap_area_t *area = vmap_find((uint64_t)ptr);
+	if (area != NULL) {
+		size = area->pages * PAGE_SIZE;
+	}
+	spinlock_release(&vmap_lock);
+
+	return size;
+}
+
+void
+vmalloc_stats(void)
+{
+	spinlock_acquire(&vmap_lock);
+	size_t areas = vmap_areas.count;
+	uint64_t pages = vmalloc_pages;
+	spinlock_release(&vmap_lock);
+
+	serial_printf(DEBUG_PORT,
+	              "[vmalloc] %zu areas, %llu pages mapped, window %llu KiB\n",
+	              areas,
+	              pages,
+	              (VMM_VMALLOC_END - VMM_VMALLOC_START) / 1024);
+}
@@ -2,6 +2,8 @@
 #include <paging.h>
 #include <pmm.h>
 #include <mmu.h>
+#include <mempool.h>
+#include <kmalloc.h>
 #include <string.h>
 
 extern void tty_printf(const char *fmt, ...);
@@ -13,13 +15,82 @@ static vmm_address_space_t *kernel_space = NULL;
 static vmm_address_space_t *current_space = NULL;
 static vmm_stats_t stats = { 0 };
 
+/* Pages held back so copy-on-write faults resolve even when out of memory */
+#define VMM_FAULT_RESERVE 16
+static mempool_t *fault_pool = NULL;
+
+/* Backs every untouched anonymous page that has only been read so far */
+static void *zero_page = NULL;
+static uint64_t zero_page_phys = 0;
+
+static kmem_cache_t *region_cache = NULL;
+
+static int
+vmm_region_cmp(const struct avl_node *a, const struct avl_node *b)
+{
+	uint64_t x = avl_entry(a, vmm_region_t, node)->virt_start;
+	uint64_t y = avl_entry(b, vmm_region_t, node)->virt_start;
+
+	return x < y ? -1 : x > y;
+}
+
+static inline vmm_region_t *
+region_of(const struct avl_node *node)
+{
+	return node != NULL ? avl_entry(node, vmm_region_t, node) : NULL;
+}
+
+static inline uint64_t
+max_u64(uint64_t a, uint64_t b)
+{
+	return a > b ? a : b;
+}
+
+/* Recompute the subtree summary of a node from its children */
+static void
+vmm_region_augment(struct avl_node *node)
+{
+	vmm_region_t *region = region_of(node);
+	vmm_region_t *left = region_of(node->left);
+	vmm_region_t *right = region_of(node->right);
+	uint64_t gap = 0;
+
+	region->subtree_start = region->virt_start;
+	region->subtree_end = region->virt_end;
+
+	if (left != NULL) {
+		region->subtree_start = left->subtree_start;
+		gap = max_u64(left->subtree_gap,
+		              region->virt_start - left->subtree_end);
+	}
+
+	if (right != NULL) {
+		region->subtree_end = right->subtree_end;
+		gap = max_u64(gap, right->subtree_gap);
+		gap = max_u64(gap, right->subtree_start - region->virt_end);
+	}
+
+	region->subtree_gap = gap;
+}
+
+static void
+vmm_init_regions(vmm_address_space_t *space)
+{
+	avl_init_augmented(&space->regions, vmm_region_cmp, vmm_region_augment);
+	space->last_hit = NULL;
+}
+
 static vmm_region_t *
 vmm_create_region(uint64_t virt_start,
                   uint64_t virt_end,
                   vmm_region_type_t type,
                   uint64_t flags)
 {
-	vmm_region_t *region = (vmm_region_t *)pmm_alloc();
+	if (region_cache == NULL) {
+		return NULL;
+	}
+
+	vmm_region_t *region = kmem_cache_alloc(region_cache, 0);
 	if (region == NULL) {
 		return NULL;
 	}
@@ -29,7 +100,20 @@ vmm_create_region(uint64_t virt_start,
 	region->type = type;
 	region->flags = flags;
 	region->cow = false;
-	region->next = NULL;
+	region->anon = false;
+
+	return region;
+}
+
+static vmm_region_t *
+vmm_dup_region(const vmm_region_t *src)
+{
+	vmm_region_t *region = vmm_create_region(
+	    src->virt_start, src->virt_end, src->type, src->flags);
+	if (region != NULL) {
+		region->cow = src->cow;
+		region->anon = src->anon;
+	}
 
 	return region;
 }
@@ -38,27 +122,76 @@ static void
 vmm_free_region(vmm_region_t *region)
 {
 	if (region != NULL) {
-		pmm_free(region);
+		kmem_cache_free(region_cache, region);
 	}
 }
 
+static inline vmm_region_t *
+vmm_first_region(vmm_address_space_t *space)
+{
+	return region_of(avl_first(&space->regions));
+}
+
+static inline vmm_region_t *
+vmm_next_region(vmm_region_t *region)
+{
+	return region_of(avl_next(&region->node));
+}
+
+/* The lowest region ending above addr, NULL if there is none */
 static vmm_region_t *
+vmm_region_above(vmm_address_space_t *space, uint64_t addr)
+{
+	struct avl_node *node = space->regions.root;
+	vmm_region_t *best = NULL;
+
+	while (node != NULL) {
+		vmm_region_t *region = region_of(node);
+
+		if (region->virt_end > addr) {
+			best = region;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+
+	return best;
+}
+
+vmm_region_t *
 vmm_find_region(vmm_address_space_t *space, uint64_t virt_addr)
 {
 	if (space == NULL) {
 		return NULL;
 	}
 
-	vmm_region_t *current = space->regions;
-	while (current != NULL) {
-		if (virt_addr >= current->virt_start &&
-		    virt_addr < current->virt_end) {
-			return current;
-		}
-		current = current->next;
+	vmm_region_t *region = space->last_hit;
+	if (region != NULL && virt_addr >= region->virt_start &&
+	    virt_addr < region->virt_end) {
+		return region;
+	}
+
+	region = vmm_region_above(space, virt_addr);
+	if (region == NULL || virt_addr < region->virt_start) {
+		return NULL;
+	}
+
+	space->last_hit = region;
+	return region;
+}
+
+bool
+vmm_range_is_free(vmm_address_space_t *space,
+                  uint64_t virt_start,
+                  size_t size)
+{
+	if (space == NULL) {
+		return false;
 	}
 
-	return NULL;
+	vmm_region_t *region = vmm_region_above(space, virt_start);
+	return region == NULL || region->virt_start >= virt_start + size;
 }
 
 static bool
@@ -68,44 +201,184 @@ vmm_add_region(vmm_address_space_t *space, vmm_region_t *region)
 		return false;
 	}
 
-	if (space->regions == NULL) {
-		space->regions = region;
-	} else {
-		vmm_region_t *current = space->regions;
-		while (current->next != NULL) {
-			current = current->next;
-		}
-		current->next = region;
+	return avl_insert(&space->regions, &region->node);
+}
+
+static void
+vmm_unlink_region(vmm_address_space_t *space, vmm_region_t *region)
+{
+	if (space->last_hit == region) {
+		space->last_hit = NULL;
 	}
 
-	return true;
+	avl_remove(&space->regions, &region->node);
+	vmm_free_region(region);
+}
+
+/* Region bounds moved without passing a neighbour, refresh the summaries */
+static inline void
+vmm_region_resized(vmm_address_space_t *space, vmm_region_t *region)
+{
+	avl_propagate(&space->regions, &region->node);
+}
+
+/* Cut region in two at addr, which must lie strictly inside it */
+static vmm_region_t *
+vmm_split_region(vmm_address_space_t *space,
+                 vmm_region_t *region,
+                 uint64_t addr)
+{
+	vmm_region_t *tail = vmm_dup_region(region);
+	if (tail == NULL) {
+		return NULL;
+	}
+
+	tail->virt_start = addr;
+	region->virt_end = addr;
+	vmm_region_resized(space, region);
+	vmm_add_region(space, tail);
+
+	return tail;
+}
+
+/* Only demand-zero regions merge; the others are freed by start address */
+static bool
+vmm_regions_mergeable(const vmm_region_t *a, const vmm_region_t *b)
+{
+	return a->virt_end == b->virt_start && a->anon && b->anon &&
+	       a->type == b->type && a->flags == b->flags && a->cow == b->cow;
+}
+
+/* Fold region into its neighbours where they match, returns the survivor */
+static vmm_region_t *
+vmm_merge_region(vmm_address_space_t *space, vmm_region_t *region)
+{
+	vmm_region_t *next = vmm_next_region(region);
+	if (next != NULL && vmm_regions_mergeable(region, next)) {
+		uint64_t end = next->virt_end;
+
+		vmm_unlink_region(space, next);
+		region->virt_end = end;
+		vmm_region_resized(space, region);
+	}
+
+	vmm_region_t *prev = region_of(avl_prev(&region->node));
+	if (prev != NULL && vmm_regions_mergeable(prev, region)) {
+		uint64_t end = region->virt_end;
+
+		vmm_unlink_region(space, region);
+		prev->virt_end = end;
+		vmm_region_resized(space, prev);
+		region = prev;
+	}
+
+	return region;
 }
 
 static bool
 vmm_remove_region(vmm_address_space_t *space, uint64_t virt_start)
 {
-	if (space == NULL || space->regions == NULL) {
+	if (space == NULL) {
 		return false;
 	}
 
-	vmm_region_t *current = space->regions;
-	vmm_region_t *prev = NULL;
+	vmm_region_t *region = vmm_find_region(space, virt_start);
+	if (region == NULL || region->virt_start != virt_start) {
+		return false;
+	}
 
-	while (current != NULL) {
-		if (current->virt_start == virt_start) {
-			if (prev == NULL) {
-				space->regions = current->next;
-			} else {
-				prev->next = current->next;
-			}
-			vmm_free_region(current);
-			return true;
-		}
-		prev = current;
-		current = current->next;
+	vmm_unlink_region(space, region);
+	return true;
+}
+
+/* Lowest start of a size byte hole at or above low within [start, end) */
+static bool
+vmm_hole_fits(uint64_t start,
+              uint64_t end,
+              uint64_t low,
+              uint64_t size,
+              uint64_t *addr)
+{
+	start = max_u64(start, low);
+	if (start >= end || end - start < size) {
+		return false;
 	}
 
-	return false;
+	*addr = start;
+	return true;
+}
+
+/* Lowest fitting hole between the regions of a subtree */
+static bool
+vmm_gap_in(const vmm_region_t *region,
+           uint64_t low,
+           uint64_t size,
+           uint64_t *addr)
+{
+	if (region == NULL || region->subtree_gap < size ||
+	    region->subtree_end < low + size) {
+		return false;
+	}
+
+	vmm_region_t *left = region_of(region->node.left);
+	vmm_region_t *right = region_of(region->node.right);
+
+	if (vmm_gap_in(left, low, size, addr)) {
+		return true;
+	}
+
+	if (left != NULL && vmm_hole_fits(left->subtree_end,
+	                                  region->virt_start,
+	                                  low,
+	                                  size,
+	                                  addr)) {
+		return true;
+	}
+
+	if (right != NULL && vmm_hole_fits(region->virt_end,
+	                                   right->subtree_start,
+	                                   low,
+	                                   size,
+	                                   addr)) {
+		return true;
+	}
+
+	return vmm_gap_in(right, low, size, addr);
+}
+
+/*
+ * First fit for size bytes of free address space in [low, high).  The
+ * subtree summaries skip every part of the tree without a big enough
+ * hole, so this is O(log n) in the number of regions.  Returns 0 when
+ * nothing fits.
+ */
+uint64_t
+vmm_find_gap(vmm_address_space_t *space,
+             size_t size,
+             uint64_t low,
+             uint64_t high)
+{
+	if (space == NULL || size == 0) {
+		return 0;
+	}
+
+	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	low = (low + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	vmm_region_t *root = region_of(space->regions.root);
+	uint64_t addr = low;
+
+	if (root != NULL &&
+	    !vmm_hole_fits(0, root->subtree_start, low, size, &addr) &&
+	    !vmm_gap_in(root, low, size, &addr)) {
+		addr = max_u64(root->subtree_end, low);
+	}
+
+	if (addr + size < addr || addr + size > high) {
+		return 0;
+	}
+
+	return addr;
 }
 
 void
@@ -121,9 +394,9 @@ vmm_init(void)
 	memset(kernel_space, 0, sizeof(vmm_address_space_t));
 
 	kernel_space->page_dir = paging_get_kernel_directory();
-	kernel_space->regions = NULL;
+	vmm_init_regions(kernel_space);
 	kernel_space->heap_start = VMM_KERNEL_HEAP_START;
-	kernel_space->heap_end = VMM_KERNEL_HEAP_START + VMM_KERNEL_HEAP_SIZE;
+	kernel_space->heap_end = VMM_VMALLOC_START;
 	kernel_space->brk = VMM_KERNEL_HEAP_START;
 
 	current_space = kernel_space;
@@ -133,8 +406,23 @@ vmm_init(void)
 	stats.cached_pages = 0;
 	stats.page_faults = 0;
 	stats.tlb_flushes = 0;
+	stats.cow_copies = 0;
+	stats.cow_reuses = 0;
+	stats.demand_faults = 0;
+	stats.zero_page_maps = 0;
+
+	region_cache = kmem_cache_create(
+	    "vmm_region", sizeof(vmm_region_t), 0, NULL, NULL);
+
+	fault_pool = mempool_create_page_pool("vmm_fault", VMM_FAULT_RESERVE);
 
-	// mmu_set_page_fault_handler(vmm_handle_page_fault);
+	/* Never freed: vmm keeps one reference, every mapping takes another */
+	zero_page = pmm_alloc_zeroed();
+	if (zero_page != NULL) {
+		zero_page_phys = mmu_virt_to_phys(zero_page);
+	}
+
+	mmu_set_page_fault_handler(vmm_handle_page_fault);
 }
 
 vmm_address_space_t *
@@ -150,7 +438,7 @@ vmm_create_address_space(bool is_kernel)
 	if (is_kernel) {
 		space->page_dir = paging_create_kernel_address_space();
 		space->heap_start = VMM_KERNEL_HEAP_START;
-		space->heap_end = VMM_KERNEL_HEAP_START + VMM_KERNEL_HEAP_SIZE;
+		space->heap_end = VMM_VMALLOC_START;
 	} else {
 		space->page_dir = paging_create_user_address_space();
 		space->heap_start = VMM_USER_HEAP_START;
@@ -158,13 +446,19 @@ vmm_create_address_space(bool is_kernel)
 	}
 
 	space->brk = space->heap_start;
-	space->regions = NULL;
+	vmm_init_regions(space);
 
 	if (space->page_dir == NULL) {
 		pmm_free(space);
 		return NULL;
 	}
 
+	/* Lets the fault handler get from CR3 back to the regions */
+	struct page *pml4_page = virt_to_page(space->page_dir->pml4);
+	if (pml4_page != NULL) {
+		pml4_page->owner = space;
+	}
+
 	return space;
 }
 
@@ -175,17 +469,14 @@ vmm_destroy_address_space(vmm_address_space_t *space)
 		return;
 	}
 
-	vmm_region_t *current = space->regions;
-	while (current != NULL) {
-		vmm_region_t *next = current->next;
-
+	vmm_region_t *current;
+	while ((current = vmm_first_region(space)) != NULL) {
 		size_t num_pages =
 		    (current->virt_end - current->virt_start) / PAGE_SIZE;
-		paging_unmap_range(
+		paging_unmap_free_range(
 		    space->page_dir, current->virt_start, num_pages);
 
-		vmm_free_region(current);
-		current = next;
+		vmm_unlink_region(space, current);
 	}
 
 	mmu_destroy_address_space(space->page_dir);
@@ -204,13 +495,9 @@ vmm_fork_address_space(vmm_address_space_t *parent)
 		return NULL;
 	}
 
-	vmm_region_t *current = parent->regions;
-	while (current != NULL) {
-		vmm_region_t *new_region =
-		    vmm_create_region(current->virt_start,
-		                      current->virt_end,
-		                      current->type,
-		                      current->flags);
+	for (vmm_region_t *current = vmm_first_region(parent); current != NULL;
+	     current = vmm_next_region(current)) {
+		vmm_region_t *new_region = vmm_dup_region(current);
 		if (new_region == NULL) {
 			vmm_destroy_address_space(child);
 			return NULL;
@@ -221,26 +508,15 @@ vmm_fork_address_space(vmm_address_space_t *parent)
 
 		size_t num_pages =
 		    (current->virt_end - current->virt_start) / PAGE_SIZE;
-		for (size_t i = 0; i < num_pages; i++) {
-			uint64_t virt = current->virt_start + (i * PAGE_SIZE);
-			uint64_t phys =
-			    mmu_get_physical_address(parent->page_dir, virt);
-
-			if (phys != 0) {
-				uint64_t cow_flags =
-				    current->flags & ~PAGE_WRITE;
-
-				mmu_map_page(
-				    child->page_dir, virt, phys, cow_flags);
-
-				paging_protect_range(
-				    parent->page_dir, virt, 1, cow_flags);
-			}
+		if (!paging_share_range(child->page_dir,
+		                        parent->page_dir,
+		                        current->virt_start,
+		                        num_pages)) {
+			vmm_destroy_address_space(child);
+			return NULL;
 		}
 
 		current->cow = true;
-
-		current = current->next;
 	}
 
 	child->brk = parent->brk;
@@ -255,9 +531,9 @@ vmm_switch_address_space(vmm_address_space_t *space)
 		return;
 	}
 
+	/* Each space has its own PCID, so the CR3 load needs no flush */
 	paging_switch_directory(space->page_dir);
 	current_space = space;
-	vmm_flush_tlb_all();
 }
 
 vmm_address_space_t *
@@ -286,58 +562,19 @@ vmm_alloc(vmm_address_space_t *space, size_t size)
 		return NULL;
 	}
 
-	vmm_region_t *check = space->regions;
-	while (check != NULL) {
-		if (!(virt_addr + size <= check->virt_start ||
-		      virt_addr >= check->virt_end)) {
-			return NULL;
-		}
-		check = check->next;
+	if (!vmm_range_is_free(space, virt_addr, size)) {
+		return NULL;
 	}
 
 	size_t num_pages = size / PAGE_SIZE;
+	uint64_t flags = PAGE_PRESENT | PAGE_WRITE;
 
-	for (size_t i = 0; i < num_pages; i++) {
-		void *phys_page = pmm_alloc();
-		if (phys_page == NULL) {
-			for (size_t j = 0; j < i; j++) {
-				uint64_t virt = virt_addr + (j * PAGE_SIZE);
-				uint64_t phys = mmu_get_physical_address(
-				    space->page_dir, virt);
-				if (phys != 0) {
-					mmu_unmap_page(space->page_dir, virt);
-					void *virt = mmu_phys_to_virt(phys);
-					pmm_free(virt);
-				}
-			}
-			return NULL;
-		}
-
-		memset(phys_page, 0, PAGE_SIZE);
-
-		uint64_t phys = mmu_virt_to_phys(phys_page);
-		uint64_t flags = PAGE_PRESENT | PAGE_WRITE;
-
-		if (space != kernel_space) {
-			flags |= PAGE_USER;
-		}
+	if (space != kernel_space) {
+		flags |= PAGE_USER;
+	}
 
-		if (!mmu_map_page(space->page_dir,
-		                  virt_addr + (i * PAGE_SIZE),
-		                  phys,
-		                  flags)) {
-			pmm_free(phys_page);
-			for (size_t j = 0; j < i; j++) {
-				uint64_t virt = virt_addr + (j * PAGE_SIZE);
-				uint64_t phys_addr = mmu_get_physical_address(
-				    space->page_dir, virt);
-				if (phys_addr != 0) {
-					mmu_unmap_page(space->page_dir, virt);
-					pmm_free((void *)phys_addr);
-				}
-			}
-			return NULL;
-		}
+	if (!paging_alloc_range(space->page_dir, virt_addr, num_pages, flags)) {
+		return NULL;
 	}
 
 	if (virt_addr == space->brk) {
@@ -376,40 +613,8 @@ vmm_alloc_at(vmm_address_space_t *space,
 	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 	size_t num_pages = size / PAGE_SIZE;
 
-	for (size_t i = 0; i < num_pages; i++) {
-		void *phys_page = pmm_alloc();
-		if (phys_page == NULL) {
-			for (size_t j = 0; j < i; j++) {
-				uint64_t virt = virt_addr + (j * PAGE_SIZE);
-				uint64_t phys = mmu_get_physical_address(
-				    space->page_dir, virt);
-				if (phys != 0) {
-					mmu_unmap_page(space->page_dir, virt);
-					pmm_free(mmu_phys_to_virt(phys));
-				}
-			}
-			return NULL;
-		}
-
-		memset(phys_page, 0, PAGE_SIZE);
-
-		uint64_t phys = mmu_virt_to_phys(phys_page);
-		if (!mmu_map_page(space->page_dir,
-		                  virt_addr + (i * PAGE_SIZE),
-		                  phys,
-		                  flags)) {
-			pmm_free(phys_page);
-			for (size_t j = 0; j < i; j++) {
-				uint64_t virt = virt_addr + (j * PAGE_SIZE);
-				uint64_t phys_addr = mmu_get_physical_address(
-				    space->page_dir, virt);
-				if (phys_addr != 0) {
-					mmu_unmap_page(space->page_dir, virt);
-					pmm_free((void *)phys_addr);
-				}
-			}
-			return NULL;
-		}
+	if (!paging_alloc_pages(space->page_dir, virt_addr, num_pages, flags)) {
+		return NULL;
 	}
 
 	if (stats.used_pages + num_pages >=
@@ -432,15 +637,7 @@ vmm_free(vmm_address_space_t *space, void *ptr, size_t size)
 	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 	size_t num_pages = size / PAGE_SIZE;
 
-	for (size_t i = 0; i < num_pages; i++) {
-		uint64_t virt = virt_addr + (i * PAGE_SIZE);
-		uint64_t phys = mmu_get_physical_address(space->page_dir, virt);
-
-		if (phys != 0) {
-			mmu_unmap_page(space->page_dir, virt);
-			pmm_free((void *)phys);
-		}
-	}
+	paging_unmap_free_range(space->page_dir, virt_addr, num_pages);
 
 	if (stats.used_pages >= num_pages) {
 		stats.used_pages -= num_pages;
@@ -467,20 +664,8 @@ vmm_map_region(vmm_address_space_t *space,
 	uint64_t flags = paging_get_flags_for_region_type((region_type_t)type);
 	size_t num_pages = size / PAGE_SIZE;
 
-	for (size_t i = 0; i < num_pages; i++) {
-		void *phys_page = pmm_alloc();
-		if (phys_page == NULL) {
-			return false;
-		}
-
-		uint64_t phys = mmu_virt_to_phys(phys_page);
-		if (!mmu_map_page(space->page_dir,
-		                  virt_start + (i * PAGE_SIZE),
-		                  phys,
-		                  flags)) {
-			pmm_free(phys_page);
-			return false;
-		}
+	if (!paging_alloc_pages(space->page_dir, virt_start, num_pages, flags)) {
+		return false;
 	}
 
 	vmm_region_t *region =
@@ -531,11 +716,138 @@ vmm_protect_region(vmm_address_space_t *space,
 	virt_start &= ~(PAGE_SIZE - 1);
 	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 	size_t num_pages = size / PAGE_SIZE;
+	uint64_t virt_end = virt_start + size;
+
+	/* Pages not faulted in yet take the new flags from their region */
+	vmm_region_t *region = vmm_region_above(space, virt_start);
+	while (region != NULL && region->virt_start < virt_end) {
+		if (region->virt_start < virt_start) {
+			region = vmm_split_region(space, region, virt_start);
+			if (region == NULL) {
+				return false;
+			}
+		}
+
+		if (region->virt_end > virt_end &&
+		    vmm_split_region(space, region, virt_end) == NULL) {
+			return false;
+		}
+
+		region->flags = flags;
+		region = vmm_next_region(vmm_merge_region(space, region));
+	}
 
 	return paging_protect_range(
 	    space->page_dir, virt_start, num_pages, flags);
 }
 
+/*
+ * Set aside [virt_start, virt_start + size) as anonymous memory without
+ * backing it.  vmm_handle_page_fault() supplies each page on first touch.
+ * A reservation that continues a compatible one extends it instead, so a
+ * growing heap stays one region.
+ */
+bool
+vmm_reserve_region(vmm_address_space_t *space,
+                   uint64_t virt_start,
+                   size_t size,
+                   vmm_region_type_t type,
+                   uint64_t flags)
+{
+	if (space == NULL || size == 0) {
+		return false;
+	}
+
+	virt_start &= ~(PAGE_SIZE - 1);
+	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	uint64_t virt_end = virt_start + size;
+
+	if (!vmm_range_is_free(space, virt_start, size)) {
+		return false;
+	}
+
+	vmm_region_t *region =
+	    vmm_create_region(virt_start, virt_end, type, flags);
+	if (region == NULL) {
+		return false;
+	}
+
+	region->anon = true;
+	if (!vmm_add_region(space, region)) {
+		vmm_free_region(region);
+		return false;
+	}
+
+	vmm_merge_region(space, region);
+	return true;
+}
+
+/*
+ * Unmap and free whatever is mapped in the range and drop it from the
+ * regions, trimming or splitting those that only partly overlap.
+ */
+bool
+vmm_release_range(vmm_address_space_t *space,
+                  uint64_t virt_start,
+                  size_t size)
+{
+	if (space == NULL || size == 0) {
+		return false;
+	}
+
+	virt_start &= ~(PAGE_SIZE - 1);
+	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	uint64_t virt_end = virt_start + size;
+
+	paging_unmap_free_range(space->page_dir, virt_start, size / PAGE_SIZE);
+
+	vmm_region_t *region = vmm_region_above(space, virt_start);
+	while (region != NULL && region->virt_start < virt_end) {
+		vmm_region_t *next = vmm_next_region(region);
+
+		if (region->virt_start < virt_start) {
+			if (region->virt_end > virt_end &&
+			    vmm_split_region(space, region, virt_end) == NULL) {
+				return false;
+			}
+			region->virt_end = virt_start;
+			vmm_region_resized(space, region);
+		} else if (region->virt_end > virt_end) {
+			region->virt_start = virt_end;
+			vmm_region_resized(space, region);
+			break;
+		} else {
+			vmm_unlink_region(space, region);
+		}
+
+		region = next;
+	}
+
+	return true;
+}
+
+/* Give dst a copy of the regions of src, for fork() */
+bool
+vmm_copy_regions(vmm_address_space_t *dst, vmm_address_space_t *src)
+{
+	if (dst == NULL || src == NULL) {
+		return false;
+	}
+
+	for (vmm_region_t *region = vmm_first_region(src); region != NULL;
+	     region = vmm_next_region(region)) {
+		vmm_region_t *copy = vmm_dup_region(region);
+		if (copy == NULL) {
+			return false;
+		}
+		vmm_add_region(dst, copy);
+	}
+
+	dst->brk = src->brk;
+
+	return true;
+}
+
 void *
 vmm_sbrk(vmm_address_space_t *space, intptr_t increment)
 {
@@ -577,79 +889,169 @@ vmm_sbrk(vmm_address_space_t *space, intptr_t increment)
 	return (void *)old_brk;
 }
 
-void
-vmm_handle_page_fault(uint64_t fault_addr, uint64_t error_code)
+/* A page for fault resolution, from the reserve once the PMM runs dry */
+static void *
+vmm_fault_alloc(bool zero)
 {
-	stats.page_faults++;
+	if (zero) {
+		void *page = pmm_alloc_zeroed();
+		if (page != NULL) {
+			return page;
+		}
+	}
 
-	vmm_address_space_t *space = current_space;
-	if (space == NULL) {
-		serial_printf(DEBUG_PORT,
-		              "Page fault in NULL address space at 0x%p\n",
-		              (void *)fault_addr);
-		return;
+	void *page = fault_pool != NULL
+	                 ? mempool_alloc(fault_pool, KMALLOC_ATOMIC)
+	                 : pmm_alloc();
+	if (page != NULL && zero) {
+		memset(page, 0, PAGE_SIZE);
 	}
 
+	return page;
+}
+
+/* The space whose PML4 is in CR3, NULL unless vmm created it */
+static vmm_address_space_t *
+vmm_active_space(void)
+{
+	page_directory_t active;
+	mmu_get_active_directory(&active);
+
+	struct page *page = phys_to_page(active.phys_addr);
+	return page != NULL ? (vmm_address_space_t *)page->owner : NULL;
+}
+
+/*
+ * Fill in a missing page of an anonymous region.  Reads map the shared
+ * zero page copy-on-write, so only pages that get written cost a frame.
+ */
+static bool
+vmm_demand_fault(uint64_t fault_addr, uint64_t error_code)
+{
+	vmm_address_space_t *space = vmm_active_space();
 	vmm_region_t *region = vmm_find_region(space, fault_addr);
-	if (region == NULL) {
-		serial_printf(
-		    DEBUG_PORT,
-		    "Page fault at unmapped address 0x%p (error: 0x%p)\n",
-		    (void *)fault_addr,
-		    (void *)error_code);
-		return;
+	if (region == NULL || !region->anon ||
+	    !(region->flags & PAGE_PRESENT)) {
+		return false;
 	}
 
-	if (region->cow && (error_code & 0x2)) {
-		uint64_t page_addr = fault_addr & ~(PAGE_SIZE - 1);
+	bool write = (error_code & VMM_PF_WRITE) != 0;
+	if (write && !(region->flags & PAGE_WRITE)) {
+		return false;
+	}
 
-		uint64_t old_phys =
-		    mmu_get_physical_address(space->page_dir, page_addr);
-		if (old_phys == 0) {
-			serial_printf(DEBUG_PORT,
-			              "COW fault but page not mapped at 0x%p\n",
-			              (void *)fault_addr);
-			return;
+	uint64_t page_addr = fault_addr & ~(PAGE_SIZE - 1);
+
+	if (!write && zero_page != NULL) {
+		uint64_t flags = region->flags & ~PAGE_WRITE;
+		if (region->flags & PAGE_WRITE) {
+			flags |= PAGE_COW;
 		}
 
-		void *new_page = pmm_alloc();
-		if (new_page == NULL) {
-			serial_printf(
-			    DEBUG_PORT,
-			    "Failed to allocate page for COW at 0x%p\n",
-			    (void *)fault_addr);
-			return;
+		if (!mmu_map_page(
+		        space->page_dir, page_addr, zero_page_phys, flags)) {
+			return false;
 		}
 
-		void *old_virt = mmu_phys_to_virt(old_phys);
-		memcpy(new_page, old_virt, PAGE_SIZE);
+		page_get(virt_to_page(zero_page));
+		stats.zero_page_maps++;
+		return true;
+	}
+
+	void *page = vmm_fault_alloc(true);
+	if (page == NULL) {
+		serial_printf(DEBUG_PORT,
+		              "Failed to allocate page for fault at 0x%p\n",
+		              (void *)fault_addr);
+		return false;
+	}
+
+	if (!mmu_map_page(space->page_dir,
+	                  page_addr,
+	                  mmu_virt_to_phys(page),
+	                  region->flags)) {
+		pmm_free(page);
+		return false;
+	}
 
-		mmu_unmap_page(space->page_dir, page_addr);
+	stats.demand_faults++;
+	return true;
+}
 
-		uint64_t new_flags = region->flags | PAGE_WRITE;
-		uint64_t new_phys = mmu_virt_to_phys(new_page);
-		if (!mmu_map_page(
-		        space->page_dir, page_addr, new_phys, new_flags)) {
-			serial_printf(DEBUG_PORT,
-			              "Failed to remap COW page at 0x%p\n",
-			              (void *)fault_addr);
-			pmm_free(new_page);
-			return;
-		}
-		size_t region_pages =
-		    (region->virt_end - region->virt_start) / PAGE_SIZE;
+/*
+ * Resolve a write to a PAGE_COW entry of the address space in CR3.  The
+ * last address space holding the frame just gets write access back;
+ * otherwise the page is copied and this space drops its reference.
+ */
+static bool
+vmm_resolve_cow(uint64_t fault_addr)
+{
+	page_directory_t active;
+	mmu_get_active_directory(&active);
+
+	uint64_t page_addr = fault_addr & ~(PAGE_SIZE - 1);
+	pte_t *pte = mmu_get_pte(&active, page_addr);
+	if (pte == NULL ||
+	    (*pte & (PAGE_PRESENT | PAGE_COW)) != (PAGE_PRESENT | PAGE_COW)) {
+		return false;
+	}
+
+	uint64_t old_phys = *pte & PAGE_ADDR_MASK;
+	uint64_t new_flags = (*pte & ~(PAGE_ADDR_MASK | PAGE_COW)) | PAGE_WRITE;
+	struct page *page = phys_to_page(old_phys);
 
+	if (page != NULL && page_refcount(page) == 1) {
+		page->flags &= ~PG_COW;
+		*pte = old_phys | new_flags;
 		vmm_flush_tlb(page_addr);
+		stats.cow_reuses++;
+		return true;
+	}
 
+	bool from_zero = (old_phys == zero_page_phys);
+	void *new_page = vmm_fault_alloc(from_zero);
+	if (new_page == NULL) {
 		serial_printf(DEBUG_PORT,
-		              "COW page fault resolved at 0x%p\n",
+		              "Failed to allocate page for COW at 0x%p\n",
 		              (void *)fault_addr);
-	} else {
-		serial_printf(DEBUG_PORT,
-		              "Unhandled page fault at 0x%p (error: 0x%p)\n",
-		              (void *)fault_addr,
-		              (void *)error_code);
+		return false;
+	}
+
+	if (!from_zero) {
+		memcpy(new_page, mmu_phys_to_virt(old_phys), PAGE_SIZE);
+	}
+
+	mmu_set_leaf(pte, mmu_virt_to_phys(new_page) | new_flags, PAGE_SIZE);
+	vmm_flush_tlb(page_addr);
+	stats.cow_copies++;
+
+	/* Drops this space's reference, the other sharers keep the frame */
+	pmm_free(mmu_phys_to_virt(old_phys));
+
+	return true;
+}
+
+bool
+vmm_handle_page_fault(uint64_t fault_addr, uint64_t error_code)
+{
+	stats.page_faults++;
+
+	if (!(error_code & VMM_PF_PRESENT) &&
+	    vmm_demand_fault(fault_addr, error_code)) {
+		return true;
+	}
+
+	if ((error_code & (VMM_PF_PRESENT | VMM_PF_WRITE)) ==
+	        (VMM_PF_PRESENT | VMM_PF_WRITE) &&
+	    vmm_resolve_cow(fault_addr)) {
+		return true;
 	}
+
+	serial_printf(DEBUG_PORT,
+	              "Unhandled page fault at 0x%p (error: 0x%p)\n",
+	              (void *)fault_addr,
+	              (void *)error_code);
+	return false;
 }
 
 void
@@ -688,18 +1090,19 @@ vmm_dump_regions(vmm_address_space_t *space)
 	serial_printf(DEBUG_PORT, "BRK: 0x%p\n", (void *)space->brk);
 	serial_printf(DEBUG_PORT, "\nRegions:\n");
 
-	vmm_region_t *current = space->regions;
+	vmm_region_t *current = vmm_first_region(space);
 	int count = 0;
 
 	while (current != NULL) {
 		serial_printf(DEBUG_PORT,
-		              "  [%d] 0x%p - 0x%p (type=%d, cow=%d)\n",
+		              "  [%d] 0x%p - 0x%p (type=%d, cow=%d, anon=%d)\n",
 		              count++,
 		              (void *)current->virt_start,
 		              (void *)current->virt_end,
 		              current->type,
-		              current->cow);
-		current = current->next;
+		              current->cow,
+		              current->anon);
+		current = vmm_next_region(current);
 	}
 
 	serial_printf(DEBUG_PORT, "\nStats:\n");
@@ -707,5 +1110,13 @@ vmm_dump_regions(vmm_address_space_t *space)
 	serial_printf(DEBUG_PORT, "  Used pages: %llu\n", stats.used_pages);
 	serial_printf(DEBUG_PORT, "  Page faults: %llu\n", stats.page_faults);
 	serial_printf(DEBUG_PORT, "  TLB flushes: %llu\n", stats.tlb_flushes);
+	serial_printf(DEBUG_PORT,
+	              "  COW faults: %llu copied, %llu reused\n",
+	              stats.cow_copies,
+	              stats.cow_reuses);
+	serial_printf(DEBUG_PORT,
+	              "  Demand faults: %llu allocated, %llu zero page\n",
+	              stats.demand_faults,
+	              stats.zero_page_maps);
 	serial_printf(DEBUG_PORT, "==============================\n\n");
 }
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include <pmm.h>
 #include <paging.h>
 #include <mmu.h>
+#include <vmm.h>
 #include <printf.h>
 #include <boot.h>
 #include <limine.h>
@@ -266,44 +267,56 @@ elf_validate(const void *elf_data, size_t size)
 	return true;
 }
 
-/* Write data to virtual memory through physical mapping */
+struct vm_write {
+	uint64_t start;
+	uint64_t end;
+	uint64_t next; /* First byte not written yet */
+	const uint8_t *data;
+};
+
 static bool
-write_to_virtual_memory(struct process *ps,
-                        uint64_t virt_addr,
-                        const uint8_t *data,
-                        size_t size,
-                        bool zero_fill)
+write_mapped_page(uint64_t virt, uint64_t *entry, uint64_t size, void *arg)
 {
-	for (size_t off = 0; off < size; off += NBPG) {
-		uint64_t virt_page = (virt_addr + off) & PAGE_MASK;
+	struct vm_write *w = arg;
 
-		/* Get physical address of this page */
-		uint64_t phys_page =
-		    mmu_get_physical_address(ps->ps_vmspace, virt_page);
-		if (phys_page == 0) {
-			serial_printf(DEBUG_PORT,
-			              "ERROR: Failed to get phys for virt=0x%lx\n",
-			              virt_page);
-			return false;
-		}
+	/* A page below this mapping was never mapped */
+	if (virt > w->next) {
+		return false;
+	}
 
-		/* Calculate parameters for this page */
-		size_t page_offset = (virt_addr + off) & PGOFSET;
-		size_t bytes_in_page = NBPG - page_offset;
-		if (off + bytes_in_page > size) {
-			bytes_in_page = size - off;
-		}
+	uint64_t to = virt + size < w->end ? virt + size : w->end;
+	uint64_t phys =
+	    (*entry & PAGE_ADDR_MASK & ~(size - 1)) + (w->next - virt);
+	uint8_t *dest = (uint8_t *)(phys + hhdm_offset);
 
-		/* Map to virtual address via HHDM */
-		uint64_t phys_addr = (phys_page & PAGE_MASK) + page_offset;
-		uint8_t *dest = (uint8_t *)(phys_addr + hhdm_offset);
+	memcpy(dest, w->data + (w->next - w->start), to - w->next);
 
-		/* Copy or zero the data */
-		if (zero_fill) {
-			memset(dest, 0, bytes_in_page);
-		} else {
-			memcpy(dest, data + off, bytes_in_page);
-		}
+	w->next = to;
+	return true;
+}
+
+/* Write data to virtual memory through physical mapping */
+static bool
+write_to_virtual_memory(struct process *ps,
+                        uint64_t virt_addr,
+                        const uint8_t *data,
+                        size_t size)
+{
+	struct vm_write w = {
+		.start = virt_addr,
+		.end = virt_addr + size,
+		.next = virt_addr,
+		.data = data,
+	};
+
+	/* One walk down the page tables for the whole range */
+	if (!mmu_walk_range(
+	        ps->ps_vmspace, w.start, w.end, write_mapped_page, &w) ||
+	    w.next < w.end) {
+		serial_printf(DEBUG_PORT,
+		              "ERROR: Failed to get phys for virt=0x%lx\n",
+		              w.next & PAGE_MASK);
+		return false;
 	}
 
 	return true;
@@ -320,20 +333,8 @@ cleanup_elf_load(struct process *ps, struct elf_load_state *state)
 		              state->stack_base,
 		              state->stack_pages);
 
-		paging_unmap_range(ps->ps_vmspace,
-		                   state->stack_base,
-		                   state->stack_pages);
-
-		/* Free physical pages */
-		for (size_t i = 0; i < state->stack_pages; i++) {
-			uint64_t virt_page = state->stack_base + (i * NBPG);
-			uint64_t phys =
-			    mmu_get_physical_address(ps->ps_vmspace, virt_page);
-			if (phys != 0) {
-				void *phys_virt = (void *)(phys + hhdm_offset);
-				pmm_free(phys_virt);
-			}
-		}
+		vmm_release_range(
+		    ps->ps_vm, state->stack_base, state->stack_pages * NBPG);
 	}
 
 	/* Clean up segment allocations */
@@ -347,21 +348,9 @@ cleanup_elf_load(struct process *ps, struct elf_load_state *state)
 		              state->segments[i].virt_start,
 		              state->segments[i].num_pages);
 
-		paging_unmap_range(ps->ps_vmspace,
-		                   state->segments[i].virt_start,
-		                   state->segments[i].num_pages);
-
-		/* Free physical pages */
-		for (size_t j = 0; j < state->segments[i].num_pages; j++) {
-			uint64_t virt_page =
-			    state->segments[i].virt_start + (j * NBPG);
-			uint64_t phys =
-			    mmu_get_physical_address(ps->ps_vmspace, virt_page);
-			if (phys != 0) {
-				void *phys_virt = (void *)(phys + hhdm_offset);
-				pmm_free(phys_virt);
-			}
-		}
+		vmm_release_range(ps->ps_vm,
+		                  state->segments[i].virt_start,
+		                  state->segments[i].num_pages * NBPG);
 	}
 }
 
@@ -377,44 +366,23 @@ allocate_user_stack(struct process *ps,
 
 	uint64_t stack_base = USER_STACK_TOP - (stack_pages * NBPG);
 
-	printf_("ELF: Allocating user stack: 0x%lx - 0x%lx (%lu pages, %lu KB)\n",
+	printf_("ELF: Reserving user stack: 0x%lx - 0x%lx (%lu pages, %lu KB)\n",
 	        stack_base,
 	        USER_STACK_TOP,
 	        stack_pages,
 	        (stack_pages * NBPG) / 1024);
 
-	/* Allocate and map stack pages */
 	uint64_t page_flags =
 	    PAGING_FLAG_PRESENT | PAGING_FLAG_WRITE | PAGING_FLAG_USER;
 
-	for (size_t i = 0; i < stack_pages; i++) {
-		uint64_t virt_page = stack_base + (i * NBPG);
-
-		/* Allocate physical page */
-		void *page_virt = pmm_alloc();
-		if (page_virt == NULL) {
-			printf_("ELF: Failed to allocate stack page %lu\n", i);
-			return false;
-		}
-
-		/* Convert to physical address */
-		uint64_t phys_page = (uint64_t)page_virt - hhdm_offset;
-
-		/* Map the page */
-		if (!paging_map_range(ps->ps_vmspace,
-		                      virt_page,
-		                      phys_page,
-		                      1,
-		                      page_flags)) {
-			printf_("ELF: Failed to map stack page at 0x%lx\n",
-			        virt_page);
-			pmm_free(page_virt);
-			return false;
-		}
-
-		/* Zero the stack page */
-		uint8_t *page_data = (uint8_t *)page_virt;
-		memset(page_data, 0, NBPG);
+	/* Demand-zero, only the pages the program touches get frames */
+	if (!vmm_reserve_region(ps->ps_vm,
+	                        stack_base,
+	                        stack_pages * NBPG,
+	                        VMM_REGION_USER_STACK,
+	                        page_flags)) {
+		printf_("ELF: Failed to reserve user stack\n");
+		return false;
 	}
 
 	state->stack_allocated = true;
@@ -528,40 +496,43 @@ elf_load(struct process *ps,
 			page_flags |= PAGING_FLAG_NX;
 		}
 
-		/* Allocate and map pages */
-		for (size_t j = 0; j < num_pages; j++) {
-			uint64_t virt_page = virt_start + (j * NBPG);
-
-			/* Allocate physical page */
-			void *page_virt = pmm_alloc();
-			if (page_virt == NULL) {
-				printf_("ELF: Failed to allocate page %lu of segment %d\n",
-				        j,
-				        i);
-				cleanup_elf_load(ps, &state);
-				return false;
-			}
+		/* Only the pages holding file data need frames up front */
+		uint64_t file_end = virt_start;
+		if (phdr->p_filesz > 0) {
+			file_end =
+			    (phdr->p_vaddr + phdr->p_filesz + PGOFSET) & PAGE_MASK;
+		}
 
-			/* Convert to physical address */
-			uint64_t phys_page = (uint64_t)page_virt - hhdm_offset;
-
-			/* Map the page */
-			if (!paging_map_range(ps->ps_vmspace,
-			                      virt_page,
-			                      phys_page,
-			                      1,
-			                      page_flags)) {
-				printf_("ELF: Failed to map page at 0x%lx\n",
-				        virt_page);
-				pmm_free(page_virt);
-				cleanup_elf_load(ps, &state);
-				return false;
-			}
+		/* Allocate and map pages */
+		if (file_end > virt_start &&
+		    !paging_alloc_pages(ps->ps_vmspace,
+		                        virt_start,
+		                        (file_end - virt_start) / NBPG,
+		                        page_flags)) {
+			printf_("ELF: Failed to allocate pages of segment %d\n",
+			        i);
+			cleanup_elf_load(ps, &state);
+			return false;
 		}
 
 		/* Mark segment as allocated */
 		state.segments[seg_idx].allocated = true;
 
+		/*
+		 * The rest of the BSS is demand-zero: reads map the shared
+		 * zero page and the first write copies it to a private frame.
+		 */
+		if (file_end < virt_end &&
+		    !vmm_reserve_region(ps->ps_vm,
+		                        file_end,
+		                        virt_end - file_end,
+		                        VMM_REGION_USER_DATA,
+		                        page_flags)) {
+			printf_("ELF: Failed to reserve BSS of segment %d\n", i);
+			cleanup_elf_load(ps, &state);
+			return false;
+		}
+
 		/* Copy segment data from file */
 		if (phdr->p_filesz > 0) {
 			const uint8_t *src =
@@ -575,34 +546,17 @@ elf_load(struct process *ps,
 			if (!write_to_virtual_memory(ps,
 			                             phdr->p_vaddr,
 			                             src,
-			                             phdr->p_filesz,
-			                             false)) {
+			                             phdr->p_filesz)) {
 				printf_("ELF: Failed to copy segment %d data\n", i);
 				cleanup_elf_load(ps, &state);
 				return false;
 			}
 		}
 
-		/* Zero out BSS (uninitialized data) */
-		if (phdr->p_memsz > phdr->p_filesz) {
-			size_t zero_size = phdr->p_memsz - phdr->p_filesz;
-			uint64_t zero_start = phdr->p_vaddr + phdr->p_filesz;
-
-			serial_printf(DEBUG_PORT,
-			              "  Zeroing %lu bytes at vaddr=0x%lx (BSS)\n",
-			              (unsigned long)zero_size,
-			              zero_start);
-
-			if (!write_to_virtual_memory(ps,
-			                             zero_start,
-			                             NULL,
-			                             zero_size,
-			                             true)) {
-				printf_("ELF: Failed to zero BSS in segment %d\n", i);
-				cleanup_elf_load(ps, &state);
-				return false;
-			}
-		}
+		/*
+		 * No BSS pass: the tail of the last file page was zeroed with
+		 * its frame and the pages after it fault in as zero.
+		 */
 	}
 
 	/* Set program break for heap */
@@ -12,7 +12,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <scheduler.h>
-#include <paging.h>
+#include <vmm.h>
 
 #define MAX_OPEN_FILES 32
 
@@ -99,7 +99,8 @@ struct process {
 	LIST_ENTRY(process) ps_hash;      /* [H] Hash chain */
 
 	/* Memory management */
-	page_directory_t *ps_vmspace; /* [L] Address space */
+	vmm_address_space_t *ps_vm;   /* [L] Regions of the address space */
+	page_directory_t *ps_vmspace; /* [L] Address space, ps_vm->page_dir */
 	uint64_t ps_strings;          /* [L] User pointers to argv/env */
 	uint64_t ps_brk;              /* [L] Program break for heap */
 
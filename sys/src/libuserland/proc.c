@@ -36,6 +36,9 @@ static spinlock_t allproc_lock = SPINLOCK_INITIALIZER("allproc");
 static spinlock_t pidhash_lock = SPINLOCK_INITIALIZER("pidhash");
 static spinlock_t tidhash_lock = SPINLOCK_INITIALIZER("tidhash");
 
+static kmem_cache_t *process_cache;
+static kmem_cache_t *proc_cache;
+
 static pid_t
 allocpid(void)
 {
@@ -79,8 +82,13 @@ proc_init(void)
 	pidhashtbl = kmalloc((pidhash + 1) * sizeof(struct pidhashhead));
 	tidhashtbl = kmalloc((tidhash + 1) * sizeof(struct tidhashhead));
 
-	if (!pidhashtbl || !tidhashtbl) {
-		printf_("FATAL: Failed to allocate process hash tables\n");
+	process_cache = kmem_cache_create(
+	    "process", sizeof(struct process), KMEM_CACHE_LINE, NULL, NULL);
+	proc_cache = kmem_cache_create(
+	    "proc", sizeof(struct proc), KMEM_CACHE_LINE, NULL, NULL);
+
+	if (!pidhashtbl || !tidhashtbl || !process_cache || !proc_cache) {
+		printf_("FATAL: Failed to allocate process tables\n");
 		if (pidhashtbl)
 			kfree(pidhashtbl);
 		if (tidhashtbl)
@@ -104,7 +112,7 @@ process_alloc(const char *name)
 {
 	struct process *ps;
 
-	ps = kmalloc(sizeof(struct process));
+	ps = kmem_cache_alloc(process_cache, 0);
 	if (!ps) {
 		printf_("Failed to allocate process structure\n");
 		return NULL;
@@ -133,12 +141,13 @@ process_alloc(const char *name)
 	LIST_INIT(&ps->ps_children);
 
 	/* Create address space */
-	ps->ps_vmspace = paging_create_user_address_space();
-	if (!ps->ps_vmspace) {
+	ps->ps_vm = vmm_create_address_space(false);
+	if (!ps->ps_vm) {
 		printf_("Failed to create address space\n");
-		kfree(ps);
+		kmem_cache_free(process_cache, ps);
 		return NULL;
 	}
+	ps->ps_vmspace = ps->ps_vm->page_dir;
 
 	/* Set initial flags */
 	ps->ps_flags = PS_EMBRYO;
@@ -185,12 +194,12 @@ process_free(struct process *ps)
 	spinlock_release(&pidhash_lock);
 
 	/* Free address space */
-	if (ps->ps_vmspace) {
+	if (ps->ps_vm) {
 		paging_free_user_pages(ps->ps_vmspace);
-		mmu_destroy_address_space(ps->ps_vmspace);
+		vmm_destroy_address_space(ps->ps_vm);
 	}
 
-	kfree(ps);
+	kmem_cache_free(process_cache, ps);
 }
 
 struct proc *
@@ -203,7 +212,7 @@ proc_alloc(struct process *ps, const char *name)
 		return NULL;
 	}
 
-	p = kmalloc(sizeof(struct proc));
+	p = kmem_cache_alloc(proc_cache, 0);
 	if (!p) {
 		printf_("Failed to allocate thread structure\n");
 		return NULL;
@@ -230,7 +239,7 @@ proc_alloc(struct process *ps, const char *name)
 	p->p_kstack = kmalloc(PROCESS_KERNEL_STACK_SIZE);
 	if (!p->p_kstack) {
 		printf_("Failed to allocate kernel stack\n");
-		kfree(p);
+		kmem_cache_free(proc_cache, p);
 		return NULL;
 	}
 
@@ -327,7 +336,7 @@ proc_free(struct proc *p)
 		kfree(p->p_kstack);
 	}
 
-	kfree(p);
+	kmem_cache_free(proc_cache, p);
 }
 
 struct process *
@@ -419,8 +428,8 @@ proc_enter_usermode(struct proc *p, uint64_t entry_point, uint64_t stack_top)
 	uint64_t user_ss = GDT_SELECTOR_USER_DATA;
 	uint64_t rflags = 0x202; /* IF=1, Reserved bit */
 
-	/* Get physical address of user page directory */
-	uint64_t user_cr3 = ps->ps_vmspace->phys_addr;
+	/* CR3 value for the user page directory, tagged with its ASID */
+	uint64_t user_cr3 = mmu_activate(ps->ps_vmspace);
 
 	/* Switch to user mode using iretq */
 	asm volatile("cli\n"
@@ -496,7 +505,7 @@ proc_fork_child_entry(void *arg)
 	proc_set_current(p);
 	p->p_stat = SONPROC;
 
-	uint64_t user_cr3 = ps->ps_vmspace->phys_addr;
+	uint64_t user_cr3 = mmu_activate(ps->ps_vmspace);
 	/* Cast to uint64_t to force 64-bit registers for pushq */
 	uint64_t user_data_sel = GDT_SELECTOR_USER_DATA;
 	uint64_t user_code_sel = GDT_SELECTOR_USER_CODE;